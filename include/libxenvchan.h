@@ -57,8 +57,15 @@ extern "C" {
 #endif
 
 struct libxenvchan_ring {
-    /* Pointer into the shared page. Offsets into buffer. */
-    struct ring_shared* shr;
+    /**
+     * The consumer and producer indexes, offsets into buffer: in the shared
+     * page, or in the index page once their writer has moved them there.
+     */
+    uint32_t *cons, *prod;
+    /* the lines of this ring in the index page, until both indexes use them */
+    struct vchan_index_ring *split;
+    /* this side's and the peer's line for this ring, once in use */
+    struct vchan_index_line *own_line, *peer_line;
     /* ring data; may be its own shared page(s) depending on order */
     void *buffer;
     /**
@@ -67,6 +74,185 @@ struct libxenvchan_ring {
      * in the shared page to remain constant.
      */
     int order;
+    /* server only: directory pages listing the data page grants of rings
+     * too large to list in the shared page */
+    void *grant_dir;
+    /* live resize: the ring offered to replace this one */
+    void *next_buffer, *next_grant_dir;
+    int next_order;
+    /* live resize (server only): the replaced ring, until the peer is off it */
+    void *prev_buffer, *prev_grant_dir;
+    int prev_order;
+    /* live resize (producer only): waiting for the consumer to switch */
+    int switching;
+    /* live resize: true while a peek or reservation points into buffer */
+    int mapped;
+    /**
+     * Wakes the thread blocked on this ring when a notification meant for it
+     * was taken off the shared event by the thread blocked on the other one.
+     * seen is the peer's index of this ring, and seen_wakeups the vchan's
+     * wakeups, as of the last look at how much data or space there is.
+     */
+    HANDLE wakeup;
+    volatile LONG waiting;
+    uint32_t seen;
+    LONG seen_wakeups;
+    /**
+     * Notification moderation of the index this side moves in the ring
+     * (wr_prod of the write ring, rd_cons of the read ring): the bytes held
+     * back since pending_since, and the timer that signals them once
+     * notify_usec have passed. Both are only changed with interlocked
+     * operations, as the timer and the thread using the other ring take
+     * them too.
+     */
+    volatile LONG pending;
+    volatile LONG64 pending_since;
+    PTP_TIMER notify_timer;
+};
+
+/**
+ * struct libxenvchan_iovec: one contiguous piece of a buffer, used by the
+ * scatter-gather and zero-copy interfaces
+ */
+struct libxenvchan_iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+
+/**
+ * struct libxenvchan_stats: per-vchan counters, see libxenvchan_get_stats().
+ * They are updated with interlocked operations, so none are lost when a
+ * reader, a writer (or several multi-producer senders) and the moderation
+ * timers use the vchan at once; a snapshot taken meanwhile is not consistent
+ * across counters.
+ */
+struct libxenvchan_stats {
+    /* data published to and consumed from the rings */
+    uint64_t bytes_sent, bytes_received;
+    /* index updates: one per send or receive call, batch or publish/commit */
+    uint64_t sends, recvs;
+    /* index updates that signalled the peer, and those it didn't ask for */
+    uint64_t notifies_sent, notifies_skipped;
+    /* calls to libxenvchan_wait(), and wakeups with no progress by the peer */
+    uint64_t waits, spurious_wakeups;
+    /* times a writer found too little space, or a reader too little data */
+    uint64_t ring_full, ring_empty;
+    /* highest occupancy seen in the send and receive rings, in bytes */
+    uint32_t max_write_fill, max_read_fill;
+};
+
+/**
+ * Latency histograms are log-linear: values below 2^LIBXENVCHAN_HIST_SUB_BITS
+ * get a bucket each, and every power of two above that is split into
+ * 2^LIBXENVCHAN_HIST_SUB_BITS buckets, so any value is within 12.5% of its
+ * bucket's lower bound. Values are in nanoseconds.
+ */
+#define LIBXENVCHAN_HIST_SUB_BITS 3
+#define LIBXENVCHAN_HIST_BUCKETS ((64 - LIBXENVCHAN_HIST_SUB_BITS + 1) << LIBXENVCHAN_HIST_SUB_BITS)
+
+struct libxenvchan_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min, max;
+    uint64_t buckets[LIBXENVCHAN_HIST_BUCKETS];
+};
+
+/**
+ * struct libxenvchan_histograms: latency distributions of a vchan, see
+ * libxenvchan_enable_histograms()
+ */
+struct libxenvchan_histograms {
+    /* time blocked in libxenvchan_wait() */
+    struct libxenvchan_hist wait;
+    /* time spent in event channel notify calls */
+    struct libxenvchan_hist notify;
+    /**
+     * time from publishing data until the peer had consumed it, sampled one
+     * publish at a time and measured by the writer on its own clock when it
+     * next looks at the ring, since the peer's clock can't be compared
+     */
+    struct libxenvchan_hist gap;
+};
+
+/* Events recorded by the trace ring, see libxenvchan_trace_enable() */
+#define LIBXENVCHAN_TRACE_WR_PROD  1 /* published data; value is the new wr_prod */
+#define LIBXENVCHAN_TRACE_RD_CONS  2 /* consumed data; value is the new rd_cons */
+#define LIBXENVCHAN_TRACE_REQUEST  3 /* set notify bit arg; value is rd_prod or wr_cons */
+#define LIBXENVCHAN_TRACE_NOTIFY   4 /* signalled the peer for notify bit arg */
+#define LIBXENVCHAN_TRACE_SKIP     5 /* didn't signal, notify bit arg was clear */
+#define LIBXENVCHAN_TRACE_WAIT     6 /* started waiting; value is rd_prod */
+#define LIBXENVCHAN_TRACE_WAKE     7 /* woke up; value is rd_prod, arg 1 if spurious */
+
+/**
+ * struct libxenvchan_trace_entry: one event of the trace ring. The timestamp
+ * is the raw time stamp counter; the header of a dump gives its frequency.
+ */
+struct libxenvchan_trace_entry {
+    uint64_t tsc;
+    uint32_t value;
+    /**
+     * In a dump, the low bits of the event's sequence number, so that events
+     * missing between two entries (torn, or overwritten while the dump was
+     * taken) can be spotted. In the ring itself, the number of times it had
+     * wrapped when the event was recorded.
+     */
+    uint16_t seq;
+    uint8_t type;
+    uint8_t arg;
+};
+
+#define LIBXENVCHAN_TRACE_MAGIC   0x52544356 /* "VCTR" */
+#define LIBXENVCHAN_TRACE_VERSION 1
+
+/**
+ * struct libxenvchan_trace_header: start of a trace dump, followed by
+ * $count entries, oldest first
+ */
+struct libxenvchan_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    /* time stamp counter ticks per second */
+    uint64_t tsc_freq;
+    /* number of events recorded since the trace was enabled */
+    uint64_t recorded;
+    uint32_t count;
+    uint32_t is_server;
+    /* ring sizes when the dump was taken */
+    uint32_t read_size, write_size;
+};
+
+struct libxenvchan_trace;
+
+/**
+ * struct libxenvchan_backend: the services a vchan is built on. Each member
+ * has the signature and return codes of the xencontrol call it stands in for
+ * (XcOpen, XcEvtchnBindUnbound, XcGnttabPermitForeignAccess, ...). The Xen
+ * backend passes them straight to xencontrol; other backends, such as the
+ * loopback backend, provide the same services without a hypervisor.
+ */
+struct libxenvchan_backend {
+    const char *name;
+    DWORD (*open)(XENCONTROL_LOGGER *logger, PXENCONTROL_CONTEXT *xc);
+    void (*close)(PXENCONTROL_CONTEXT xc);
+    /* event channels; the port signals event when the peer notifies it */
+    DWORD (*evtchn_bind_unbound)(PXENCONTROL_CONTEXT xc, USHORT domain, HANDLE event, BOOL mask, ULONG *port);
+    DWORD (*evtchn_bind_interdomain)(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG remote_port, HANDLE event,
+                                     BOOL mask, ULONG *local_port);
+    DWORD (*evtchn_notify)(PXENCONTROL_CONTEXT xc, ULONG port);
+    DWORD (*evtchn_close)(PXENCONTROL_CONTEXT xc, ULONG port);
+    /* shared pages */
+    DWORD (*gnttab_grant)(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG notify_offset, ULONG notify_port,
+                          XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address, ULONG *refs);
+    DWORD (*gnttab_revoke)(PXENCONTROL_CONTEXT xc, PVOID address);
+    DWORD (*gnttab_map)(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG *refs, ULONG notify_offset,
+                        ULONG notify_port, XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address);
+    DWORD (*gnttab_unmap)(PXENCONTROL_CONTEXT xc, PVOID address);
+    /* the store that connection details are published in */
+    DWORD (*store_read)(PXENCONTROL_CONTEXT xc, const CHAR *path, DWORD size, CHAR *value);
+    DWORD (*store_write)(PXENCONTROL_CONTEXT xc, const CHAR *path, const CHAR *value);
+    DWORD (*store_remove)(PXENCONTROL_CONTEXT xc, const CHAR *path);
+    DWORD (*store_set_permissions)(PXENCONTROL_CONTEXT xc, const CHAR *path, ULONG count,
+                                   PXENIFACE_STORE_PERMISSION perms);
 };
 
 /**
@@ -81,14 +267,79 @@ struct libxenvchan {
     uint32_t event_port;
     /* event to wait on */
     HANDLE event;
+    /* number of times a waiting thread has taken a notification off event */
+    volatile LONG wakeups;
+    /* set on every notification taken off event, for a reactor watching the vchan */
+    HANDLE volatile reactor_wakeup;
     /* informative flags: are we acting as server? */
     int is_server;
     /* true if server remains active when client closes (allows reconnection) */
     int server_persist;
     /* true if operations should block instead of returning 0 */
     int blocking;
+    /* true if write notifications are held back until libxenvchan_uncork() */
+    int corked;
+    /**
+     * Upper bound (in microseconds) on polling the ring indexes in
+     * libxenvchan_wait() before sleeping on the event; 0 disables polling.
+     * The time actually spent is tuned per vchan in spin_budget, based on
+     * how long recent waits took to be satisfied.
+     */
+    int spin_usec;
+    int spin_budget;
+    /* true if libxenvchan_wait() never sleeps, see libxenvchan_set_busy_poll() */
+    int busy_poll;
+    /**
+     * Multi-producer sends, see libxenvchan_set_multi_producer(). mp_reserve
+     * holds the ring index up to which space is handed out and, above it,
+     * the ticket of the next send; sends publish in ticket order through
+     * mp_slots, from mp_next on. mp_lock serializes the sends that find the
+     * ring full.
+     */
+    int multi_producer;
+    volatile LONG64 mp_reserve;
+    volatile LONG mp_publishing;
+    uint32_t mp_next;
+    struct libxenvchan_mp_slot *mp_slots;
+    SRWLOCK mp_lock;
+    /**
+     * Notification moderation, set with libxenvchan_set_notify_policy():
+     * index updates are signalled to the peer once notify_bytes have been
+     * written or consumed, or once notify_usec have passed since the first
+     * update that was held back. Both 0 (the default) signals every update.
+     */
+    int notify_bytes;
+    int notify_usec;
+    /* how much a blocking read waits for, see libxenvchan_set_read_watermark() */
+    int read_watermark;
+    /* how much space a blocking write waits for, see libxenvchan_set_write_watermark() */
+    int write_watermark;
+    struct libxenvchan_stats stats;
+    /* latency histograms, or NULL if not enabled */
+    struct libxenvchan_histograms *hist;
+    /* memory behind hist, kept until close as threads may still record into it */
+    struct libxenvchan_histograms *hist_buf;
+    /* publish being timed for the gap histogram (if gap_start is set) */
+    uint32_t gap_idx;
+    uint64_t gap_start;
+    /* trace ring of index transitions, or NULL if not enabled */
+    struct libxenvchan_trace *trace;
+    /* trace rings no longer in use, which threads may still record into */
+    struct libxenvchan_trace *trace_retired;
+    /* queued asynchronous operations, or NULL if not attached to an engine */
+    struct libxenvchan_async_vchan *async;
     /* communication rings */
     struct libxenvchan_ring read, write;
+    /* live resize control page, or NULL if the peer can't resize */
+    struct vchan_resize *resize;
+    /* version 2 index page, or NULL if the peer doesn't use one */
+    struct vchan_indexes *indexes;
+    /* peer domain, for granting or mapping resized rings */
+    USHORT domain;
+    /* services used by this vchan; xc is a context opened by it */
+    const struct libxenvchan_backend *backend;
+    /* store directory a server published itself in, removed on close */
+    char *xs_path;
 };
 
 /*
@@ -99,6 +350,28 @@ after the first reboot after pvdrivers installation, xeniface takes
 a while to load).
 */
 
+/** The backend that uses xencontrol, and through it the Xen hypervisor */
+XENVCHAN_API
+const struct libxenvchan_backend *libxenvchan_xen_backend(void);
+
+/**
+ * The loopback backend: shared pages are named file mappings, event channels
+ * link two events and the store is a table in a named section, so the ends
+ * of a vchan can be in the same process or in two processes of one session.
+ * Domain numbers are ignored; it is meant for testing and profiling without
+ * a hypervisor.
+ */
+XENVCHAN_API
+const struct libxenvchan_backend *libxenvchan_loopback_backend(void);
+
+/**
+ * Select the backend used by vchans set up from now on; vchans that are
+ * already set up keep theirs.
+ * @param backend The backend, or NULL for the Xen backend (the default)
+ */
+XENVCHAN_API
+void libxenvchan_set_backend(const struct libxenvchan_backend *backend);
+
 /**
  * Set up a vchan, including granting pages
  * @param logger Logger for libxc errors
@@ -127,7 +400,8 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
 /**
  * Close a vchan. This deallocates the vchan and attempts to free its
  * resources. The other side is notified of the close, but can still read any
- * data pending prior to the close.
+ * data pending prior to the close. A server also removes what it published
+ * under its xs_path, so that later clients don't find a stale vchan.
  */
 XENVCHAN_API
 void libxenvchan_close(struct libxenvchan *ctrl);
@@ -175,7 +449,307 @@ XENVCHAN_API
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
 
 /**
- * Waits for reads or writes to unblock, or for a close
+ * Packet-based scatter-gather send: send all segments if possible. The data
+ * is published to the peer with a single index update and notification.
+ * @param ctrl The vchan control structure
+ * @param iov Array of buffers to send, in order
+ * @param iovcnt Number of elements in iov
+ * @return -1 on error, 0 if nonblocking and insufficient space is available,
+ *         or the total size of all segments
+ */
+XENVCHAN_API
+int libxenvchan_sendv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt);
+
+/**
+ * Stream-based scatter-gather send: send as much data as possible, with one
+ * index update and notification for each chunk that fits in the ring.
+ * @param ctrl The vchan control structure
+ * @param iov Array of buffers to send, in order
+ * @param iovcnt Number of elements in iov
+ * @return -1 on error, otherwise the amount of data sent (which may be zero if
+ *         the vchan is nonblocking)
+ */
+XENVCHAN_API
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt);
+
+/**
+ * Packet-based scatter-gather receive: always fills all segments.
+ * @param ctrl The vchan control structure
+ * @param iov Array of buffers to fill, in order
+ * @param iovcnt Number of elements in iov
+ * @return -1 on error, 0 if nonblocking and insufficient data is available,
+ *         or the total size of all segments
+ */
+XENVCHAN_API
+int libxenvchan_recvv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt);
+
+/**
+ * Stream-based scatter-gather receive: reads as much data as possible,
+ * filling the segments in order.
+ * @param ctrl The vchan control structure
+ * @param iov Array of buffers to fill, in order
+ * @param iovcnt Number of elements in iov
+ * @return -1 on error, otherwise the amount of data read (which may be zero if
+ *         the vchan is nonblocking)
+ */
+XENVCHAN_API
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt);
+
+/**
+ * Zero-copy receive: map the data that is ready to read, without consuming it.
+ * Data that wraps around the end of the ring is described by two segments.
+ * A resize of the receive ring does not switch buffers until the data is
+ * consumed.
+ * @param ctrl The vchan control structure
+ * @param iov Filled with up to two segments pointing into the receive ring;
+ *        unused segments have iov_len 0. The memory must not be modified.
+ * @return -1 on error, otherwise the amount of data mapped (which may be zero if
+ *         the vchan is nonblocking)
+ */
+XENVCHAN_API
+int libxenvchan_read_peek(struct libxenvchan *ctrl, struct libxenvchan_iovec iov[2]);
+
+/**
+ * Consume data previously mapped by libxenvchan_read_peek() and notify the
+ * peer once. Segments returned by the peek are invalid after this call.
+ * @param ctrl The vchan control structure
+ * @param size Amount of data to consume; must not exceed the amount mapped
+ * @return -1 on error, or $size
+ */
+XENVCHAN_API
+int libxenvchan_read_commit(struct libxenvchan *ctrl, size_t size);
+
+/**
+ * Zero-copy send: reserve space in the send ring so that data can be built
+ * in place. Space that wraps around the end of the ring is described by two
+ * segments. Nothing is visible to the peer until libxenvchan_write_publish(),
+ * and a resize of the send ring does not switch buffers until then.
+ * @param ctrl The vchan control structure
+ * @param size Amount of space to reserve
+ * @param iov Filled with up to two writable segments inside the send ring;
+ *        unused segments have iov_len 0
+ * @return -1 on error, 0 if nonblocking and insufficient space is available, or $size
+ */
+XENVCHAN_API
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size, struct libxenvchan_iovec iov[2]);
+
+/**
+ * Make data written into space from libxenvchan_write_reserve() visible to
+ * the peer and notify it once.
+ * @param ctrl The vchan control structure
+ * @param size Amount of data to publish; must not exceed the amount reserved
+ * @return -1 on error, or $size
+ */
+XENVCHAN_API
+int libxenvchan_write_publish(struct libxenvchan *ctrl, size_t size);
+
+/**
+ * Hold back write notifications: data written while corked is made visible
+ * to the peer as usual, but the peer is not signalled until
+ * libxenvchan_uncork(), or until the writer has to wait for buffer space.
+ */
+XENVCHAN_API
+void libxenvchan_cork(struct libxenvchan *ctrl);
+
+/**
+ * Stop holding back write notifications and signal the peer once for
+ * everything written while corked.
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_uncork(struct libxenvchan *ctrl);
+
+/**
+ * Set the notification moderation policy: signal the peer only after $bytes
+ * have been written or consumed, or $usec after the first update that was
+ * held back, whichever comes first. Anything held back is also signalled
+ * before the vchan waits. The deadline is kept by a thread pool timer, so
+ * it is only as precise as the system timer.
+ * @param ctrl The vchan control structure
+ * @param bytes Byte threshold, or 0 for no threshold
+ * @param usec Deadline in microseconds; 0 with a byte threshold selects 1ms
+ * @return -1 on error, 0 on success. Passing 0 for both restores the default
+ *         of signalling every update.
+ */
+XENVCHAN_API
+int libxenvchan_set_notify_policy(struct libxenvchan *ctrl, int bytes, int usec);
+
+/**
+ * Set how much data a blocking read waits for. libxenvchan_read() and
+ * libxenvchan_readv() then return once min($bytes, size) bytes are ready
+ * instead of as soon as any are, and the threshold is published to the
+ * writer, which on the version 2 index layout only signals once it is
+ * reached. libxenvchan_recv() always waits for the size it is given.
+ * libxenvchan_data_ready() and libxenvchan_poll() use the threshold to
+ * decide when to signal, but still report any data that is ready.
+ * @param ctrl The vchan control structure
+ * @param bytes Threshold in bytes, or 0 for the default of 1
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_set_read_watermark(struct libxenvchan *ctrl, int bytes);
+
+/**
+ * Set how much free space a blocking write waits for. libxenvchan_write()
+ * and libxenvchan_writev() then copy in chunks of at least min($bytes,
+ * remaining size) instead of whatever space has been freed, and the
+ * threshold is published to the reader, which on the version 2 index layout
+ * only signals once that much space is free. libxenvchan_send() always
+ * waits for the size it is given. libxenvchan_buffer_space() and
+ * libxenvchan_poll() use the threshold to decide when to signal, but still
+ * report any space that is free.
+ * @param ctrl The vchan control structure
+ * @param bytes Threshold in bytes, or 0 for the default of 1
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_set_write_watermark(struct libxenvchan *ctrl, int bytes);
+
+/**
+ * Switch busy polling on or off. While it is on, this side never asks the
+ * peer for notifications and libxenvchan_wait() spins on the ring indexes
+ * with pause hints instead of sleeping on the event, so it burns a core for
+ * the lowest possible latency. Notifications the peer asks for are still
+ * sent; once both sides poll, no event channel traffic is left. The mode can
+ * be switched at any time, also while another thread waits. The event
+ * returned by libxenvchan_fd_for_select() does not fire for a polling vchan.
+ * @param ctrl The vchan control structure
+ * @param enable Nonzero to poll, 0 to go back to waiting on the event
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_set_busy_poll(struct libxenvchan *ctrl, int enable);
+
+/**
+ * Let any number of threads call libxenvchan_send() and libxenvchan_sendv()
+ * on the vchan at the same time. Each send reserves its space in the ring
+ * with an atomic operation and copies its data in parallel with the others;
+ * the data is published in the order the space was reserved, and one index
+ * update and notification covers every send that completed meanwhile. Sends
+ * that find the ring full, or a resize under way, take turns instead. Other
+ * write calls must not run concurrently with these, but may be used in
+ * between them. Only switch the mode while no write is in progress.
+ * @param ctrl The vchan control structure
+ * @param enable Nonzero for multi-producer sends, 0 for a single writer
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_set_multi_producer(struct libxenvchan *ctrl, int enable);
+
+/**
+ * Read the counters of a vchan. They are always on, and cost a few
+ * increments per operation.
+ * @param ctrl The vchan control structure
+ * @param stats Filled with a copy of the counters
+ */
+XENVCHAN_API
+void libxenvchan_get_stats(struct libxenvchan *ctrl, struct libxenvchan_stats *stats);
+
+/**
+ * Reset all counters of a vchan to 0.
+ */
+XENVCHAN_API
+void libxenvchan_reset_stats(struct libxenvchan *ctrl);
+
+/**
+ * Turn latency histograms on or off. They cost two timestamps per wait,
+ * notify call and sampled publish while on. libxenvchan_reset_stats() also
+ * clears them. Other threads may keep using the vchan meanwhile; the memory
+ * is only released by libxenvchan_close().
+ * @param ctrl The vchan control structure
+ * @param enable Nonzero to start recording (from empty histograms), 0 to stop
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_enable_histograms(struct libxenvchan *ctrl, int enable);
+
+/**
+ * Take a snapshot of the latency histograms of a vchan.
+ * @param ctrl The vchan control structure
+ * @param hist Filled with a copy of the histograms
+ * @return -1 if histograms are not enabled, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_get_histograms(struct libxenvchan *ctrl, struct libxenvchan_histograms *hist);
+
+/**
+ * Add the histograms in $src to those in $dst, to aggregate snapshots of
+ * many vchans. $dst may start out zeroed.
+ */
+XENVCHAN_API
+void libxenvchan_merge_histograms(struct libxenvchan_histograms *dst, const struct libxenvchan_histograms *src);
+
+/**
+ * Value at a percentile of a histogram.
+ * @param hist The histogram
+ * @param percentile Between 0 and 100
+ * @return Lower bound of the bucket holding the value (in nanoseconds), or 0
+ *         if the histogram is empty
+ */
+XENVCHAN_API
+uint64_t libxenvchan_hist_percentile(const struct libxenvchan_hist *hist, double percentile);
+
+/**
+ * Turn the trace ring on or off. While on, every index update, notify bit
+ * request, notification decision and wait is recorded with a time stamp
+ * counter value into a fixed-size ring that overwrites its oldest entries,
+ * for post-mortem analysis of a stalled or slow vchan. Recording takes a few
+ * nanoseconds and is safe from any number of threads. Other threads may
+ * keep using the vchan meanwhile, so rings that are replaced or turned off
+ * are only freed by libxenvchan_close().
+ * @param ctrl The vchan control structure
+ * @param entries Number of events to keep, rounded up to a power of two, or
+ *        0 to stop tracing
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_trace_enable(struct libxenvchan *ctrl, size_t entries);
+
+/**
+ * Copy the trace ring into a buffer, as a struct libxenvchan_trace_header
+ * followed by the entries it holds, oldest first. Tracing carries on; events
+ * recorded during the copy may be missing from it, which the entry numbers
+ * show. The dump can be saved to a file and turned into a timeline with the
+ * xenvchan-trace tool, which marks such gaps.
+ * @param ctrl The vchan control structure
+ * @param buf Buffer for the dump, or NULL to get the size needed. If it is
+ *        too small for all entries, the newest ones that fit are kept.
+ * @param size Size of the buffer
+ * @return -1 on error (including if tracing is not enabled or the buffer
+ *         can't hold the header), otherwise the size of the dump in bytes
+ */
+XENVCHAN_API
+int libxenvchan_trace_dump(struct libxenvchan *ctrl, void *buf, size_t size);
+
+/**
+ * Resize the rings of a connected vchan, without losing data or ordering.
+ * This only starts the resize: the switch happens as both sides keep using
+ * the vchan, once the peer has drained the old ring, and libxenvchan_wait()
+ * may return early for the steps in between. Reads and writes move the
+ * resize of their own ring along; libxenvchan_wait() and libxenvchan_poll()
+ * (and so the reactor) move both along, which keeps it going on a side that
+ * is otherwise idle. Sizes are rounded up to a power of two of at least one
+ * page. Blocking sends larger than a shrunk ring fail, as they would on a
+ * vchan created with that size.
+ * @param ctrl The vchan control structure
+ * @param read_min The minimum size (in bytes) of the receive ring, or 0 to keep it
+ * @param write_min The minimum size (in bytes) of the send ring, or 0 to keep it
+ * @return -1 on error (including if the peer does not support resizing or a
+ *         resize of the same ring is in progress), 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_resize(struct libxenvchan *ctrl, size_t read_min, size_t write_min);
+
+/**
+ * Waits for reads or writes to unblock, or for a close. If spin_usec is set,
+ * the ring indexes are polled for a short adaptive period first. In busy
+ * poll mode it only polls, and may return without anything having changed.
+ *
+ * The blocking reads and writes wait for their own ring instead, so one
+ * thread reading and another writing the same vchan at the same time is
+ * supported: a notification taken by one of them is passed on to the other
+ * when the index it waits for has moved. Any other concurrent use of a vchan
+ * needs locking by the caller.
  */
 XENVCHAN_API
 int libxenvchan_wait(struct libxenvchan *ctrl);
@@ -205,6 +779,299 @@ int libxenvchan_data_ready(struct libxenvchan *ctrl);
 XENVCHAN_API
 int libxenvchan_buffer_space(struct libxenvchan *ctrl);
 
+/**
+ * struct libxenvchan_msg: one message for libxenvchan_send_batch() and
+ * libxenvchan_recv_batch()
+ */
+struct libxenvchan_msg {
+    /* message data to send, or buffer to receive into */
+    void *buf;
+    /* size of the message to send, or of the receive buffer */
+    size_t size;
+    /* received message length; greater than size if it was truncated */
+    size_t len;
+};
+
+/**
+ * Framed send: send one message, which the peer receives whole with
+ * libxenvchan_recv_msg(). Messages that do not fit in the ring are split
+ * into fragments; once the first fragment is sent, the rest of the message
+ * is sent even if the vchan is nonblocking.
+ * @param ctrl The vchan control structure
+ * @param data Message to send
+ * @param size Size of the message
+ * @return -1 on error, 0 if nonblocking and insufficient space is available, or $size
+ */
+XENVCHAN_API
+int libxenvchan_send_msg(struct libxenvchan *ctrl, const void *data, size_t size);
+
+/**
+ * Framed receive: receive one message sent with libxenvchan_send_msg(),
+ * reassembling it if it was fragmented. If the buffer is too small, the
+ * message is truncated and the rest of it is discarded.
+ * @param ctrl The vchan control structure
+ * @param data Buffer for the message
+ * @param size Size of the buffer
+ * @return -1 on error, 0 if nonblocking and no complete message is available
+ *         (or if the message is empty), or the length of the message (greater
+ *         than $size if it was truncated)
+ */
+XENVCHAN_API
+int libxenvchan_recv_msg(struct libxenvchan *ctrl, void *data, size_t size);
+
+/**
+ * Framed batch send: send several messages, publishing all of them that fit
+ * in the ring with one index update and signalling the peer once.
+ * @param ctrl The vchan control structure
+ * @param msgs Messages to send (buf and size are used)
+ * @param count Number of messages
+ * @return -1 on error if nothing was sent, otherwise the number of messages sent
+ *         (which may be less than $count if the vchan is nonblocking)
+ */
+XENVCHAN_API
+int libxenvchan_send_batch(struct libxenvchan *ctrl, struct libxenvchan_msg *msgs, int count);
+
+/**
+ * Framed batch receive: receive all complete messages that are ready, up to
+ * $count, consuming them with one index update. If blocking, waits for at
+ * least one message.
+ * @param ctrl The vchan control structure
+ * @param msgs Buffers to receive into (buf and size are used, len is set)
+ * @param count Number of buffers
+ * @return -1 on error, otherwise the number of messages received (which may
+ *         be zero if the vchan is nonblocking)
+ */
+XENVCHAN_API
+int libxenvchan_recv_batch(struct libxenvchan *ctrl, struct libxenvchan_msg *msgs, int count);
+
+/* Readiness events reported by libxenvchan_poll() and the reactor */
+#define LIBXENVCHAN_READABLE 0x1
+#define LIBXENVCHAN_WRITABLE 0x2
+#define LIBXENVCHAN_CLOSED   0x4
+
+/**
+ * Evaluate the readiness of a vchan in one pass: whether data is ready to
+ * read, whether buffer space is available and whether the peer has closed.
+ * Notifications are requested for any interest that is not yet satisfied, so
+ * the event returned by libxenvchan_fd_for_select() fires when it changes.
+ * @param ctrl The vchan control structure
+ * @param interest Mask of LIBXENVCHAN_READABLE and LIBXENVCHAN_WRITABLE
+ * @return Mask of the interesting events that are ready, plus
+ *         LIBXENVCHAN_CLOSED if the vchan is no longer open
+ */
+XENVCHAN_API
+int libxenvchan_poll(struct libxenvchan *ctrl, int interest);
+
+struct libxenvchan_reactor;
+struct libxenvchan_reactor_entry;
+
+/**
+ * Reactor callback: invoked from a reactor worker thread when a registered
+ * vchan is ready. Callbacks for one vchan never run concurrently.
+ * @param ctrl The vchan that is ready
+ * @param events Mask of ready events (see libxenvchan_poll())
+ * @param context Context passed to libxenvchan_reactor_add()
+ */
+typedef void libxenvchan_reactor_cb(struct libxenvchan *ctrl, int events, void *context);
+
+/**
+ * Create a reactor that waits on any number of vchans and dispatches
+ * readiness callbacks from a small pool of worker threads.
+ * @param threads Maximum number of worker threads, or 0 for one per processor
+ * @return The reactor, or NULL in case of an error
+ */
+XENVCHAN_API
+struct libxenvchan_reactor *libxenvchan_reactor_create(int threads);
+
+/**
+ * Destroy a reactor, removing all vchans still registered with it. The
+ * vchans themselves are not closed. Must not be called from a callback.
+ */
+XENVCHAN_API
+void libxenvchan_reactor_destroy(struct libxenvchan_reactor *reactor);
+
+/**
+ * Register a vchan with a reactor. Readiness is level-triggered: the callback
+ * is invoked again as long as an interesting event stays ready, so it should
+ * consume data until the vchan would block, and drop LIBXENVCHAN_WRITABLE
+ * from the interest while it has nothing to send. LIBXENVCHAN_CLOSED is
+ * always reported, once. The vchan should be nonblocking, and can only be
+ * registered with one reactor at a time. Threads blocked in reads or writes
+ * on the vchan and the reactor pass notifications on to each other, so none
+ * are lost; libxenvchan_wait() must not be used on it while registered.
+ * @param reactor The reactor
+ * @param ctrl The vchan to watch
+ * @param interest Mask of LIBXENVCHAN_READABLE and LIBXENVCHAN_WRITABLE
+ * @param callback Function called when the vchan is ready
+ * @param context Passed to callback
+ * @return Registration handle, or NULL in case of an error
+ */
+XENVCHAN_API
+struct libxenvchan_reactor_entry *libxenvchan_reactor_add(struct libxenvchan_reactor *reactor, struct libxenvchan *ctrl,
+                                                          int interest, libxenvchan_reactor_cb *callback, void *context);
+
+/**
+ * Change the events a registered vchan is watched for. May be called from
+ * the vchan's own callback; an interest of 0 suspends the registration.
+ */
+XENVCHAN_API
+void libxenvchan_reactor_modify(struct libxenvchan_reactor_entry *entry, int interest);
+
+/**
+ * Unregister a vchan, waiting for any callback in progress to finish. Must
+ * not be called from the vchan's own callback.
+ */
+XENVCHAN_API
+void libxenvchan_reactor_remove(struct libxenvchan_reactor_entry *entry);
+
+struct libxenvchan_async;
+
+/**
+ * Completion callback of an asynchronous operation, invoked from an engine
+ * worker thread. Completions of one vchan are delivered one at a time, in
+ * the order the operations finish; reads and writes each finish in the
+ * order they were queued.
+ * @param ctrl The vchan the operation was queued on
+ * @param result Number of bytes transferred, or -1 if the operation failed
+ *        or was cancelled (including by the peer closing the vchan)
+ * @param context Context passed with the operation
+ */
+typedef void libxenvchan_async_cb(struct libxenvchan *ctrl, int result, void *context);
+
+/**
+ * Create an engine that drives asynchronous reads and writes on any number
+ * of vchans from a fixed pool of worker threads, using a reactor.
+ * Operations queued without a callback complete by posting to $port with
+ * PostQueuedCompletionStatus(): the number of bytes transferred is the
+ * result ((DWORD)-1 on failure), the completion key is the vchan and the
+ * OVERLAPPED pointer is the operation's context.
+ * @param threads Maximum number of worker threads, or 0 for one per processor
+ * @param port I/O completion port for completions, or NULL to only use callbacks
+ * @return The engine, or NULL in case of an error
+ */
+XENVCHAN_API
+struct libxenvchan_async *libxenvchan_async_create(int threads, HANDLE port);
+
+/**
+ * Destroy an engine, detaching all vchans still attached to it. Must not be
+ * called from a completion callback.
+ */
+XENVCHAN_API
+void libxenvchan_async_destroy(struct libxenvchan_async *engine);
+
+/**
+ * Attach a vchan to an engine, so that asynchronous operations can be queued
+ * on it. The vchan is made nonblocking until it is detached and must not be
+ * read, written or waited on elsewhere while it is attached.
+ * @return -1 on error, 0 on success
+ */
+XENVCHAN_API
+int libxenvchan_async_attach(struct libxenvchan_async *engine, struct libxenvchan *ctrl);
+
+/**
+ * Detach a vchan from its engine, completing any operations still queued
+ * with -1, and give it back the blocking mode it had when attached. The
+ * vchan itself is not closed. Must not be called from a completion callback
+ * of the same vchan.
+ */
+XENVCHAN_API
+void libxenvchan_async_detach(struct libxenvchan *ctrl);
+
+/**
+ * Queue a read, which completes once some data, at most $size bytes, has
+ * been read into $data (as libxenvchan_read() on a blocking vchan would).
+ * $data must stay valid until the operation completes.
+ * @param ctrl The vchan control structure, attached to an engine
+ * @param data Buffer to read into
+ * @param size Size of the buffer
+ * @param callback Called on completion, or NULL to post to the engine's port
+ * @param context Passed to callback, or the OVERLAPPED pointer of the posted completion
+ * @return -1 on error (including if the vchan is closed), 0 if the read was queued
+ */
+XENVCHAN_API
+int libxenvchan_read_async(struct libxenvchan *ctrl, void *data, size_t size,
+                           libxenvchan_async_cb *callback, void *context);
+
+/**
+ * Queue a write, which completes once all $size bytes of $data have been
+ * written to the ring (as libxenvchan_write() on a blocking vchan would).
+ * Writes are copied in the order they were queued, and $data must stay
+ * valid until the operation completes.
+ * @param ctrl The vchan control structure, attached to an engine
+ * @param data Data to write
+ * @param size Size of the data
+ * @param callback Called on completion, or NULL to post to the engine's port
+ * @param context Passed to callback, or the OVERLAPPED pointer of the posted completion
+ * @return -1 on error (including if the vchan is closed), 0 if the write was queued
+ */
+XENVCHAN_API
+int libxenvchan_write_async(struct libxenvchan *ctrl, const void *data, size_t size,
+                            libxenvchan_async_cb *callback, void *context);
+
+struct libxenvchan_mq;
+
+/* largest number of queues of a multi-queue vchan */
+#define LIBXENVCHAN_MAX_QUEUES 64
+
+/**
+ * Set up a multi-queue vchan: $queues independent vchans, each with its own
+ * rings and event channel, published under $xs_path/queue-N. The number of
+ * queues is published last, as $xs_path/queues. Each queue can be used from
+ * its own thread without any locking between queues.
+ * @param logger Logger for libxc errors
+ * @param domain The peer domain that will be connecting
+ * @param xs_path Base xenstore path for storing queue data
+ * @param queues Number of queues, at most LIBXENVCHAN_MAX_QUEUES
+ * @param read_min The minimum size (in bytes) of the receive ring of each queue
+ * @param write_min The minimum size (in bytes) of the send ring of each queue
+ * @return The structure, or NULL in case of an error (including if the path
+ *         of a queue is too long)
+ */
+XENVCHAN_API
+struct libxenvchan_mq *libxenvchan_mq_server_init(XENCONTROL_LOGGER *logger, int domain, const char *xs_path,
+                                                  int queues, size_t read_min, size_t write_min);
+
+/**
+ * Connect to all queues of an existing multi-queue vchan.
+ * @param logger Logger for libxc errors
+ * @param domain The peer domain to connect to
+ * @param xs_path Base xenstore path for storing queue data
+ * @return The structure, or NULL in case of an error
+ */
+XENVCHAN_API
+struct libxenvchan_mq *libxenvchan_mq_client_init(XENCONTROL_LOGGER *logger, int domain, const char *xs_path);
+
+/**
+ * Close all queues of a multi-queue vchan and free it. A server removes the
+ * published queue count before closing the queues.
+ */
+XENVCHAN_API
+void libxenvchan_mq_close(struct libxenvchan_mq *mq);
+
+/** Number of queues of a multi-queue vchan */
+XENVCHAN_API
+int libxenvchan_mq_num_queues(struct libxenvchan_mq *mq);
+
+/**
+ * Caller-chosen queue selection.
+ * @return The vchan of queue $index, or NULL if there is no such queue
+ */
+XENVCHAN_API
+struct libxenvchan *libxenvchan_mq_queue(struct libxenvchan_mq *mq, int index);
+
+/**
+ * Hash-based queue selection: the same key always selects the same queue, so
+ * traffic for one flow stays in order. Both sides select the same queue for
+ * the same key.
+ * @param mq The multi-queue vchan
+ * @param key Flow key to hash, or NULL to hash the calling thread's id, which
+ *        gives each thread a queue of its own while there are enough queues
+ * @param len Size of the key
+ * @return The vchan of the selected queue
+ */
+XENVCHAN_API
+struct libxenvchan *libxenvchan_mq_select(struct libxenvchan_mq *mq, const void *key, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
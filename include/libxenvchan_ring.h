@@ -52,6 +52,14 @@ struct ring_shared {
 #define VCHAN_NOTIFY_WRITE 0x1
 #define VCHAN_NOTIFY_READ 0x2
 
+/**
+ * Framed messages: each fragment in the ring is preceded by a 32-bit header
+ * holding the fragment length. VCHAN_MSG_MORE is set on every fragment of a
+ * message except the last one.
+ */
+#define VCHAN_MSG_MORE 0x80000000u
+#define VCHAN_MSG_LEN_MASK 0x7fffffffu
+
 /**
  * vchan_interface: primary shared data structure
  */
@@ -67,7 +75,11 @@ struct vchan_interface {
 	 * 10   - at offset 1024 in ring's page
 	 * 11   - at offset 2048 in ring's page
 	 * 12+  - uses 2^(N-12) grants to describe the multi-page ring
-	 * These should remain constant once the page is shared.
+	 * 21+  - uses 2^(N-22) grants (rounded up) of directory pages, each
+	 *        listing up to 1024 grants of the multi-page ring; only used
+	 *        if the server sets "indirect-grants" in XenStore
+	 * These should remain constant once the page is shared, except that the
+	 * server updates them when a live resize completes (see vchan_resize).
 	 * Only one of the two orders can be 10 (or 11).
 	 */
 	uint16_t left_order, right_order;
@@ -89,7 +101,103 @@ struct vchan_interface {
 	 * Grant list: ordering is left, right. Must not extend into actual ring
 	 * or grow beyond the end of the initial shared page.
 	 * These should remain constant once the page is shared, to allow
-	 * for possible remapping by a client that restarts.
+	 * for possible remapping by a client that restarts; a live resize
+	 * rewrites them for the same reason.
 	 */
 	uint32_t grants[0];
 };
+
+/**
+ * Live ring resize: each transition is made by one side only, and the state
+ * only moves forward from VCHAN_RESIZE_IDLE and back to it.
+ */
+#define VCHAN_RESIZE_IDLE      0 /* no resize in progress */
+#define VCHAN_RESIZE_OFFERED   1 /* server: new ring granted, order and grants are valid */
+#define VCHAN_RESIZE_MAPPED    2 /* client: new ring mapped */
+#define VCHAN_RESIZE_SWITCHING 3 /* producer: data from switch_idx on goes to the new ring */
+#define VCHAN_RESIZE_SWITCHED  4 /* consumer: old ring drained, reading from the new ring */
+#define VCHAN_RESIZE_FAILED    5 /* client: could not map the new ring */
+
+/* enough for a directly granted ring of 2^20 bytes */
+#define VCHAN_RESIZE_MAX_GRANTS 256
+
+struct vchan_resize_ring {
+	/* VCHAN_RESIZE_*; the server returns it to IDLE once the old ring is released */
+	uint8_t state;
+	uint8_t pad;
+	/* order asked for by either side, picked up by the server when IDLE */
+	uint16_t req_order;
+	/* order of the new ring, same encoding as in vchan_interface */
+	uint16_t order;
+	uint16_t pad2;
+	/* producer index at which the new ring takes over */
+	uint32_t switch_idx;
+	/* grants of the new ring (or of its directory pages) */
+	uint32_t grants[VCHAN_RESIZE_MAX_GRANTS];
+};
+
+/**
+ * vchan_resize: control page for resizing the rings of a connected vchan.
+ * It is granted by the server and advertised in XenStore as "resize-ref".
+ * Once the new ring of a resize has been mapped by both sides, the producer
+ * stops writing at switch_idx, the consumer drains the old ring up to it and
+ * then both continue with the same indexes in the new ring. The server then
+ * rewrites the grant list and order in the primary shared page.
+ */
+struct vchan_resize {
+	/* resize of the left (client write) and right (client read) rings */
+	struct vchan_resize_ring left, right;
+	/* set by a client that maps this page; the server can't resize before */
+	uint8_t cli_resize;
+};
+
+#define VCHAN_CACHE_LINE 64
+
+/* one ring index, alone on its cache line */
+struct vchan_index_line {
+	uint32_t idx;
+	/* set by the writer of idx once idx has moved here */
+	uint8_t moved;
+	uint8_t pad[3];
+	/**
+	 * Written with idx: the value of the other index of the ring at which
+	 * the writer of idx wants to be notified. On the consumer's line it is
+	 * the producer index a waiting reader needs, on the producer's line the
+	 * consumer index at which a waiting writer has the space it needs. A
+	 * side that sees the peer's notify bit only notifies once it has moved
+	 * its index to event or past it.
+	 */
+	uint32_t event;
+	uint8_t pad2[VCHAN_CACHE_LINE - 12];
+};
+
+struct vchan_index_ring {
+	struct vchan_index_line cons, prod;
+};
+
+#define VCHAN_INDEXES_VERSION 2
+
+/**
+ * vchan_indexes: version 2 layout of the ring indexes. In vchan_interface the
+ * indexes of both rings share a cache line, which then bounces between the
+ * two sides on every update. This page puts each index on a line of its own.
+ * It is granted by the server and advertised in XenStore as "index-ref", or
+ * as 0 if the server couldn't grant it; version 1 clients don't look for it
+ * and keep using vchan_interface.
+ *
+ * Each index is moved by its writer: the client moves its two indexes as it
+ * connects, and the server moves its index of a ring once it sees that the
+ * client has moved the other one. Until a reader sees moved set, it keeps
+ * reading the index in vchan_interface, which only ever lags behind.
+ *
+ * A client moves its indexes back to vchan_interface as it closes, clearing
+ * moved. A server that sees that, or sees cli_live drop to 0, moves its own
+ * indexes back as well, so that a persistent server can take a client of
+ * either version next.
+ */
+struct vchan_indexes {
+	/* VCHAN_INDEXES_VERSION, set by the server */
+	uint8_t version;
+	uint8_t pad[VCHAN_CACHE_LINE - 1];
+	struct vchan_index_ring left, right;
+};
@@ -0,0 +1,368 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the asynchronous I/O engine. Reads and writes queued on
+ *  a vchan are carried out from the callbacks of a reactor, which watches
+ *  the vchan only for the directions that have operations queued, so any
+ *  number of transfers can be in flight without a thread blocking on each.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "libxenvchan.h"
+
+struct async_op {
+    struct async_op *next;
+    uint8_t *data;
+    size_t size;
+    /* bytes of a write copied so far */
+    size_t done;
+    libxenvchan_async_cb *callback;
+    void *context;
+    int result;
+};
+
+struct async_queue {
+    struct async_op *head, *tail;
+};
+
+struct libxenvchan_async_vchan {
+    struct libxenvchan_async *engine;
+    struct libxenvchan *ctrl;
+    struct libxenvchan_reactor_entry *entry;
+    /* protects the queues and closed */
+    CRITICAL_SECTION lock;
+    struct async_queue reads, writes;
+    /* true once the peer has closed, no more operations are accepted */
+    int closed;
+    /* ctrl->blocking before attaching, restored on detach */
+    int blocking;
+    struct libxenvchan_async_vchan *prev, *next;
+};
+
+struct libxenvchan_async {
+    struct libxenvchan_reactor *reactor;
+    HANDLE port;
+    /* protects the list of vchans */
+    CRITICAL_SECTION lock;
+    struct libxenvchan_async_vchan *vchans;
+};
+
+static void queue_push(struct async_queue *queue, struct async_op *op)
+{
+    op->next = NULL;
+    if (queue->tail)
+        queue->tail->next = op;
+    else
+        queue->head = op;
+    queue->tail = op;
+}
+
+static struct async_op *queue_pop(struct async_queue *queue)
+{
+    struct async_op *op = queue->head;
+
+    if (op)
+    {
+        queue->head = op->next;
+        if (!queue->head)
+            queue->tail = NULL;
+    }
+    return op;
+}
+
+/* move every operation of a queue to the completed ones, failed */
+static void queue_fail(struct async_queue *queue, struct async_queue *completed)
+{
+    struct async_op *op;
+
+    while ((op = queue_pop(queue)) != NULL)
+    {
+        op->result = -1;
+        queue_push(completed, op);
+    }
+}
+
+/* called without the vchan's lock, so callbacks may queue more operations */
+static void async_complete(struct libxenvchan_async_vchan *av, struct async_queue *completed)
+{
+    struct async_op *op;
+
+    while ((op = queue_pop(completed)) != NULL)
+    {
+        if (op->callback)
+            op->callback(av->ctrl, op->result, op->context);
+        else
+            PostQueuedCompletionStatus(av->engine->port, (DWORD)op->result, (ULONG_PTR)av->ctrl, op->context);
+        free(op);
+    }
+}
+
+/*
+ * Watch the vchan for the directions that have work queued. Called with the
+ * vchan's lock held, so that racing submissions can't undo each other.
+ */
+static void async_update_interest(struct libxenvchan_async_vchan *av)
+{
+    int interest = 0;
+
+    if (av->reads.head)
+        interest |= LIBXENVCHAN_READABLE;
+    if (av->writes.head)
+        interest |= LIBXENVCHAN_WRITABLE;
+
+    libxenvchan_reactor_modify(av->entry, interest);
+}
+
+static void async_reads(struct libxenvchan_async_vchan *av, struct async_queue *completed)
+{
+    struct async_op *op;
+    int ret;
+
+    while ((op = av->reads.head) != NULL)
+    {
+        ret = libxenvchan_read(av->ctrl, op->data, op->size);
+        if (ret == 0)
+            break;
+
+        op->result = ret;
+        queue_push(completed, queue_pop(&av->reads));
+    }
+}
+
+static void async_writes(struct libxenvchan_async_vchan *av, struct async_queue *completed)
+{
+    struct async_op *op;
+    int ret;
+
+    while ((op = av->writes.head) != NULL)
+    {
+        ret = libxenvchan_write(av->ctrl, op->data + op->done, op->size - op->done);
+        if (ret == 0)
+            break;
+
+        if (ret < 0)
+        {
+            op->result = -1;
+        }
+        else
+        {
+            op->done += ret;
+            if (op->done < op->size)
+                break;
+            op->result = (int)op->size;
+        }
+        queue_push(completed, queue_pop(&av->writes));
+    }
+}
+
+static void async_reactor_cb(struct libxenvchan *ctrl, int events, void *context)
+{
+    struct libxenvchan_async_vchan *av = context;
+    struct async_queue completed = { NULL, NULL };
+
+    EnterCriticalSection(&av->lock);
+
+    // data that arrived before a close can still be read
+    if (events & (LIBXENVCHAN_READABLE | LIBXENVCHAN_CLOSED))
+        async_reads(av, &completed);
+
+    if (events & LIBXENVCHAN_CLOSED)
+    {
+        av->closed = 1;
+        queue_fail(&av->reads, &completed);
+        queue_fail(&av->writes, &completed);
+    }
+    else if (events & LIBXENVCHAN_WRITABLE)
+    {
+        async_writes(av, &completed);
+    }
+
+    async_update_interest(av);
+    LeaveCriticalSection(&av->lock);
+
+    async_complete(av, &completed);
+}
+
+static int async_queue_op(struct libxenvchan *ctrl, int write, void *data, size_t size,
+                          libxenvchan_async_cb *callback, void *context)
+{
+    struct libxenvchan_async_vchan *av = ctrl->async;
+    struct async_op *op;
+
+    if (!av || !data || !size || size > INT32_MAX || (!callback && !av->engine->port))
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return -1;
+    }
+
+    op = malloc(sizeof(*op));
+    if (!op)
+        return -1;
+
+    ZeroMemory(op, sizeof(*op));
+    op->data = data;
+    op->size = size;
+    op->callback = callback;
+    op->context = context;
+
+    EnterCriticalSection(&av->lock);
+    if (av->closed)
+    {
+        LeaveCriticalSection(&av->lock);
+        free(op);
+        SetLastError(ERROR_BROKEN_PIPE);
+        return -1;
+    }
+
+    queue_push(write ? &av->writes : &av->reads, op);
+    async_update_interest(av);
+    LeaveCriticalSection(&av->lock);
+    return 0;
+}
+
+int libxenvchan_read_async(struct libxenvchan *ctrl, void *data, size_t size,
+                           libxenvchan_async_cb *callback, void *context)
+{
+    return async_queue_op(ctrl, 0, data, size, callback, context);
+}
+
+int libxenvchan_write_async(struct libxenvchan *ctrl, const void *data, size_t size,
+                            libxenvchan_async_cb *callback, void *context)
+{
+    return async_queue_op(ctrl, 1, (void *)data, size, callback, context);
+}
+
+struct libxenvchan_async *libxenvchan_async_create(int threads, HANDLE port)
+{
+    struct libxenvchan_async *engine;
+
+    engine = malloc(sizeof(*engine));
+    if (!engine)
+        return NULL;
+
+    ZeroMemory(engine, sizeof(*engine));
+
+    engine->reactor = libxenvchan_reactor_create(threads);
+    if (!engine->reactor)
+    {
+        free(engine);
+        return NULL;
+    }
+
+    engine->port = port;
+    InitializeCriticalSection(&engine->lock);
+    return engine;
+}
+
+void libxenvchan_async_destroy(struct libxenvchan_async *engine)
+{
+    if (!engine)
+        return;
+
+    while (engine->vchans)
+        libxenvchan_async_detach(engine->vchans->ctrl);
+
+    libxenvchan_reactor_destroy(engine->reactor);
+    DeleteCriticalSection(&engine->lock);
+    free(engine);
+}
+
+int libxenvchan_async_attach(struct libxenvchan_async *engine, struct libxenvchan *ctrl)
+{
+    struct libxenvchan_async_vchan *av;
+
+    if (!engine || !ctrl || ctrl->async)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return -1;
+    }
+
+    av = malloc(sizeof(*av));
+    if (!av)
+        return -1;
+
+    ZeroMemory(av, sizeof(*av));
+    av->engine = engine;
+    av->ctrl = ctrl;
+    InitializeCriticalSection(&av->lock);
+
+    // the reactor callbacks must never block
+    av->blocking = ctrl->blocking;
+    ctrl->blocking = 0;
+
+    /* nothing is queued yet, so nothing is watched either */
+    av->entry = libxenvchan_reactor_add(engine->reactor, ctrl, 0, async_reactor_cb, av);
+    if (!av->entry)
+    {
+        ctrl->blocking = av->blocking;
+        DeleteCriticalSection(&av->lock);
+        free(av);
+        return -1;
+    }
+
+    EnterCriticalSection(&engine->lock);
+    av->next = engine->vchans;
+    if (av->next)
+        av->next->prev = av;
+    engine->vchans = av;
+    LeaveCriticalSection(&engine->lock);
+
+    ctrl->async = av;
+    return 0;
+}
+
+void libxenvchan_async_detach(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_async_vchan *av = ctrl->async;
+    struct libxenvchan_async *engine;
+    struct async_queue completed = { NULL, NULL };
+
+    if (!av)
+        return;
+
+    engine = av->engine;
+
+    /* refuse new operations before the reactor entry they would update goes */
+    EnterCriticalSection(&av->lock);
+    av->closed = 1;
+    LeaveCriticalSection(&av->lock);
+
+    libxenvchan_reactor_remove(av->entry);
+
+    EnterCriticalSection(&engine->lock);
+    if (av->prev)
+        av->prev->next = av->next;
+    else
+        engine->vchans = av->next;
+    if (av->next)
+        av->next->prev = av->prev;
+    LeaveCriticalSection(&engine->lock);
+
+    queue_fail(&av->reads, &completed);
+    queue_fail(&av->writes, &completed);
+    async_complete(av, &completed);
+
+    ctrl->async = NULL;
+    ctrl->blocking = av->blocking;
+    DeleteCriticalSection(&av->lock);
+    free(av);
+}
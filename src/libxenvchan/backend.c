@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the Xen backend, which hands everything to xencontrol,
+ *  and the selection of the backend for new vchans.
+ */
+
+#include "private.h"
+
+/*
+ * xencontrol is imported from a DLL, so its functions can't be used in a
+ * static initializer directly.
+ */
+static DWORD xen_open(XENCONTROL_LOGGER *logger, PXENCONTROL_CONTEXT *xc)
+{
+    return XcOpen(logger, xc);
+}
+
+static void xen_close(PXENCONTROL_CONTEXT xc)
+{
+    XcClose(xc);
+}
+
+static DWORD xen_evtchn_bind_unbound(PXENCONTROL_CONTEXT xc, USHORT domain, HANDLE event, BOOL mask, ULONG *port)
+{
+    return XcEvtchnBindUnbound(xc, domain, event, mask, port);
+}
+
+static DWORD xen_evtchn_bind_interdomain(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG remote_port, HANDLE event,
+                                         BOOL mask, ULONG *local_port)
+{
+    return XcEvtchnBindInterdomain(xc, domain, remote_port, event, mask, local_port);
+}
+
+static DWORD xen_evtchn_notify(PXENCONTROL_CONTEXT xc, ULONG port)
+{
+    return XcEvtchnNotify(xc, port);
+}
+
+static DWORD xen_evtchn_close(PXENCONTROL_CONTEXT xc, ULONG port)
+{
+    return XcEvtchnClose(xc, port);
+}
+
+static DWORD xen_gnttab_grant(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG notify_offset, ULONG notify_port,
+                              XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address, ULONG *refs)
+{
+    return XcGnttabPermitForeignAccess(xc, domain, pages, notify_offset, notify_port, flags, address, refs);
+}
+
+static DWORD xen_gnttab_revoke(PXENCONTROL_CONTEXT xc, PVOID address)
+{
+    return XcGnttabRevokeForeignAccess(xc, address);
+}
+
+static DWORD xen_gnttab_map(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG *refs, ULONG notify_offset,
+                            ULONG notify_port, XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address)
+{
+    return XcGnttabMapForeignPages(xc, domain, pages, refs, notify_offset, notify_port, flags, address);
+}
+
+static DWORD xen_gnttab_unmap(PXENCONTROL_CONTEXT xc, PVOID address)
+{
+    return XcGnttabUnmapForeignPages(xc, address);
+}
+
+static DWORD xen_store_read(PXENCONTROL_CONTEXT xc, const CHAR *path, DWORD size, CHAR *value)
+{
+    return XcStoreRead(xc, path, size, value);
+}
+
+static DWORD xen_store_write(PXENCONTROL_CONTEXT xc, const CHAR *path, const CHAR *value)
+{
+    return XcStoreWrite(xc, path, value);
+}
+
+static DWORD xen_store_remove(PXENCONTROL_CONTEXT xc, const CHAR *path)
+{
+    return XcStoreRemove(xc, path);
+}
+
+static DWORD xen_store_set_permissions(PXENCONTROL_CONTEXT xc, const CHAR *path, ULONG count,
+                                       PXENIFACE_STORE_PERMISSION perms)
+{
+    return XcStoreSetPermissions(xc, path, count, perms);
+}
+
+static const struct libxenvchan_backend xen_backend = {
+    "xen",
+    xen_open,
+    xen_close,
+    xen_evtchn_bind_unbound,
+    xen_evtchn_bind_interdomain,
+    xen_evtchn_notify,
+    xen_evtchn_close,
+    xen_gnttab_grant,
+    xen_gnttab_revoke,
+    xen_gnttab_map,
+    xen_gnttab_unmap,
+    xen_store_read,
+    xen_store_write,
+    xen_store_remove,
+    xen_store_set_permissions,
+};
+
+static const struct libxenvchan_backend *backend = &xen_backend;
+
+const struct libxenvchan_backend *libxenvchan_xen_backend(void)
+{
+    return &xen_backend;
+}
+
+void libxenvchan_set_backend(const struct libxenvchan_backend *new_backend)
+{
+    backend = new_backend ? new_backend : &xen_backend;
+}
+
+const struct libxenvchan_backend *current_backend(void)
+{
+    return backend;
+}
@@ -0,0 +1,295 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the copy kernels used to move data into and out of
+ *  the rings. The kernel is picked by size and by what the CPU supports:
+ *  medium copies use unaligned AVX2 moves, and bulk copies into a ring use
+ *  non-temporal stores so that neither side's cache fills up with data
+ *  only the peer is going to read. Small copies that do not wrap are done
+ *  inline, see copy_to_ring() and copy_from_ring() in private.h.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "private.h"
+
+/* copies at least this big bypass the cache on their way into a ring */
+#define COPY_STREAM_MIN (256 * 1024)
+
+/* how far ahead of the source the bulk kernels prefetch */
+#define PREFETCH_DISTANCE 512
+
+enum copy_level {
+    COPY_UNKNOWN = -1,
+    COPY_CRT,
+    COPY_SSE2,
+    COPY_AVX2,
+};
+
+static volatile LONG copy_level = COPY_UNKNOWN;
+
+static LONG detect_copy_level(void)
+{
+    int regs[4];
+    int max_leaf;
+    int level = COPY_CRT;
+
+    __cpuid(regs, 0);
+    max_leaf = regs[0];
+
+    __cpuid(regs, 1);
+    if (regs[3] & (1 << 26)) /* SSE2 */
+        level = COPY_SSE2;
+
+    /* AVX2 needs the OS to save the upper halves of the ymm registers */
+    if ((regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && /* OSXSAVE, AVX */
+        (_xgetbv(0) & 6) == 6 && max_leaf >= 7)
+    {
+        __cpuidex(regs, 7, 0);
+        if (regs[1] & (1 << 5)) /* AVX2 */
+            level = COPY_AVX2;
+    }
+
+    return level;
+}
+
+static __inline LONG get_copy_level(void)
+{
+    LONG level = copy_level;
+
+    // racing threads all come up with the same answer
+    if (level == COPY_UNKNOWN)
+    {
+        level = detect_copy_level();
+        copy_level = level;
+    }
+
+    return level;
+}
+
+/* size > 32; src and dst never overlap */
+static void copy_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(src + size - 32));
+    uint8_t *dst_tail = dst + size - 32;
+
+    while (size > 128)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)src);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(src + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+        _mm256_storeu_si256((__m256i*)dst, a);
+        _mm256_storeu_si256((__m256i*)(dst + 32), b);
+        _mm256_storeu_si256((__m256i*)(dst + 64), c);
+        _mm256_storeu_si256((__m256i*)(dst + 96), d);
+        src += 128;
+        dst += 128;
+        size -= 128;
+    }
+
+    while (size > 32)
+    {
+        _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        src += 32;
+        dst += 32;
+        size -= 32;
+    }
+
+    // the last, possibly partial, block overlaps the one before it
+    _mm256_storeu_si256((__m256i*)dst_tail, tail);
+    _mm256_zeroupper();
+}
+
+/* size > 64; stores go around the cache, caller must fence before publishing */
+static void stream_avx2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(src + size - 32));
+    uint8_t *dst_tail = dst + size - 32;
+
+    // an unaligned store to get dst onto a 32 byte boundary
+    _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+    src += head;
+    dst += head;
+    size -= head;
+
+    while (size >= 128)
+    {
+        __m256i a, b, c, d;
+
+        _mm_prefetch((const char*)src + PREFETCH_DISTANCE, _MM_HINT_NTA);
+        _mm_prefetch((const char*)src + PREFETCH_DISTANCE + 64, _MM_HINT_NTA);
+        a = _mm256_loadu_si256((const __m256i*)src);
+        b = _mm256_loadu_si256((const __m256i*)(src + 32));
+        c = _mm256_loadu_si256((const __m256i*)(src + 64));
+        d = _mm256_loadu_si256((const __m256i*)(src + 96));
+
+        _mm256_stream_si256((__m256i*)dst, a);
+        _mm256_stream_si256((__m256i*)(dst + 32), b);
+        _mm256_stream_si256((__m256i*)(dst + 64), c);
+        _mm256_stream_si256((__m256i*)(dst + 96), d);
+        src += 128;
+        dst += 128;
+        size -= 128;
+    }
+
+    while (size >= 32)
+    {
+        _mm256_stream_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+        src += 32;
+        dst += 32;
+        size -= 32;
+    }
+
+    if (size)
+        _mm256_storeu_si256((__m256i*)dst_tail, tail);
+
+    _mm256_zeroupper();
+}
+
+/* size > 32; stores go around the cache, caller must fence before publishing */
+static void stream_sse2(uint8_t *dst, const uint8_t *src, size_t size)
+{
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    __m128i tail = _mm_loadu_si128((const __m128i*)(src + size - 16));
+    uint8_t *dst_tail = dst + size - 16;
+
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    src += head;
+    dst += head;
+    size -= head;
+
+    while (size >= 64)
+    {
+        __m128i a, b, c, d;
+
+        _mm_prefetch((const char*)src + PREFETCH_DISTANCE, _MM_HINT_NTA);
+        a = _mm_loadu_si128((const __m128i*)src);
+        b = _mm_loadu_si128((const __m128i*)(src + 16));
+        c = _mm_loadu_si128((const __m128i*)(src + 32));
+        d = _mm_loadu_si128((const __m128i*)(src + 48));
+
+        _mm_stream_si128((__m128i*)dst, a);
+        _mm_stream_si128((__m128i*)(dst + 16), b);
+        _mm_stream_si128((__m128i*)(dst + 32), c);
+        _mm_stream_si128((__m128i*)(dst + 48), d);
+        src += 64;
+        dst += 64;
+        size -= 64;
+    }
+
+    while (size >= 16)
+    {
+        _mm_stream_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+        src += 16;
+        dst += 16;
+        size -= 16;
+    }
+
+    if (size)
+        _mm_storeu_si128((__m128i*)dst_tail, tail);
+}
+
+/* size > COPY_SMALL */
+static void copy_medium(LONG level, void *dst, const void *src, size_t size)
+{
+    if (level == COPY_AVX2)
+        copy_avx2(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
+/* size > COPY_SMALL */
+static void copy_stream(LONG level, void *dst, const void *src, size_t size)
+{
+    if (size <= 64)
+        copy_medium(level, dst, src, size);
+    else if (level == COPY_AVX2)
+        stream_avx2(dst, src, size);
+    else if (level == COPY_SSE2)
+        stream_sse2(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
+static void copy_in(LONG level, void *dst, const void *src, size_t size, int stream)
+{
+    if (size <= COPY_SMALL)
+        copy_small(dst, src, size);
+    else if (stream)
+        copy_stream(level, dst, src, size);
+    else
+        copy_medium(level, dst, src, size);
+}
+
+void copy_ring_in(void *ring, uint32_t ring_size, uint32_t idx, const void *data, size_t size)
+{
+    LONG level = get_copy_level();
+    uint32_t real_idx = idx & (ring_size - 1);
+    size_t contig = ring_size - real_idx;
+    int stream = size >= COPY_STREAM_MIN && level != COPY_CRT;
+
+    if (contig > size)
+        contig = size;
+
+    copy_in(level, (uint8_t*)ring + real_idx, data, contig, stream);
+
+    if (contig < size)
+    {
+        // we rolled across the end of the ring
+        copy_in(level, ring, (const uint8_t*)data + contig, size - contig, stream);
+    }
+
+    // non-temporal stores are weakly ordered, they must land before the index moves
+    if (stream)
+        _mm_sfence();
+}
+
+static void copy_out(LONG level, void *dst, const void *src, size_t size)
+{
+    if (size <= COPY_SMALL)
+        copy_small(dst, src, size);
+    else
+        copy_medium(level, dst, src, size);
+}
+
+void copy_ring_out(void *data, const void *ring, uint32_t ring_size, uint32_t idx, size_t size)
+{
+    LONG level = get_copy_level();
+    uint32_t real_idx = idx & (ring_size - 1);
+    size_t contig = ring_size - real_idx;
+
+    if (contig > size)
+        contig = size;
+
+    copy_out(level, data, (const uint8_t*)ring + real_idx, contig);
+
+    if (contig < size)
+    {
+        // we rolled across the end of the ring
+        copy_out(level, (uint8_t*)data + contig, ring, size - contig);
+    }
+}
@@ -0,0 +1,171 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the latency histograms.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <intrin.h>
+
+#include "private.h"
+
+#define SUB_BUCKETS (1 << LIBXENVCHAN_HIST_SUB_BITS)
+
+uint64_t now_nsec(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000000 +
+                      now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+}
+
+static int msb64(uint64_t value)
+{
+    unsigned long bit;
+
+    /* _BitScanReverse64 is only available on x64 */
+    if (_BitScanReverse(&bit, (unsigned long)(value >> 32)))
+        return bit + 32;
+
+    _BitScanReverse(&bit, (unsigned long)value);
+    return bit;
+}
+
+static int bucket_index(uint64_t value)
+{
+    int msb;
+
+    if (value < SUB_BUCKETS)
+        return (int)value;
+
+    msb = msb64(value);
+    return ((msb - LIBXENVCHAN_HIST_SUB_BITS + 1) << LIBXENVCHAN_HIST_SUB_BITS) +
+           (int)((value >> (msb - LIBXENVCHAN_HIST_SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_value(int index)
+{
+    int shift = (index >> LIBXENVCHAN_HIST_SUB_BITS) - 1;
+
+    if (shift <= 0)
+        return index;
+
+    return (uint64_t)(SUB_BUCKETS + (index & (SUB_BUCKETS - 1))) << shift;
+}
+
+void hist_record(struct libxenvchan_hist *hist, uint64_t value)
+{
+    if (!hist->count || value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+
+    hist->count++;
+    hist->sum += value;
+    hist->buckets[bucket_index(value)]++;
+}
+
+int libxenvchan_enable_histograms(struct libxenvchan *ctrl, int enable)
+{
+    if (!enable)
+    {
+        /* another thread may still be recording; keep the memory until close */
+        ctrl->hist = NULL;
+        return 0;
+    }
+
+    if (!ctrl->hist_buf)
+    {
+        ctrl->hist_buf = malloc(sizeof(*ctrl->hist_buf));
+        if (!ctrl->hist_buf)
+            return -1;
+    }
+
+    ZeroMemory(ctrl->hist_buf, sizeof(*ctrl->hist_buf));
+    ctrl->gap_start = 0;
+    ctrl->hist = ctrl->hist_buf;
+    return 0;
+}
+
+int libxenvchan_get_histograms(struct libxenvchan *ctrl, struct libxenvchan_histograms *hist)
+{
+    struct libxenvchan_histograms *cur = hist_get(ctrl);
+
+    if (!cur)
+        return -1;
+
+    *hist = *cur;
+    return 0;
+}
+
+static void merge_hist(struct libxenvchan_hist *dst, const struct libxenvchan_hist *src)
+{
+    int i;
+
+    if (!src->count)
+        return;
+
+    if (!dst->count || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    for (i = 0; i < LIBXENVCHAN_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+void libxenvchan_merge_histograms(struct libxenvchan_histograms *dst, const struct libxenvchan_histograms *src)
+{
+    merge_hist(&dst->wait, &src->wait);
+    merge_hist(&dst->notify, &src->notify);
+    merge_hist(&dst->gap, &src->gap);
+}
+
+uint64_t libxenvchan_hist_percentile(const struct libxenvchan_hist *hist, double percentile)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (!hist->count)
+        return 0;
+
+    if (percentile >= 100)
+        return hist->max;
+
+    rank = (uint64_t)(hist->count * (percentile > 0 ? percentile : 0) / 100);
+
+    for (i = 0; i < LIBXENVCHAN_HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen > rank)
+            return max(bucket_value(i), hist->min);
+    }
+
+    return hist->max;
+}
@@ -0,0 +1,237 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the negotiation of the version 2 index layout, which
+ *  moves the ring indexes out of the shared page onto cache lines of their
+ *  own (see struct vchan_indexes).
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <intrin.h>
+
+#include "private.h"
+
+#define xen_rmb() _ReadBarrier()
+#define xen_wmb() _WriteBarrier()
+
+static struct vchan_index_ring *indexes_shared(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    /* left is client write, server read */
+    if ((ring == &ctrl->read) == (ctrl->is_server != 0))
+        return &ctrl->indexes->left;
+    else
+        return &ctrl->indexes->right;
+}
+
+/* the producer's index of ring in vchan_interface if producer is set, else the consumer's */
+static uint32_t *interface_index(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, int producer)
+{
+    struct ring_shared *shr;
+
+    if ((ring == &ctrl->read) == (ctrl->is_server != 0))
+        shr = &ctrl->ring->left;
+    else
+        shr = &ctrl->ring->right;
+
+    return producer ? &shr->prod : &shr->cons;
+}
+
+/*
+ * Called by the side's producer for its write ring and by its consumer for
+ * its read ring, so that each index is only moved by the thread writing it.
+ */
+void indexes_update(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    struct vchan_index_ring *split = ring->split;
+    int producer = ring == &ctrl->write;
+    struct vchan_index_line *own = producer ? &split->prod : &split->cons;
+    struct vchan_index_line *peer = producer ? &split->cons : &split->prod;
+    uint32_t **own_idx = producer ? &ring->prod : &ring->cons;
+    uint32_t **peer_idx = producer ? &ring->cons : &ring->prod;
+
+    if (*peer_idx != &peer->idx && peer->moved)
+    {
+        xen_rmb(); /* read moved /then/ the index */
+        *peer_idx = &peer->idx;
+        ring->peer_line = peer;
+    }
+
+    /* the server can't move until it knows the client reads the index page */
+    if (*own_idx != &own->idx && (!ctrl->is_server || peer->moved))
+    {
+        // a reconnecting client finds its indexes already moved
+        if (!own->moved)
+        {
+            own->idx = **own_idx;
+            /* until we say otherwise, any progress by the peer is wanted */
+            own->event = (producer ? **peer_idx : own->idx) + 1;
+            xen_wmb(); /* write the index /then/ tell the reader it moved */
+            own->moved = 1;
+        }
+        *own_idx = &own->idx;
+        ring->own_line = own;
+    }
+
+    if (*own_idx == &own->idx && *peer_idx == &peer->idx)
+    {
+        Log(XLL_DEBUG, "%s ring indexes split", producer ? "write" : "read");
+        ring->split = NULL;
+    }
+}
+
+uint32_t indexes_init_srv(struct libxenvchan *ctrl)
+{
+    uint32_t ref;
+    void *page;
+    DWORD status;
+
+    status = ctrl->backend->gnttab_grant(ctrl->xc,
+                                         ctrl->domain,
+                                         1,
+                                         0,
+                                         0,
+                                         0, // no notifications
+                                         &page,
+                                         &ref);
+
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_WARNING, "Granting index page to domain %u failed, using version 1 layout", ctrl->domain);
+        return 0;
+    }
+
+    ZeroMemory(page, sizeof(struct vchan_indexes));
+    ctrl->indexes = page;
+    ctrl->indexes->version = VCHAN_INDEXES_VERSION;
+    ctrl->read.split = indexes_shared(ctrl, &ctrl->read);
+    ctrl->write.split = indexes_shared(ctrl, &ctrl->write);
+    return ref;
+}
+
+/* must be called before the client is live, while it is the only user of its indexes */
+int indexes_init_cli(struct libxenvchan *ctrl, uint32_t index_ref)
+{
+    void *page;
+    DWORD status;
+
+    status = ctrl->backend->gnttab_map(ctrl->xc,
+                                       ctrl->domain,
+                                       1,
+                                       &index_ref,
+                                       0,
+                                       0,
+                                       0, // no notifications
+                                       &page);
+
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_WARNING, "Mapping index page (ref %u) from domain %u failed, using version 1 layout", index_ref, ctrl->domain);
+        return -1;
+    }
+
+    ctrl->indexes = page;
+    if (ctrl->indexes->version != VCHAN_INDEXES_VERSION)
+    {
+        Log(XLL_WARNING, "index page version %u not supported, using version 1 layout", ctrl->indexes->version);
+        indexes_close(ctrl);
+        return -1;
+    }
+
+    ctrl->read.split = indexes_shared(ctrl, &ctrl->read);
+    ctrl->write.split = indexes_shared(ctrl, &ctrl->write);
+    indexes_update(ctrl, &ctrl->read);
+    indexes_update(ctrl, &ctrl->write);
+    return 0;
+}
+
+/* move this side's index of ring back to vchan_interface, if it moved */
+static void indexes_restore(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    int producer = ring == &ctrl->write;
+    uint32_t **own_idx = producer ? &ring->prod : &ring->cons;
+    uint32_t *idx = interface_index(ctrl, ring, producer);
+
+    if (!ring->own_line)
+        return;
+
+    *idx = **own_idx;
+    xen_wmb(); /* write the index /then/ tell the reader it is back */
+    ring->own_line->moved = 0;
+    *own_idx = idx;
+    ring->own_line = NULL;
+}
+
+/*
+ * Called by the server's owner of ring once its client has moved its index
+ * of ring back, or has gone without doing so: move the server's index back
+ * too, so that the next client can use either layout.
+ */
+void indexes_reset(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    struct vchan_index_line *peer = ring->peer_line;
+    int producer = ring == &ctrl->write;
+    uint32_t **peer_idx = producer ? &ring->cons : &ring->prod;
+    uint32_t *idx = interface_index(ctrl, ring, !producer);
+
+    if (peer->moved && ctrl->ring->cli_live)
+        return;
+
+    // a client that didn't close left its index on the index page
+    if (peer->moved)
+    {
+        *idx = peer->idx;
+        xen_wmb();
+        peer->moved = 0;
+    }
+
+    *peer_idx = idx;
+    ring->peer_line = NULL;
+    indexes_restore(ctrl, ring);
+
+    Log(XLL_DEBUG, "%s ring indexes back in the shared page", producer ? "write" : "read");
+    ring->split = indexes_shared(ctrl, ring);
+
+    /* a version 1 client may already be waiting on the indexes it saw before */
+    ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+}
+
+void indexes_close(struct libxenvchan *ctrl)
+{
+    if (!ctrl->indexes)
+        return;
+
+    if (ctrl->is_server)
+    {
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->indexes);
+    }
+    else
+    {
+        // leave the layout as it was for whichever client comes next
+        indexes_restore(ctrl, &ctrl->read);
+        indexes_restore(ctrl, &ctrl->write);
+        ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->indexes);
+    }
+
+    ctrl->indexes = NULL;
+    ctrl->read.split = ctrl->write.split = NULL;
+    ctrl->read.own_line = ctrl->read.peer_line = NULL;
+    ctrl->write.own_line = ctrl->write.peer_line = NULL;
+}
@@ -35,39 +35,15 @@
 #include <stdint.h>
 #include <string.h>
 
-#include "libxenvchan.h"
-
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
-
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
-
-#define SMALL_RING_SHIFT 10
-#define LARGE_RING_SHIFT 11
-
-#define MAX_SMALL_RING (1 << SMALL_RING_SHIFT)
-#define SMALL_RING_OFFSET 1024
-#define MAX_LARGE_RING (1 << LARGE_RING_SHIFT)
-#define LARGE_RING_OFFSET 2048
-
-// if you go over this size, you'll have too many grants to fit in the shared page.
-#define MAX_RING_SHIFT 20
-#define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
+#include "private.h"
 
 #ifndef offsetof
 #define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
 #endif
 
-#ifndef max
-#define max(a,b) (((a) > (b)) ? (a) : (b))
-#endif
-
 #define snprintf _snprintf
 
-static void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvchan *ctrl, PWCHAR format, ...)
+void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvchan *ctrl, PWCHAR format, ...)
 {
     va_list args;
 
@@ -82,17 +58,146 @@ static void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvch
     va_end(args);
 }
 
-#define Log(level, msg, ...) _Log(level, __FUNCTION__, ctrl, L"(%p) " L##msg L"\n", ctrl, __VA_ARGS__)
+/*
+ * Number of data pages of a ring, and number of entries it takes up in the
+ * grant list of the shared page.
+ */
+int ring_pages(int order)
+{
+    return order >= PAGE_SHIFT ? 1 << (order - PAGE_SHIFT) : 0;
+}
+
+int ring_grants(int order)
+{
+    int pages = ring_pages(order);
+
+    if (order <= MAX_RING_SHIFT)
+        return pages;
+
+    return (int)((pages + GRANTS_PER_DIR_PAGE - 1) / GRANTS_PER_DIR_PAGE);
+}
+
+/*
+ * Grant the data pages of a multi-page ring, storing the grants for the
+ * shared page in grants. Large rings are granted indirectly: the data page
+ * grants go into directory pages, which are granted in turn.
+ */
+DWORD grant_ring_pages(struct libxenvchan *ctrl, USHORT domain, struct libxenvchan_ring *ring, uint32_t *grants)
+{
+    DWORD status;
+
+    if (ring->order <= MAX_RING_SHIFT)
+    {
+        return ctrl->backend->gnttab_grant(ctrl->xc,
+                                           domain,
+                                           ring_pages(ring->order),
+                                           0,
+                                           0,
+                                           0, // no notifications
+                                           &ring->buffer,
+                                           grants);
+    }
+
+    status = ctrl->backend->gnttab_grant(ctrl->xc,
+                                         domain,
+                                         ring_grants(ring->order),
+                                         0,
+                                         0,
+                                         0, // no notifications
+                                         &ring->grant_dir,
+                                         grants);
+
+    if (status != ERROR_SUCCESS)
+    {
+        ring->grant_dir = NULL;
+        return status;
+    }
+
+    status = ctrl->backend->gnttab_grant(ctrl->xc,
+                                         domain,
+                                         ring_pages(ring->order),
+                                         0,
+                                         0,
+                                         0, // no notifications
+                                         &ring->buffer,
+                                         ring->grant_dir);
+
+    if (status != ERROR_SUCCESS)
+    {
+        ctrl->backend->gnttab_revoke(ctrl->xc, ring->grant_dir);
+        ring->grant_dir = NULL;
+    }
+
+    return status;
+}
+
+/*
+ * Map the data pages of a multi-page ring from the grants in the shared page,
+ * going through the directory pages for large rings.
+ */
+DWORD map_ring_pages(struct libxenvchan *ctrl, USHORT domain, struct libxenvchan_ring *ring, uint32_t *grants, int flags)
+{
+    int pages = ring_pages(ring->order);
+    uint32_t *refs;
+    void *dir;
+    DWORD status;
+
+    if (ring->order <= MAX_RING_SHIFT)
+    {
+        return ctrl->backend->gnttab_map(ctrl->xc,
+                                         domain,
+                                         pages,
+                                         grants,
+                                         0,
+                                         0,
+                                         flags, // no notifications
+                                         &ring->buffer);
+    }
+
+    status = ctrl->backend->gnttab_map(ctrl->xc,
+                                       domain,
+                                       ring_grants(ring->order),
+                                       grants,
+                                       0,
+                                       0,
+                                       XENIFACE_GNTTAB_READONLY, // no notifications
+                                       &dir);
+
+    if (status != ERROR_SUCCESS)
+        return status;
+
+    // take a private copy so that the server can't change the list under us
+    refs = malloc(pages * sizeof(uint32_t));
+    if (refs)
+        memcpy(refs, dir, pages * sizeof(uint32_t));
+
+    ctrl->backend->gnttab_unmap(ctrl->xc, dir);
+
+    if (!refs)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    status = ctrl->backend->gnttab_map(ctrl->xc,
+                                       domain,
+                                       pages,
+                                       refs,
+                                       0,
+                                       0,
+                                       flags, // no notifications
+                                       &ring->buffer);
+
+    free(refs);
+    return status;
+}
 
 static int init_gnt_srv(struct libxenvchan *ctrl, USHORT domain)
 {
-    int pages_left = ctrl->read.order >= PAGE_SHIFT ? 1 << (ctrl->read.order - PAGE_SHIFT) : 0;
-    int pages_right = ctrl->write.order >= PAGE_SHIFT ? 1 << (ctrl->write.order - PAGE_SHIFT) : 0;
+    int pages_left = ring_pages(ctrl->read.order);
+    int pages_right = ring_pages(ctrl->write.order);
     uint32_t ring_ref;
     void *ring;
     DWORD status;
 
-    status = XcGnttabPermitForeignAccess(ctrl->xc,
+    status = ctrl->backend->gnttab_grant(ctrl->xc,
                                          domain,
                                          1,
                                          offsetof(struct vchan_interface, srv_live),
@@ -109,8 +214,10 @@ static int init_gnt_srv(struct libxenvchan *ctrl, USHORT domain)
     }
 
     ctrl->ring = ring;
-    ctrl->read.shr = &ctrl->ring->left;
-    ctrl->write.shr = &ctrl->ring->right;
+    ctrl->read.cons = &ctrl->ring->left.cons;
+    ctrl->read.prod = &ctrl->ring->left.prod;
+    ctrl->write.cons = &ctrl->ring->right.cons;
+    ctrl->write.prod = &ctrl->ring->right.prod;
     ctrl->ring->left_order = (uint16_t)ctrl->read.order;
     ctrl->ring->right_order = (uint16_t)ctrl->write.order;
     ctrl->ring->cli_live = 2;
@@ -128,14 +235,7 @@ static int init_gnt_srv(struct libxenvchan *ctrl, USHORT domain)
         break;
 
     default:
-        status = XcGnttabPermitForeignAccess(ctrl->xc,
-                                             domain,
-                                             pages_left,
-                                             0,
-                                             0,
-                                             0, // no notifications
-                                             &ctrl->read.buffer,
-                                             ctrl->ring->grants);
+        status = grant_ring_pages(ctrl, domain, &ctrl->read, ctrl->ring->grants);
 
         if (status != ERROR_SUCCESS)
         {
@@ -155,14 +255,7 @@ static int init_gnt_srv(struct libxenvchan *ctrl, USHORT domain)
         break;
 
     default:
-        status = XcGnttabPermitForeignAccess(ctrl->xc,
-                                             domain,
-                                             pages_right,
-                                             0,
-                                             0,
-                                             0, // no notifications
-                                             &ctrl->write.buffer,
-                                             ctrl->ring->grants + pages_left);
+        status = grant_ring_pages(ctrl, domain, &ctrl->write, ctrl->ring->grants + ring_grants(ctrl->read.order));
 
         if (status != ERROR_SUCCESS)
         {
@@ -177,30 +270,33 @@ out:
 
 out_unmap_left:
     if (pages_left > 0)
-        XcGnttabRevokeForeignAccess(ctrl->xc, ctrl->read.buffer);
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->read.buffer);
+    if (ctrl->read.grant_dir)
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->read.grant_dir);
+    ctrl->read.grant_dir = NULL;
 
 out_ring:
-    XcGnttabRevokeForeignAccess(ctrl->xc, ctrl->ring);
+    ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->ring);
     ring_ref = ~0ul;
     ctrl->ring = NULL;
     ctrl->write.order = ctrl->read.order = 0;
     goto out;
 }
 
-static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_ref)
+static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_ref, int max_shift)
 {
     int rv = -1;
     uint32_t *grants;
     DWORD status;
 
-    status = XcGnttabMapForeignPages(ctrl->xc,
-                                   domain,
-                                   1,
-                                   &ring_ref,
-                                   offsetof(struct vchan_interface, cli_live),
-                                   ctrl->event_port,
-                                   XENIFACE_GNTTAB_USE_NOTIFY_OFFSET | XENIFACE_GNTTAB_USE_NOTIFY_PORT,
-                                   &ctrl->ring);
+    status = ctrl->backend->gnttab_map(ctrl->xc,
+                                     domain,
+                                     1,
+                                     &ring_ref,
+                                     offsetof(struct vchan_interface, cli_live),
+                                     ctrl->event_port,
+                                     XENIFACE_GNTTAB_USE_NOTIFY_OFFSET | XENIFACE_GNTTAB_USE_NOTIFY_PORT,
+                                     &ctrl->ring);
 
     if (status != ERROR_SUCCESS)
     {
@@ -210,12 +306,14 @@ static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_r
 
     ctrl->write.order = ctrl->ring->left_order;
     ctrl->read.order = ctrl->ring->right_order;
-    ctrl->write.shr = &ctrl->ring->left;
-    ctrl->read.shr = &ctrl->ring->right;
+    ctrl->write.cons = &ctrl->ring->left.cons;
+    ctrl->write.prod = &ctrl->ring->left.prod;
+    ctrl->read.cons = &ctrl->ring->right.cons;
+    ctrl->read.prod = &ctrl->ring->right.prod;
 
-    if (ctrl->write.order < SMALL_RING_SHIFT || ctrl->write.order > MAX_RING_SHIFT)
+    if (ctrl->write.order < SMALL_RING_SHIFT || ctrl->write.order > max_shift)
         goto out_unmap_ring;
-    if (ctrl->read.order < SMALL_RING_SHIFT || ctrl->read.order > MAX_RING_SHIFT)
+    if (ctrl->read.order < SMALL_RING_SHIFT || ctrl->read.order > max_shift)
         goto out_unmap_ring;
     if (ctrl->read.order == ctrl->write.order && ctrl->read.order < PAGE_SHIFT)
         goto out_unmap_ring;
@@ -234,16 +332,9 @@ static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_r
 
     default:
     {
-        int pages_left = 1 << (ctrl->write.order - PAGE_SHIFT);
+        int pages_left = ring_pages(ctrl->write.order);
 
-        status = XcGnttabMapForeignPages(ctrl->xc,
-                                         domain,
-                                         pages_left,
-                                         grants,
-                                         0,
-                                         0,
-                                         0, // no notifications
-                                         &ctrl->write.buffer);
+        status = map_ring_pages(ctrl, domain, &ctrl->write, grants, 0);
 
         if (status != ERROR_SUCCESS)
         {
@@ -251,7 +342,7 @@ static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_r
             goto out_unmap_ring;
         }
 
-        grants += pages_left;
+        grants += ring_grants(ctrl->write.order);
     }
     }
 
@@ -267,16 +358,9 @@ static int init_gnt_cli(struct libxenvchan *ctrl, USHORT domain, uint32_t ring_r
 
     default:
     {
-        int pages_right = 1 << (ctrl->read.order - PAGE_SHIFT);
+        int pages_right = ring_pages(ctrl->read.order);
 
-        status = XcGnttabMapForeignPages(ctrl->xc,
-                                         domain,
-                                         pages_right,
-                                         grants,
-                                         0,
-                                         0,
-                                         XENIFACE_GNTTAB_READONLY, // no notifications
-                                         &ctrl->read.buffer);
+        status = map_ring_pages(ctrl, domain, &ctrl->read, grants, XENIFACE_GNTTAB_READONLY);
 
         if (status != ERROR_SUCCESS)
         {
@@ -293,16 +377,30 @@ out:
 
 out_unmap_left:
     if (ctrl->write.order >= PAGE_SHIFT)
-        XcGnttabUnmapForeignPages(ctrl->xc, ctrl->write.buffer);
+        ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->write.buffer);
 
 out_unmap_ring:
-    XcGnttabUnmapForeignPages(ctrl->xc, ctrl->ring);
+    ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->ring);
     ctrl->ring = 0;
     ctrl->write.order = ctrl->read.order = 0;
     rv = -1;
     goto out;
 }
 
+/* the per-ring events of wait_ring(); libxenvchan_close() closes them */
+static int init_wakeups(struct libxenvchan *ctrl)
+{
+    ctrl->read.wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ctrl->write.wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!ctrl->read.wakeup || !ctrl->write.wakeup)
+    {
+        Log(XLL_ERROR, "CreateEvent failed: 0x%x", GetLastError());
+        return -1;
+    }
+
+    return 0;
+}
+
 static int init_evt_srv(struct libxenvchan *ctrl, USHORT domain)
 {
     DWORD status;
@@ -314,7 +412,10 @@ static int init_evt_srv(struct libxenvchan *ctrl, USHORT domain)
         goto fail;
     }
 
-    status = XcEvtchnBindUnbound(ctrl->xc, domain, ctrl->event, FALSE, &ctrl->event_port);
+    if (init_wakeups(ctrl))
+        goto fail;
+
+    status = ctrl->backend->evtchn_bind_unbound(ctrl->xc, domain, ctrl->event, FALSE, &ctrl->event_port);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to bind event channel for domain %u: 0x%x", domain, status);
@@ -335,20 +436,20 @@ fail:
     return -1;
 }
 
-static int init_xs_srv(struct libxenvchan *ctrl, USHORT domain, const char *xs_base, uint32_t ring_ref)
+/*
+ * Write a XenStore entry that the peer domain is allowed to read.
+ */
+int store_write_peer(struct libxenvchan *ctrl, USHORT domain, const char *path, const char *value)
 {
-    int ret = -1;
     XENIFACE_STORE_PERMISSION perms[2];
-    char buf[64];
-    char ref[16];
     char domid_str[16];
     DWORD status;
 
-    status = XcStoreRead(ctrl->xc, "domid", sizeof(domid_str), domid_str);
+    status = ctrl->backend->store_read(ctrl->xc, "domid", sizeof(domid_str), domid_str);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to read own domid from xenstore: 0x%x", status);
-        goto fail;
+        return -1;
     }
 
     // owner domain is us
@@ -359,47 +460,58 @@ static int init_xs_srv(struct libxenvchan *ctrl, USHORT domain, const char *xs_b
     perms[1].Domain = domain;
     perms[1].Mask = XENIFACE_STORE_PERM_READ;
 
-    snprintf(ref, sizeof(ref), "%d", ring_ref);
-    snprintf(buf, sizeof(buf), "%s/ring-ref", xs_base);
-
-    status = XcStoreWrite(ctrl->xc, buf, ref);
+    status = ctrl->backend->store_write(ctrl->xc, path, value);
     if (status != ERROR_SUCCESS)
     {
-        Log(XLL_ERROR, "store write (%S, %S) failed: 0x%x", buf, ref, status);
-        goto fail;
+        Log(XLL_ERROR, "store write (%S, %S) failed: 0x%x", path, value, status);
+        return -1;
     }
 
-    status = XcStoreSetPermissions(ctrl->xc, buf, 2, perms);
+    status = ctrl->backend->store_set_permissions(ctrl->xc, path, 2, perms);
     if (status != ERROR_SUCCESS)
     {
-        Log(XLL_ERROR, "failed to set store permissions on '%S': 0x%x", buf, status);
-        goto fail;
+        Log(XLL_ERROR, "failed to set store permissions on '%S': 0x%x", path, status);
+        return -1;
     }
 
+    return 0;
+}
+
+static int init_xs_srv(struct libxenvchan *ctrl, USHORT domain, const char *xs_base, uint32_t ring_ref, uint32_t resize_ref, uint32_t index_ref)
+{
+    char buf[64];
+    char ref[16];
+
+    snprintf(ref, sizeof(ref), "%d", ring_ref);
+    snprintf(buf, sizeof(buf), "%s/ring-ref", xs_base);
+    if (store_write_peer(ctrl, domain, buf, ref))
+        return -1;
+
     snprintf(ref, sizeof(ref), "%d", ctrl->event_port);
     snprintf(buf, sizeof(buf), "%s/event-channel", xs_base);
+    if (store_write_peer(ctrl, domain, buf, ref))
+        return -1;
 
-    status = XcStoreWrite(ctrl->xc, buf, ref);
-    if (status != ERROR_SUCCESS)
-    {
-        Log(XLL_ERROR, "store write (%S, %S) failed: 0x%x", buf, ref, status);
-        goto fail;
-    }
+    // clients that don't know about directory pages must not map large rings;
+    // any ring can become large through a resize, so always advertise them
+    snprintf(buf, sizeof(buf), "%s/indirect-grants", xs_base);
+    if (store_write_peer(ctrl, domain, buf, "1"))
+        return -1;
 
-    status = XcStoreSetPermissions(ctrl->xc, buf, 2, perms);
-    if (status != ERROR_SUCCESS)
-    {
-        Log(XLL_ERROR, "failed to set store permissions on '%S': 0x%x", buf, status);
-        goto fail;
-    }
+    snprintf(ref, sizeof(ref), "%d", resize_ref);
+    snprintf(buf, sizeof(buf), "%s/resize-ref", xs_base);
+    if (store_write_peer(ctrl, domain, buf, ref))
+        return -1;
 
-    ret = 0;
+    snprintf(ref, sizeof(ref), "%d", index_ref);
+    snprintf(buf, sizeof(buf), "%s/index-ref", xs_base);
+    if (store_write_peer(ctrl, domain, buf, ref))
+        return -1;
 
-fail:
-    return ret;
+    return 0;
 }
 
-static int min_order(int size)
+int min_order(int size)
 {
     int rv = PAGE_SHIFT;
 
@@ -412,10 +524,10 @@ static int min_order(int size)
 struct libxenvchan *libxenvchan_server_init(XENCONTROL_LOGGER *logger, int domain, const char *xs_path, size_t left_min, size_t right_min)
 {
     struct libxenvchan *ctrl;
-    uint32_t ring_ref;
+    uint32_t ring_ref, resize_ref, index_ref;
     DWORD status;
 
-    if (left_min > MAX_RING_SIZE || right_min > MAX_RING_SIZE)
+    if (left_min > MAX_INDIRECT_RING_SIZE || right_min > MAX_INDIRECT_RING_SIZE)
         return NULL;
 
     ctrl = malloc(sizeof(*ctrl));
@@ -426,6 +538,8 @@ struct libxenvchan *libxenvchan_server_init(XENCONTROL_LOGGER *logger, int domai
     ctrl->logger = logger;
     ctrl->is_server = 1;
     ctrl->server_persist = 0;
+    ctrl->domain = (USHORT)domain;
+    ctrl->backend = current_backend();
 
     ctrl->read.order = min_order((int)left_min);
     ctrl->write.order = min_order((int)right_min);
@@ -450,7 +564,7 @@ struct libxenvchan *libxenvchan_server_init(XENCONTROL_LOGGER *logger, int domai
         ctrl->write.order = LARGE_RING_SHIFT;
     }
 
-    status = XcOpen(logger, &ctrl->xc);
+    status = ctrl->backend->open(logger, &ctrl->xc);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to open xencontrol: 0x%x", status);
@@ -471,7 +585,19 @@ struct libxenvchan *libxenvchan_server_init(XENCONTROL_LOGGER *logger, int domai
     if (ring_ref == ~0ul)
         goto out;
 
-    if (init_xs_srv(ctrl, (USHORT)domain, xs_path, ring_ref))
+    resize_ref = resize_init_srv(ctrl);
+    if (resize_ref == ~0ul)
+        goto out;
+
+    // 0 if there is no index page, and clients keep to version 1
+    index_ref = indexes_init_srv(ctrl);
+
+    // set before publishing anything, so that a failure below cleans up too
+    ctrl->xs_path = _strdup(xs_path);
+    if (!ctrl->xs_path)
+        goto out;
+
+    if (init_xs_srv(ctrl, (USHORT)domain, xs_path, ring_ref, resize_ref, index_ref))
         goto out;
 
     Log(XLL_DEBUG, "returning %p", ctrl);
@@ -494,7 +620,10 @@ static int init_evt_cli(struct libxenvchan *ctrl, USHORT domain)
         goto fail;
     }
 
-    status = XcEvtchnBindInterdomain(ctrl->xc, domain, ctrl->event_port, ctrl->event, FALSE, &port);
+    if (init_wakeups(ctrl))
+        goto fail;
+
+    status = ctrl->backend->evtchn_bind_interdomain(ctrl->xc, domain, ctrl->event_port, ctrl->event, FALSE, &port);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to bind event channel (%u, %u): 0x%x", domain, ctrl->event_port, status);
@@ -520,6 +649,7 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
     struct libxenvchan *ctrl = malloc(sizeof(struct libxenvchan));
     char buf[64], ref[64];
     uint32_t ring_ref;
+    int max_shift = MAX_RING_SHIFT;
     DWORD status;
 
     if (!ctrl)
@@ -529,8 +659,10 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
     ctrl->logger = logger;
     ctrl->write.order = ctrl->read.order = 0;
     ctrl->is_server = 0;
+    ctrl->domain = (USHORT)domain;
+    ctrl->backend = current_backend();
 
-    status = XcOpen(logger, &ctrl->xc);
+    status = ctrl->backend->open(logger, &ctrl->xc);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to open xencontrol: 0x%x", status);
@@ -546,7 +678,7 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
 
     // find xenstore entry
     snprintf(buf, sizeof buf, "%s/ring-ref", xs_path);
-    status = XcStoreRead(ctrl->xc, buf, sizeof(ref), ref);
+    status = ctrl->backend->store_read(ctrl->xc, buf, sizeof(ref), ref);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to read '%s' from store: 0x%x", buf, status);
@@ -558,7 +690,7 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
         goto fail;
 
     snprintf(buf, sizeof buf, "%s/event-channel", xs_path);
-    status = XcStoreRead(ctrl->xc, buf, sizeof(ref), ref);
+    status = ctrl->backend->store_read(ctrl->xc, buf, sizeof(ref), ref);
     if (status != ERROR_SUCCESS)
     {
         Log(XLL_ERROR, "failed to read '%s' from store: 0x%x", buf, status);
@@ -571,14 +703,32 @@ struct libxenvchan *libxenvchan_client_init(XENCONTROL_LOGGER *logger, int domai
 
     Log(XLL_DEBUG, "ring-ref %u, event-channel %u", ring_ref, ctrl->event_port);
 
+    // large rings are only used if the server says their grants are indirect
+    snprintf(buf, sizeof buf, "%s/indirect-grants", xs_path);
+    status = ctrl->backend->store_read(ctrl->xc, buf, sizeof(ref), ref);
+    if (status == ERROR_SUCCESS && atoi(ref) == 1)
+        max_shift = MAX_INDIRECT_RING_SHIFT;
+
     // set up event channel
     if (init_evt_cli(ctrl, (USHORT)domain))
         goto fail;
 
     // set up shared page(s)
-    if (init_gnt_cli(ctrl, (USHORT)domain, ring_ref))
+    if (init_gnt_cli(ctrl, (USHORT)domain, ring_ref, max_shift))
         goto fail;
 
+    // live resizing is optional
+    snprintf(buf, sizeof buf, "%s/resize-ref", xs_path);
+    status = ctrl->backend->store_read(ctrl->xc, buf, sizeof(ref), ref);
+    if (status == ERROR_SUCCESS && atoi(ref))
+        resize_init_cli(ctrl, atoi(ref));
+
+    // so is the version 2 index layout; without it the indexes stay in the shared page
+    snprintf(buf, sizeof buf, "%s/index-ref", xs_path);
+    status = ctrl->backend->store_read(ctrl->xc, buf, sizeof(ref), ref);
+    if (status == ERROR_SUCCESS && atoi(ref))
+        indexes_init_cli(ctrl, atoi(ref));
+
     ctrl->ring->cli_live = 1;
     ctrl->ring->srv_notify = VCHAN_NOTIFY_WRITE;
 
@@ -31,36 +31,35 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <intrin.h>
 
-#include "libxenvchan.h"
+#include "private.h"
 
-#ifndef PAGE_SHIFT
-#define PAGE_SHIFT 12
-#endif
+/* smallest polling budget that libxenvchan_wait will shrink to */
+#define SPIN_MIN_USEC 2
 
-#ifndef PAGE_SIZE
-#define PAGE_SIZE 4096
-#endif
+/* rounds of polling in busy poll mode between looks at the rest of the vchan */
+#define BUSY_POLL_SPINS 1024
 
-static void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvchan *ctrl, PWCHAR format, ...)
-{
-    va_list args;
-
-    if (!ctrl)
-        return;
+/* multi-producer sends that can be filling the write ring at the same time */
+#define MP_SLOTS 64
 
-    if (!ctrl->logger)
-        return;
+/* tickets are 31 bits, above the ring index in mp_reserve */
+#define MP_TICKET_MASK 0x7fffffffu
+#define MP_CLOSED (1ull << 63)
 
-    va_start(args, format);
-    ctrl->logger(logLevel, function, format, args);
-    va_end(args);
-}
+struct libxenvchan_mp_slot {
+    /* ticket of the send that last filled its data in */
+    volatile LONG ticket;
+    /* ring index just past that data */
+    uint32_t end;
+};
 
-#define Log(level, msg, ...) _Log(level, __FUNCTION__, ctrl, L"(%p) " L##msg L"\n", ctrl, __VA_ARGS__)
+/* notification deadline used when only a byte threshold is given */
+#define NOTIFY_DEFAULT_USEC 1000
 
 #define inline __inline
 #define xen_mb()  _ReadWriteBarrier()
@@ -70,26 +69,58 @@ static void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvch
 #define __sync_or_and_fetch(a, b)   ((*(a)) |= (b))
 #define __sync_fetch_and_and        InterlockedAnd8
 
+/*
+ * The counters are updated by the reader and the writer (or several writers
+ * in multi-producer mode) at the same time, so only with interlocked
+ * operations.
+ */
+static inline void stat_add(uint64_t *counter, uint64_t value)
+{
+    InterlockedExchangeAdd64((volatile LONG64 *)counter, (LONG64)value);
+}
+
+static inline void stat_max(uint32_t *counter, uint32_t value)
+{
+    uint32_t old = *(volatile uint32_t *)counter;
+    uint32_t seen;
+
+    while (old < value)
+    {
+        seen = (uint32_t)InterlockedCompareExchange((volatile LONG *)counter, (LONG)value, (LONG)old);
+        if (seen == old)
+            break;
+        old = seen;
+    }
+}
+
+/* the 64-bit counters, which come first in struct libxenvchan_stats */
+#define STATS_COUNTERS (offsetof(struct libxenvchan_stats, max_write_fill) / sizeof(uint64_t))
+
+static inline uint64_t mp_pack(uint32_t ticket, uint32_t idx)
+{
+    return (uint64_t)(ticket & MP_TICKET_MASK) << 32 | idx;
+}
+
 static inline uint32_t rd_prod(struct libxenvchan *ctrl)
 {
-    return ctrl->read.shr->prod;
+    return *ctrl->read.prod;
 }
 
 static inline uint32_t* _rd_cons(struct libxenvchan *ctrl)
 {
-    return &ctrl->read.shr->cons;
+    return ctrl->read.cons;
 }
 #define rd_cons(x) (*_rd_cons(x))
 
 static inline uint32_t* _wr_prod(struct libxenvchan *ctrl)
 {
-    return &ctrl->write.shr->prod;
+    return ctrl->write.prod;
 }
 #define wr_prod(x) (*_wr_prod(x))
 
 static inline uint32_t wr_cons(struct libxenvchan *ctrl)
 {
-    return ctrl->write.shr->cons;
+    return *ctrl->write.cons;
 }
 
 static inline const void* rd_ring(struct libxenvchan *ctrl)
@@ -102,27 +133,180 @@ static inline void* wr_ring(struct libxenvchan *ctrl)
     return ctrl->write.buffer;
 }
 
-static inline uint32_t wr_ring_size(struct libxenvchan *ctrl)
+/**
+ * Advance a live resize of ring if it is waiting for this side, unless a
+ * peek or reservation still points into the buffer it would switch from.
+ */
+static inline void resize_poll(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    if (ctrl->resize && !ring->mapped)
+        resize_update(ctrl, ring);
+}
+
+/* advance a live resize of either ring, for callers that own both */
+static inline void resize_poll_all(struct libxenvchan *ctrl)
+{
+    resize_poll(ctrl, &ctrl->read);
+    resize_poll(ctrl, &ctrl->write);
+}
+
+/**
+ * Move this side's index of ring to the index page, or follow the peer's,
+ * if the version 2 layout is being negotiated. On a server, move them back
+ * once the client has moved its own back; moved shares a line with the
+ * client's index, which is being read anyway.
+ */
+static inline void indexes_poll(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    if (ring->split)
+        indexes_update(ctrl, ring);
+    else if (ring->peer_line && !ring->peer_line->moved && ctrl->is_server)
+        indexes_reset(ctrl, ring);
+}
+
+/**
+ * On a server, give the indexes of ring back to vchan_interface once the
+ * client that moved them has gone, even without moving its own back. ring is
+ * the ring the caller owns, or NULL for both.
+ */
+static inline void indexes_check(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
 {
-    return (1 << ctrl->write.order);
+    if (ring != &ctrl->write && ctrl->read.peer_line && ctrl->is_server)
+        indexes_reset(ctrl, &ctrl->read);
+    if (ring != &ctrl->read && ctrl->write.peer_line && ctrl->is_server)
+        indexes_reset(ctrl, &ctrl->write);
 }
 
-static inline uint32_t rd_ring_size(struct libxenvchan *ctrl)
+static inline void trace_event(struct libxenvchan *ctrl, uint8_t type, uint8_t arg, uint32_t value)
 {
-    return (1 << ctrl->read.order);
+    struct libxenvchan_trace *trace = trace_get(ctrl);
+
+    if (trace)
+        trace_record(trace, type, arg, value);
 }
 
 static inline void request_notify(struct libxenvchan *ctrl, uint8_t bit)
 {
     uint8_t *notify = ctrl->is_server ? &ctrl->ring->cli_notify : &ctrl->ring->srv_notify;
 
+    /* a busy polling side notices progress by itself */
+    if (ctrl->busy_poll)
+        return;
+
     __sync_or_and_fetch(notify, bit);
     xen_mb(); /* post the request /before/ caller re-reads any indexes */
+    trace_event(ctrl, LIBXENVCHAN_TRACE_REQUEST, bit,
+                bit == VCHAN_NOTIFY_WRITE ? rd_prod(ctrl) : wr_cons(ctrl));
+}
+
+/**
+ * Ask the writer to notify us once wake bytes are ready. A writer on the
+ * version 2 index layout holds its notifications back until then; any other
+ * writer notifies every write.
+ */
+static inline void request_data(struct libxenvchan *ctrl, size_t wake)
+{
+    struct vchan_index_line *line = ctrl->read.own_line;
+
+    if (line)
+    {
+        if (wake > rd_ring_size(ctrl))
+            wake = rd_ring_size(ctrl);
+        line->event = rd_cons(ctrl) + (uint32_t)wake;
+    }
+
+    request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+
+    if (line)
+        MemoryBarrier(); /* the writer reads the event /after/ moving wr_prod */
+}
+
+/**
+ * Has the reader, if it said how much it is waiting for (see request_data()),
+ * got that much? An event index left behind by a reader that went on to
+ * consume without asking again counts as reached.
+ */
+static inline int wakes_reader(struct libxenvchan *ctrl)
+{
+    struct vchan_index_line *line = ctrl->write.peer_line;
+
+    if (!line)
+        return 1;
+
+    MemoryBarrier(); /* move wr_prod /then/ read the reader's event */
+    return (int32_t)(wr_prod(ctrl) - line->event) >= 0;
+}
+
+/**
+ * Ask the reader to notify us once wake bytes of space are free, the
+ * counterpart of request_data().
+ */
+static inline void request_space(struct libxenvchan *ctrl, size_t wake)
+{
+    struct vchan_index_line *line = ctrl->write.own_line;
+
+    if (line)
+    {
+        if (wake > wr_ring_size(ctrl))
+            wake = wr_ring_size(ctrl);
+        line->event = wr_prod(ctrl) - wr_ring_size(ctrl) + (uint32_t)wake;
+    }
+
+    request_notify(ctrl, VCHAN_NOTIFY_READ);
+
+    if (line)
+        MemoryBarrier(); /* the reader reads the event /after/ moving rd_cons */
+}
+
+/**
+ * Has the writer, if it said how much space it is waiting for (see
+ * request_space()), got that much?
+ */
+static inline int wakes_writer(struct libxenvchan *ctrl)
+{
+    struct vchan_index_line *line = ctrl->read.peer_line;
+
+    if (!line)
+        return 1;
+
+    MemoryBarrier(); /* move rd_cons /then/ read the writer's event */
+    return (int32_t)(rd_cons(ctrl) - line->event) >= 0;
+}
+
+/**
+ * How much a read of size bytes waits for, see libxenvchan_set_read_watermark()
+ */
+static inline size_t read_wake(struct libxenvchan *ctrl, size_t size)
+{
+    size_t wake = ctrl->read_watermark > 0 ? (size_t)ctrl->read_watermark : 1;
+
+    if (wake > size)
+        wake = size;
+    if (wake > rd_ring_size(ctrl))
+        wake = rd_ring_size(ctrl);
+    return wake ? wake : 1;
+}
+
+/**
+ * How much space a write of size bytes waits for, see
+ * libxenvchan_set_write_watermark()
+ */
+static inline size_t write_wake(struct libxenvchan *ctrl, size_t size)
+{
+    size_t wake = ctrl->write_watermark > 0 ? (size_t)ctrl->write_watermark : 1;
+
+    if (wake > size)
+        wake = size;
+    if (wake > wr_ring_size(ctrl))
+        wake = wr_ring_size(ctrl);
+    return wake ? wake : 1;
 }
 
 static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 {
+    struct libxenvchan_histograms *hist = hist_get(ctrl);
     uint8_t *notify, prev;
+    uint64_t start;
     DWORD status;
 
     xen_mb(); /* caller updates indexes /before/ we decode to notify */
@@ -131,7 +315,18 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 
     if (prev & bit)
     {
-        status = XcEvtchnNotify(ctrl->xc, ctrl->event_port);
+        stat_add(&ctrl->stats.notifies_sent, 1);
+        trace_event(ctrl, LIBXENVCHAN_TRACE_NOTIFY, bit, 0);
+        if (!hist)
+        {
+            status = ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+        }
+        else
+        {
+            start = now_nsec();
+            status = ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+            hist_record(&hist->notify, now_nsec() - start);
+        }
         if (status == ERROR_SUCCESS)
             return 0;
 
@@ -140,8 +335,123 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
     }
     else
     {
+        stat_add(&ctrl->stats.notifies_skipped, 1);
+        trace_event(ctrl, LIBXENVCHAN_TRACE_SKIP, bit, 0);
+        return 0;
+    }
+}
+
+/*
+ * Take what is held back on ring; returns nonzero if anything was. The timer,
+ * uncork and a wait on the other ring take it as well as the thread moving
+ * the index, so the deadline is cleared first: bytes added after that either
+ * go with this notification or start a new deadline of their own.
+ */
+static int take_pending(struct libxenvchan_ring *ring)
+{
+    InterlockedExchange64(&ring->pending_since, 0);
+    return InterlockedExchange(&ring->pending, 0) != 0;
+}
+
+/*
+ * send_notify() for the moderation timers. They run on a thread pool thread
+ * while the reader and writer keep going, so they leave the histograms those
+ * update alone; the counters and trace_record() are updated atomically.
+ */
+static void timer_notify(struct libxenvchan *ctrl, uint8_t bit)
+{
+    uint8_t *notify, prev;
+    DWORD status;
+
+    xen_mb();
+    notify = ctrl->is_server ? &ctrl->ring->srv_notify : &ctrl->ring->cli_notify;
+    prev = __sync_fetch_and_and(notify, ~bit);
+    if (!(prev & bit))
+        return;
+
+    stat_add(&ctrl->stats.notifies_sent, 1);
+    trace_event(ctrl, LIBXENVCHAN_TRACE_NOTIFY, bit, 0);
+    status = ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+    if (status != ERROR_SUCCESS)
+        Log(XLL_ERROR, "failed to notify event channel %u: 0x%x", ctrl->event_port, status);
+}
+
+static VOID CALLBACK wr_notify_timer_cb(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+    struct libxenvchan *ctrl = context;
+
+    /* deadline reached: signal anything that is still held back */
+    if (take_pending(&ctrl->write))
+        timer_notify(ctrl, VCHAN_NOTIFY_WRITE);
+}
+
+static VOID CALLBACK rd_notify_timer_cb(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_TIMER timer)
+{
+    struct libxenvchan *ctrl = context;
+
+    if (take_pending(&ctrl->read))
+        timer_notify(ctrl, VCHAN_NOTIFY_READ);
+}
+
+static void arm_notify_timer(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    ULARGE_INTEGER due;
+    FILETIME ft;
+
+    /* negative due time is relative, in 100ns units */
+    due.QuadPart = (ULONGLONG)(-(LONGLONG)ctrl->notify_usec * 10);
+    ft.dwLowDateTime = due.LowPart;
+    ft.dwHighDateTime = due.HighPart;
+    SetThreadpoolTimer(ring->notify_timer, &ft, 0, 0);
+}
+
+/**
+ * Account for an index update of size bytes to ring under the moderation
+ * policy. Each ring keeps its own deadline, so that updates held back in one
+ * direction don't put off those of the other.
+ * returns 1 if the notification should be held back, 0 to send it now.
+ */
+static inline int moderate_notify(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, size_t size)
+{
+    uint32_t pending;
+    uint64_t since;
+    uint64_t now;
+
+    if (!ctrl->notify_bytes && !ctrl->notify_usec)
         return 0;
+
+    pending = (uint32_t)InterlockedExchangeAdd(&ring->pending, (LONG)size) + (uint32_t)size;
+    now = now_usec();
+
+    /* the first update held back starts the deadline */
+    since = (uint64_t)InterlockedCompareExchange64(&ring->pending_since, (LONG64)now, 0);
+    if (!since)
+    {
+        since = now;
+        arm_notify_timer(ctrl, ring);
     }
+
+    if ((!ctrl->notify_bytes || pending < (uint32_t)ctrl->notify_bytes) &&
+        now - since < (uint64_t)ctrl->notify_usec)
+        return 1;
+
+    /* if someone else took it, they have sent the notification */
+    return !take_pending(ring);
+}
+
+/**
+ * Send any notifications held back by corking or moderation.
+ */
+static int flush_notify(struct libxenvchan *ctrl)
+{
+    int write = take_pending(&ctrl->write) || ctrl->corked;
+    int read = take_pending(&ctrl->read);
+
+    if (write && send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+        return -1;
+    if (read && send_notify(ctrl, VCHAN_NOTIFY_READ))
+        return -1;
+    return 0;
 }
 
 /*
@@ -150,7 +460,13 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
  */
 static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 {
-    uint32_t ready = rd_prod(ctrl) - rd_cons(ctrl);
+    uint32_t ready;
+
+    /* what wait_ring() compares against; wakeups /then/ the index */
+    ctrl->read.seen_wakeups = ctrl->wakeups;
+    xen_rmb();
+    ctrl->read.seen = rd_prod(ctrl);
+    ready = ctrl->read.seen - rd_cons(ctrl);
 
     xen_mb(); /* Ensure 'ready' is read only once. */
 
@@ -165,26 +481,32 @@ static inline int raw_get_data_ready(struct libxenvchan *ctrl)
 }
 
 /**
- * Get the amount of buffer space available and enable notifications if needed.
+ * Get the amount of data available and enable notifications if it is less
+ * than request, to be signalled once wake bytes are available.
  */
-static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request)
+static inline int fast_get_data_ready(struct libxenvchan *ctrl, size_t request, size_t wake)
 {
     int ready;
 
+    resize_poll(ctrl, &ctrl->read);
+    indexes_poll(ctrl, &ctrl->read);
     ready = raw_get_data_ready(ctrl);
     if (ready >= request)
     {
+        stat_max(&ctrl->stats.max_read_fill, (uint32_t)ready);
         return ready;
     }
 
     /* We plan to consume all data; please tell us if you send more */
-    request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+    request_data(ctrl, wake);
     /*
      * If the writer moved rd_prod after our read but before request, we
      * will not get notified even though the actual amount of data ready is
      * above request. Reread rd_prod to cover this case.
      */
     ready = raw_get_data_ready(ctrl);
+    if (ready < request)
+        stat_add(&ctrl->stats.ring_empty, 1);
     return ready;
 }
 
@@ -194,7 +516,9 @@ int libxenvchan_data_ready(struct libxenvchan *ctrl)
      * when it changes
      */
     int ready;
-    request_notify(ctrl, VCHAN_NOTIFY_WRITE);
+    resize_poll(ctrl, &ctrl->read);
+    indexes_poll(ctrl, &ctrl->read);
+    request_data(ctrl, read_wake(ctrl, rd_ring_size(ctrl)));
     ready = raw_get_data_ready(ctrl);
     return ready;
 }
@@ -205,7 +529,17 @@ int libxenvchan_data_ready(struct libxenvchan *ctrl)
  */
 static inline int raw_get_buffer_space(struct libxenvchan *ctrl)
 {
-    uint32_t ready = wr_ring_size(ctrl) - (wr_prod(ctrl) - wr_cons(ctrl));
+    uint32_t ready;
+
+    ctrl->write.seen_wakeups = ctrl->wakeups;
+    xen_rmb();
+    ctrl->write.seen = wr_cons(ctrl);
+
+    /* nothing goes into a resized ring until the reader has moved to it */
+    if (ctrl->write.switching)
+        return 0;
+
+    ready = wr_ring_size(ctrl) - (wr_prod(ctrl) - ctrl->write.seen);
 
     xen_mb(); /* Ensure 'ready' is read only once. */
 
@@ -220,24 +554,49 @@ static inline int raw_get_buffer_space(struct libxenvchan *ctrl)
 }
 
 /**
- * Get the amount of buffer space available and enable notifications if needed.
+ * Record the publish-to-consume gap of the sampled publish once the reader
+ * has consumed it.
+ */
+static inline void gap_check(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_histograms *hist;
+
+    if (ctrl->gap_start && (int32_t)(wr_cons(ctrl) - ctrl->gap_idx) >= 0)
+    {
+        hist = hist_get(ctrl);
+        if (hist)
+            hist_record(&hist->gap, now_nsec() - ctrl->gap_start);
+        ctrl->gap_start = 0;
+    }
+}
+
+/**
+ * Get the amount of buffer space available and enable notifications if it
+ * is less than request, to be signalled once wake bytes are free.
  */
-static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request)
+static inline int fast_get_buffer_space(struct libxenvchan *ctrl, size_t request, size_t wake)
 {
-    int ready = raw_get_buffer_space(ctrl);
+    int ready;
+
+    resize_poll(ctrl, &ctrl->write);
+    indexes_poll(ctrl, &ctrl->write);
+    gap_check(ctrl);
+    ready = raw_get_buffer_space(ctrl);
 
     if (ready >= request)
     {
         return ready;
     }
     /* We plan to fill the buffer; please tell us when you've read it */
-    request_notify(ctrl, VCHAN_NOTIFY_READ);
+    request_space(ctrl, wake);
     /*
      * If the reader moved wr_cons after our read but before request, we
      * will not get notified even though the actual amount of buffer space
      * is above request. Reread wr_cons to cover this case.
      */
     ready = raw_get_buffer_space(ctrl);
+    if (ready < request)
+        stat_add(&ctrl->stats.ring_full, 1);
     return ready;
 }
 
@@ -247,123 +606,424 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
      * when it changes
      */
     int ready;
-    request_notify(ctrl, VCHAN_NOTIFY_READ);
+    resize_poll(ctrl, &ctrl->write);
+    indexes_poll(ctrl, &ctrl->write);
+    request_space(ctrl, write_wake(ctrl, wr_ring_size(ctrl)));
     ready = raw_get_buffer_space(ctrl);
     return ready;
 }
 
-int libxenvchan_wait(struct libxenvchan *ctrl)
+/* is a resize of either ring asked for or under way? */
+static inline int resizing(struct libxenvchan *ctrl)
 {
-    DWORD ret;
-
-    ret = WaitForSingleObject(ctrl->event, INFINITE);
-    if (ret != WAIT_OBJECT_0)
-    {
-        Log(XLL_ERROR, "WaitForSingleObject failed: 0x%x", ret);
-        return -1;
-    }
-    return 0;
+    return ctrl->resize &&
+        (ctrl->resize->left.state != VCHAN_RESIZE_IDLE || ctrl->resize->right.state != VCHAN_RESIZE_IDLE ||
+         ctrl->resize->left.req_order || ctrl->resize->right.req_order);
 }
 
 /**
- * returns -1 on error, or size on success
- *
- * caller must have checked that enough space is available
+ * Called after taking a notification off the shared event: pass it on to a
+ * thread blocked in wait_ring() if the index it waits for has moved, or if
+ * it can't be told from the index alone (the vchan closed, a resize or the
+ * version 2 layout is under way). A reactor polls the vchan itself, so it is
+ * always passed on.
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+void wake_waiters(struct libxenvchan *ctrl)
 {
-    int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
-    size_t avail_contig = wr_ring_size(ctrl) - real_idx;
+    HANDLE reactor = ctrl->reactor_wakeup;
+    int busy;
 
-    if (avail_contig > size)
-        avail_contig = size;
+    /* count the wakeup /then/ look for waiters, see wait_ring() */
+    InterlockedIncrement(&ctrl->wakeups);
+    busy = !libxenvchan_is_open(ctrl) || resizing(ctrl);
 
-    xen_mb(); /* read indexes /then/ write data */
-    memcpy((uint8_t*)wr_ring(ctrl) + real_idx, data, avail_contig);
+    if (ctrl->read.waiting && (busy || ctrl->read.split || rd_prod(ctrl) != ctrl->read.seen))
+        SetEvent(ctrl->read.wakeup);
+
+    if (ctrl->write.waiting && (busy || ctrl->write.split || wr_cons(ctrl) != ctrl->write.seen))
+        SetEvent(ctrl->write.wakeup);
+
+    if (reactor)
+        SetEvent(reactor);
+}
+
+/**
+ * Poll the indexes the peer updates for at most spin_budget microseconds.
+ * returns 1 if the peer made progress (or closed) while polling, 0 otherwise.
+ * The budget is adjusted so that it covers the typical time to progress.
+ */
+static int spin_wait(struct libxenvchan *ctrl)
+{
+    uint32_t prod = rd_prod(ctrl);
+    uint32_t cons = wr_cons(ctrl);
+    int budget = ctrl->spin_budget;
+    uint64_t start, elapsed;
 
-    if (avail_contig < size)
+    if (budget < SPIN_MIN_USEC || budget > ctrl->spin_usec)
+        budget = ctrl->spin_usec;
+
+    start = now_usec();
+    while (1)
     {
-        // we rolled across the end of the ring
-        memcpy(wr_ring(ctrl), (uint8_t*)data + avail_contig, size - avail_contig);
+        YieldProcessor();
+        xen_rmb();
+
+        if (rd_prod(ctrl) != prod || wr_cons(ctrl) != cons || !libxenvchan_is_open(ctrl))
+            break;
+
+        elapsed = now_usec() - start;
+        if (elapsed >= (uint64_t)budget)
+        {
+            /* peer is slower than we hoped; spin less next time */
+            budget -= budget / 4;
+            ctrl->spin_budget = max(budget, min(SPIN_MIN_USEC, ctrl->spin_usec));
+            return 0;
+        }
     }
 
-    xen_wmb(); /* write data /then/ notify */
-    wr_prod(ctrl) += (uint32_t)size;
+    /* aim for twice the observed latency so that most waits are covered */
+    elapsed = now_usec() - start;
+    budget += ((int)elapsed * 2 - budget) / 4;
+    ctrl->spin_budget = min(max(budget, SPIN_MIN_USEC), ctrl->spin_usec);
 
-    if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+    /* the notification for this change (if any) is now stale */
+    if (WaitForSingleObject(ctrl->event, 0) == WAIT_OBJECT_0)
+        wake_waiters(ctrl);
+    return 1;
+}
+
+/**
+ * Poll the indexes the peer updates with nothing to fall back on, for
+ * busy_poll. Gives up after BUSY_POLL_SPINS rounds anyway, so that the
+ * caller gets to look at resizes and index moves in between.
+ */
+static void busy_wait(struct libxenvchan *ctrl)
+{
+    uint32_t prod = rd_prod(ctrl);
+    uint32_t cons = wr_cons(ctrl);
+    int i;
+
+    for (i = 0; i < BUSY_POLL_SPINS; i++)
     {
-        Log(XLL_ERROR, "send_notify failed");
-        return -1;
-    }
+        YieldProcessor();
+        xen_rmb();
 
-    return (int)size;
+        // busy_poll is checked too: a waiter that stops polling must go back and ask to be notified
+        if (rd_prod(ctrl) != prod || wr_cons(ctrl) != cons || !ctrl->busy_poll || !libxenvchan_is_open(ctrl))
+            break;
+    }
 }
 
 /**
- * returns 0 if no buffer space is available, -1 on error, or size on success
+ * Block until the shared event fires or, for a thread waiting on ring, until
+ * the thread waiting on the other ring passes on a notification for it.
+ * returns -1 on error, 0 otherwise
  */
-int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
+static int block(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
 {
-    int avail;
-    int sent;
+    HANDLE events[2];
+    DWORD ret;
 
-    while (1)
+    if (!ring)
     {
-        if (!libxenvchan_is_open(ctrl))
+        ret = WaitForSingleObject(ctrl->event, INFINITE);
+        if (ret != WAIT_OBJECT_0)
         {
-            Log(XLL_ERROR, "vchan not open");
+            Log(XLL_ERROR, "WaitForSingleObject failed: 0x%x", ret);
             return -1;
         }
+        wake_waiters(ctrl);
+        return 0;
+    }
 
-        avail = fast_get_buffer_space(ctrl, size);
-        if (size <= avail)
-        {
-            sent = do_send(ctrl, data, size);
-            return sent;
-        }
+    ring->waiting = 1;
+    MemoryBarrier(); /* say we wait /then/ count wakeups, see wake_waiters() */
 
-        if (!ctrl->blocking)
-        {
-            return 0;
-        }
+    /* a notification taken since the caller looked may have been for us */
+    if (ctrl->wakeups != ring->seen_wakeups)
+    {
+        ring->waiting = 0;
+        return 0;
+    }
 
-        if (size > wr_ring_size(ctrl))
-        {
-            Log(XLL_ERROR, "size > wr_ring_size(ctrl)");
-            return -1;
-        }
+    events[0] = ctrl->event;
+    events[1] = ring->wakeup;
+    ret = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+    ring->waiting = 0;
 
-        if (libxenvchan_wait(ctrl))
-        {
-            Log(XLL_ERROR, "wait failed");
-            return -1;
-        }
+    if (ret == WAIT_OBJECT_0)
+    {
+        wake_waiters(ctrl);
+    }
+    else if (ret != WAIT_OBJECT_0 + 1)
+    {
+        Log(XLL_ERROR, "WaitForMultipleObjects failed: 0x%x", ret);
+        return -1;
     }
+    return 0;
 }
 
-int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+static int do_wait(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
 {
-    size_t avail;
-    int sent;
-
-    if (!libxenvchan_is_open(ctrl))
+    uint32_t prod = rd_prod(ctrl);
+    uint32_t cons = wr_cons(ctrl);
+    struct libxenvchan_histograms *hist = hist_get(ctrl);
+    uint64_t start = hist ? now_nsec() : 0;
+    int spurious = 0;
+
+    stat_add(&ctrl->stats.waits, 1);
+    trace_event(ctrl, LIBXENVCHAN_TRACE_WAIT, 0, prod);
+
+    /* callers of libxenvchan_wait() own both rings; keep their resizes going */
+    if (!ring)
+        resize_poll_all(ctrl);
+    indexes_check(ctrl, ring);
+
+    /* the peer may be waiting for updates we haven't told it about yet */
+    if (flush_notify(ctrl))
     {
-        Log(XLL_ERROR, "vchan not open");
+        Log(XLL_ERROR, "send_notify failed");
         return -1;
     }
 
-    if (ctrl->blocking)
+    if (ctrl->busy_poll)
     {
-        size_t pos = 0;
+        busy_wait(ctrl);
+        goto out;
+    }
 
-        while (1)
-        {
-            avail = fast_get_buffer_space(ctrl, size - pos);
+    if (ctrl->spin_usec > 0 && spin_wait(ctrl))
+        goto out;
 
-            if (pos + avail > size)
-                avail = size - pos;
+    if (block(ctrl, ring))
+        return -1;
 
-            if (avail)
+    xen_rmb();
+    spurious = rd_prod(ctrl) == prod && wr_cons(ctrl) == cons && libxenvchan_is_open(ctrl);
+    if (spurious)
+        stat_add(&ctrl->stats.spurious_wakeups, 1);
+
+out:
+    if (!ring)
+        resize_poll_all(ctrl);
+    indexes_check(ctrl, ring);
+
+    trace_event(ctrl, LIBXENVCHAN_TRACE_WAKE, (uint8_t)spurious, rd_prod(ctrl));
+    if (hist)
+        hist_record(&hist->wait, now_nsec() - start);
+    return 0;
+}
+
+int libxenvchan_wait(struct libxenvchan *ctrl)
+{
+    return do_wait(ctrl, NULL);
+}
+
+/**
+ * libxenvchan_wait() for a thread that only reads (ring is ctrl->read) or
+ * only writes (ctrl->write), after it found too little data or space.
+ */
+int wait_ring(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    return do_wait(ctrl, ring);
+}
+
+/**
+ * Describe size bytes of a ring starting at index idx, splitting the
+ * range in two where it crosses the end of the ring.
+ */
+static inline void ring_segments(void *ring, uint32_t ring_size, uint32_t idx, size_t size, struct libxenvchan_iovec iov[2])
+{
+    uint32_t real_idx = idx & (ring_size - 1);
+    size_t avail_contig = ring_size - real_idx;
+
+    if (avail_contig > size)
+        avail_contig = size;
+
+    iov[0].iov_base = (uint8_t*)ring + real_idx;
+    iov[0].iov_len = avail_contig;
+    iov[1].iov_base = ring;
+    iov[1].iov_len = size - avail_contig;
+}
+
+/**
+ * Move the multi-producer reservation up to wr_prod after a write that
+ * didn't go through it (libxenvchan_write(), a reservation and so on), so
+ * that the next send neither overwrites that data nor publishes backwards.
+ * Nothing to do while serialized sends hold the reservation closed, as
+ * mp_reopen() resyncs it.
+ */
+static void mp_sync(struct libxenvchan *ctrl)
+{
+    uint64_t old, new;
+
+    do
+    {
+        old = (uint64_t)ctrl->mp_reserve;
+        if (old & MP_CLOSED)
+            return;
+
+        new = mp_pack((uint32_t)(old >> 32), wr_prod(ctrl));
+    } while ((uint64_t)InterlockedCompareExchange64(&ctrl->mp_reserve, (LONG64)new, (LONG64)old) != old);
+}
+
+/**
+ * Advance the producer index and notify the reader if it asked for it.
+ * returns -1 on error, or size on success
+ */
+static int wr_publish(struct libxenvchan *ctrl, size_t size)
+{
+    uint32_t fill;
+
+    xen_wmb(); /* write data /then/ notify */
+    wr_prod(ctrl) += (uint32_t)size;
+    ctrl->write.mapped = 0;
+    if (ctrl->multi_producer && !ctrl->mp_publishing)
+        mp_sync(ctrl);
+    trace_event(ctrl, LIBXENVCHAN_TRACE_WR_PROD, 0, wr_prod(ctrl));
+
+    stat_add(&ctrl->stats.sends, 1);
+    stat_add(&ctrl->stats.bytes_sent, size);
+    if (hist_get(ctrl) && !ctrl->gap_start)
+    {
+        ctrl->gap_idx = wr_prod(ctrl);
+        ctrl->gap_start = now_nsec();
+    }
+    fill = wr_prod(ctrl) - wr_cons(ctrl);
+    stat_max(&ctrl->stats.max_write_fill, fill);
+
+    if (ctrl->corked || moderate_notify(ctrl, &ctrl->write, size))
+        return (int)size;
+
+    if (!wakes_reader(ctrl))
+    {
+        stat_add(&ctrl->stats.notifies_skipped, 1);
+        trace_event(ctrl, LIBXENVCHAN_TRACE_SKIP, VCHAN_NOTIFY_WRITE, wr_prod(ctrl));
+        return (int)size;
+    }
+
+    if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+    {
+        Log(XLL_ERROR, "send_notify failed");
+        return -1;
+    }
+
+    return (int)size;
+}
+
+/**
+ * Advance the consumer index and notify the writer if it asked for it.
+ * returns -1 on error, or size on success
+ */
+static int rd_consume(struct libxenvchan *ctrl, size_t size)
+{
+    xen_mb(); /* consume /then/ notify */
+    rd_cons(ctrl) += (uint32_t)size;
+    ctrl->read.mapped = 0;
+    trace_event(ctrl, LIBXENVCHAN_TRACE_RD_CONS, 0, rd_cons(ctrl));
+
+    stat_add(&ctrl->stats.recvs, 1);
+    stat_add(&ctrl->stats.bytes_received, size);
+
+    if (!moderate_notify(ctrl, &ctrl->read, size))
+    {
+        if (!wakes_writer(ctrl))
+        {
+            stat_add(&ctrl->stats.notifies_skipped, 1);
+            trace_event(ctrl, LIBXENVCHAN_TRACE_SKIP, VCHAN_NOTIFY_READ, rd_cons(ctrl));
+        }
+        else if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+        {
+            Log(XLL_ERROR, "send_notify failed");
+            return -1;
+        }
+    }
+
+    /* a writer stalled on a resize may be waiting for us to reach this point */
+    resize_poll(ctrl, &ctrl->read);
+    return (int)size;
+}
+
+/**
+ * returns -1 on error, or size on success
+ *
+ * caller must have checked that enough space is available
+ */
+static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+    xen_mb(); /* read indexes /then/ write data */
+    copy_to_ring(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), data, size);
+
+    return wr_publish(ctrl, size);
+}
+
+/**
+ * returns 0 if no buffer space is available, -1 on error, or size on success
+ */
+static int send_single(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+    int avail;
+    int sent;
+
+    while (1)
+    {
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        avail = fast_get_buffer_space(ctrl, size, size);
+        if (size <= avail)
+        {
+            sent = do_send(ctrl, data, size);
+            return sent;
+        }
+
+        if (!ctrl->blocking)
+        {
+            return 0;
+        }
+
+        if (size > wr_ring_size(ctrl))
+        {
+            Log(XLL_ERROR, "size > wr_ring_size(ctrl)");
+            return -1;
+        }
+
+        if (wait_ring(ctrl, &ctrl->write))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+    size_t avail;
+    int sent;
+
+    if (!libxenvchan_is_open(ctrl))
+    {
+        Log(XLL_ERROR, "vchan not open");
+        return -1;
+    }
+
+    if (ctrl->blocking)
+    {
+        size_t pos = 0;
+
+        while (1)
+        {
+            size_t wake = write_wake(ctrl, size - pos);
+
+            avail = fast_get_buffer_space(ctrl, size - pos, wake);
+
+            if (pos + avail > size)
+                avail = size - pos;
+
+            if (avail >= wake)
             {
                 sent = do_send(ctrl, (uint8_t*)data + pos, avail);
                 pos += sent;
@@ -374,7 +1034,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
                 return (int)pos;
             }
 
-            if (libxenvchan_wait(ctrl))
+            if (wait_ring(ctrl, &ctrl->write))
             {
                 Log(XLL_ERROR, "wait failed");
                 return -1;
@@ -389,7 +1049,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
     }
     else
     {
-        avail = fast_get_buffer_space(ctrl, size);
+        avail = fast_get_buffer_space(ctrl, size, write_wake(ctrl, size));
 
         if (size > avail)
             size = avail;
@@ -409,31 +1069,10 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
  */
 static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
 {
-    int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-    size_t avail_contig = rd_ring_size(ctrl) - real_idx;
-
-    if (avail_contig > size)
-        avail_contig = size;
-
     xen_rmb(); /* data read must happen /after/ rd_cons read */
-    memcpy(data, (uint8_t*)rd_ring(ctrl) + real_idx, avail_contig);
-
-    if (avail_contig < size)
-    {
-        // we rolled across the end of the ring
-        memcpy((uint8_t*)data + avail_contig, rd_ring(ctrl), size - avail_contig);
-    }
-
-    xen_mb(); /* consume /then/ notify */
-    rd_cons(ctrl) += (uint32_t)size;
-
-    if (send_notify(ctrl, VCHAN_NOTIFY_READ))
-    {
-        Log(XLL_ERROR, "send_notify failed");
-        return -1;
-    }
+    copy_from_ring(data, rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), size);
 
-    return (int)size;
+    return rd_consume(ctrl, size);
 }
 
 /**
@@ -446,7 +1085,7 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 
     while (1)
     {
-        int avail = fast_get_data_ready(ctrl, size);
+        int avail = fast_get_data_ready(ctrl, size, size);
 
         if (size <= avail)
         {
@@ -471,7 +1110,7 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
             return -1;
         }
 
-        if (libxenvchan_wait(ctrl))
+        if (wait_ring(ctrl, &ctrl->read))
         {
             Log(XLL_ERROR, "wait failed");
             return -1;
@@ -481,18 +1120,16 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 
 int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
 {
+    size_t wake = read_wake(ctrl, size);
     int tx;
 
     while (1)
     {
-        int avail = fast_get_data_ready(ctrl, size);
-
-        if (avail && size > avail)
-            size = avail;
+        int avail = fast_get_data_ready(ctrl, size, wake);
 
-        if (avail)
+        if (avail >= wake || (avail && !ctrl->blocking))
         {
-            tx = do_recv(ctrl, data, size);
+            tx = do_recv(ctrl, data, min(size, (size_t)avail));
             return tx;
         }
 
@@ -507,7 +1144,7 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
             return 0;
         }
 
-        if (libxenvchan_wait(ctrl))
+        if (wait_ring(ctrl, &ctrl->read))
         {
             Log(XLL_ERROR, "wait failed");
             return -1;
@@ -515,65 +1152,823 @@ int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
     }
 }
 
-int libxenvchan_is_open(struct libxenvchan* ctrl)
+static size_t iov_total(const struct libxenvchan_iovec *iov, int iovcnt)
 {
-    if (ctrl->is_server)
-        return ctrl->server_persist ? 1 : ctrl->ring->cli_live;
-    else
-        return ctrl->ring->srv_live;
-}
+    size_t size = 0;
+    int i;
 
-HANDLE libxenvchan_fd_for_select(struct libxenvchan *ctrl)
-{
-    return ctrl->event;
+    for (i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    return size;
 }
 
-void libxenvchan_close(struct libxenvchan *ctrl)
+/* copy size bytes of iov, starting offset bytes in, into the write ring at idx */
+static void copy_iov_to_ring(struct libxenvchan *ctrl, uint32_t idx, const struct libxenvchan_iovec *iov, int iovcnt,
+                             size_t offset, size_t size)
 {
-    if (!ctrl)
-        return;
+    size_t left = size;
+    int i;
 
-    Log(XLL_DEBUG, "start");
-    if (ctrl->read.order >= PAGE_SHIFT && ctrl->read.buffer)
+    for (i = 0; i < iovcnt && left; i++)
     {
-        if (ctrl->is_server)
-            XcGnttabRevokeForeignAccess(ctrl->xc, ctrl->read.buffer);
-        else
-            XcGnttabUnmapForeignPages(ctrl->xc, ctrl->read.buffer);
+        const uint8_t *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        if (offset >= len)
+        {
+            offset -= len;
+            continue;
+        }
+
+        data += offset;
+        len -= offset;
+        offset = 0;
+
+        if (len > left)
+            len = left;
+
+        copy_to_ring(wr_ring(ctrl), wr_ring_size(ctrl), idx, data, len);
+
+        idx += (uint32_t)len;
+        left -= len;
     }
+}
 
-    if (ctrl->write.order >= PAGE_SHIFT && ctrl->write.buffer)
+/**
+ * Copy size bytes, starting offset bytes into the iovec array, into the send
+ * ring and publish them with a single index update.
+ * returns -1 on error, or size on success
+ *
+ * caller must have checked that enough space is available
+ */
+static int do_sendv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, size_t offset, size_t size)
+{
+    xen_mb(); /* read indexes /then/ write data */
+    copy_iov_to_ring(ctrl, wr_prod(ctrl), iov, iovcnt, offset, size);
+
+    return wr_publish(ctrl, size);
+}
+
+/**
+ * Copy size bytes out of the receive ring into the iovec array, starting
+ * offset bytes into it, and consume them with a single index update.
+ * returns -1 on error, or size on success
+ *
+ * caller must have checked that enough data is available
+ */
+static int do_recvv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, size_t offset, size_t size)
+{
+    uint32_t idx = rd_cons(ctrl);
+    size_t left = size;
+    int i;
+
+    xen_rmb(); /* data read must happen /after/ rd_cons read */
+    for (i = 0; i < iovcnt && left; i++)
     {
-        if (ctrl->is_server)
-            XcGnttabRevokeForeignAccess(ctrl->xc, ctrl->write.buffer);
-        else
-            XcGnttabUnmapForeignPages(ctrl->xc, ctrl->write.buffer);
+        uint8_t *data = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        if (offset >= len)
+        {
+            offset -= len;
+            continue;
+        }
+
+        data += offset;
+        len -= offset;
+        offset = 0;
+
+        if (len > left)
+            len = left;
+
+        copy_from_ring(data, rd_ring(ctrl), rd_ring_size(ctrl), idx, len);
+
+        idx += (uint32_t)len;
+        left -= len;
     }
 
-    if (ctrl->ring)
+    return rd_consume(ctrl, size);
+}
+
+static int sendv_single(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, size_t size, int block)
+{
+    int avail;
+
+    while (1)
     {
-        if (ctrl->is_server)
+        if (!libxenvchan_is_open(ctrl))
         {
-            ctrl->ring->srv_live = 0;
-            XcGnttabRevokeForeignAccess(ctrl->xc, ctrl->ring);
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
         }
-        else
+
+        avail = fast_get_buffer_space(ctrl, size, size);
+        if (size <= avail)
         {
-            ctrl->ring->cli_live = 0;
-            XcGnttabUnmapForeignPages(ctrl->xc, ctrl->ring);
+            return do_sendv(ctrl, iov, iovcnt, 0, size);
         }
-    }
 
-    if (ctrl->event)
-    {
-        if (ctrl->ring)
-            XcEvtchnNotify(ctrl->xc, ctrl->event_port);
+        if (!block)
+        {
+            return 0;
+        }
+
+        if (size > wr_ring_size(ctrl))
+        {
+            Log(XLL_ERROR, "size > wr_ring_size(ctrl)");
+            return -1;
+        }
 
-        XcEvtchnClose(ctrl->xc, ctrl->event_port);
+        if (wait_ring(ctrl, &ctrl->write))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
     }
+}
+
+/**
+ * Reserve size bytes at the end of the write ring for a multi-producer send,
+ * without taking a lock. returns 1 with *start and *ticket set, or 0 if the
+ * send has to go the serialized way: the ring is full, being resized or
+ * negotiating its index layout, or too many sends are filling it already.
+ */
+static int mp_reserve(struct libxenvchan *ctrl, size_t size, uint32_t *start, uint32_t *ticket)
+{
+    uint64_t old, new;
+
+    do
+    {
+        old = (uint64_t)ctrl->mp_reserve;
+        if (old & MP_CLOSED || ctrl->write.split || resizing(ctrl))
+            return 0;
+
+        *start = (uint32_t)old;
+        *ticket = (uint32_t)(old >> 32);
+        if (((*ticket - ctrl->mp_next) & MP_TICKET_MASK) >= MP_SLOTS)
+            return 0;
+
+        xen_rmb(); /* read the reservation /then/ the consumer index */
+        if (size > wr_ring_size(ctrl) - (*start - wr_cons(ctrl)))
+            return 0;
+
+        new = mp_pack(*ticket + 1, *start + (uint32_t)size);
+    } while ((uint64_t)InterlockedCompareExchange64(&ctrl->mp_reserve, (LONG64)new, (LONG64)old) != old);
+
+    return 1;
+}
+
+/**
+ * Mark the send with ticket as filled up to end, and move wr_prod over every
+ * send that is filled and has all sends before it published, with a single
+ * index update and notification. Only one thread publishes at a time; a send
+ * that finishes meanwhile leaves its publishing to that thread.
+ * returns -1 on error, 0 on success
+ */
+static int mp_publish(struct libxenvchan *ctrl, uint32_t ticket, uint32_t end)
+{
+    struct libxenvchan_mp_slot *slot = &ctrl->mp_slots[ticket % MP_SLOTS];
+    uint32_t prod;
+    int ret = 0;
+
+    slot->end = end;
+    InterlockedExchange(&slot->ticket, (LONG)ticket); /* data and end /then/ ticket */
+
+    do
+    {
+        if (InterlockedCompareExchange(&ctrl->mp_publishing, 1, 0))
+            break;
+
+        prod = wr_prod(ctrl);
+        slot = &ctrl->mp_slots[ctrl->mp_next % MP_SLOTS];
+        while ((uint32_t)slot->ticket == ctrl->mp_next)
+        {
+            prod = slot->end;
+            ctrl->mp_next = (ctrl->mp_next + 1) & MP_TICKET_MASK;
+            slot = &ctrl->mp_slots[ctrl->mp_next % MP_SLOTS];
+        }
+
+        if (prod != wr_prod(ctrl) && wr_publish(ctrl, prod - wr_prod(ctrl)) < 0)
+            ret = -1;
+
+        InterlockedExchange(&ctrl->mp_publishing, 0);
+
+        // recheck: a send that saw us publishing may have filled its slot after we looked
+    } while ((uint32_t)slot->ticket == ctrl->mp_next);
+
+    return ret;
+}
+
+/**
+ * Stop new reservations and wait for the ones in flight to be published, so
+ * that the caller can use the write ring like a single producer.
+ * returns the ticket to pass to mp_reopen()
+ */
+static uint32_t mp_close(struct libxenvchan *ctrl)
+{
+    uint64_t old = (uint64_t)InterlockedOr64(&ctrl->mp_reserve, (LONG64)MP_CLOSED);
+
+    while (wr_prod(ctrl) != (uint32_t)old || ctrl->mp_publishing)
+    {
+        YieldProcessor();
+        xen_rmb();
+    }
+
+    return (uint32_t)(old >> 32);
+}
+
+static void mp_reopen(struct libxenvchan *ctrl, uint32_t ticket)
+{
+    InterlockedExchange64(&ctrl->mp_reserve, (LONG64)mp_pack(ticket, wr_prod(ctrl)));
+}
+
+static int mp_sendv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, size_t size, int block)
+{
+    uint32_t start, ticket;
+    int reserved;
+    int ret;
+
+    if (!libxenvchan_is_open(ctrl))
+    {
+        Log(XLL_ERROR, "vchan not open");
+        return -1;
+    }
+
+    reserved = mp_reserve(ctrl, size, &start, &ticket);
+    if (!reserved)
+    {
+        /* one serialized send at a time, the others queue up behind it */
+        AcquireSRWLockExclusive(&ctrl->mp_lock);
+        reserved = mp_reserve(ctrl, size, &start, &ticket);
+        if (!reserved)
+        {
+            ticket = mp_close(ctrl);
+            ret = sendv_single(ctrl, iov, iovcnt, size, block);
+            mp_reopen(ctrl, ticket);
+            ReleaseSRWLockExclusive(&ctrl->mp_lock);
+            return ret;
+        }
+        ReleaseSRWLockExclusive(&ctrl->mp_lock);
+    }
+
+    copy_iov_to_ring(ctrl, start, iov, iovcnt, 0, size);
+
+    if (mp_publish(ctrl, ticket, start + (uint32_t)size))
+        return -1;
+
+    return (int)size;
+}
+
+int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+    struct libxenvchan_iovec iov;
+
+    if (!ctrl->multi_producer)
+        return send_single(ctrl, data, size);
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    return mp_sendv(ctrl, &iov, 1, size, ctrl->blocking);
+}
+
+/**
+ * libxenvchan_sendv() that waits for space if block is set, whatever
+ * ctrl->blocking says.
+ */
+int sendv_block(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, int block)
+{
+    size_t size = iov_total(iov, iovcnt);
+
+    if (ctrl->multi_producer)
+        return mp_sendv(ctrl, iov, iovcnt, size, block);
+
+    return sendv_single(ctrl, iov, iovcnt, size, block);
+}
+
+int libxenvchan_sendv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt)
+{
+    return sendv_block(ctrl, iov, iovcnt, ctrl->blocking);
+}
+
+int libxenvchan_set_multi_producer(struct libxenvchan *ctrl, int enable)
+{
+    int i;
+
+    if (enable && !ctrl->mp_slots)
+    {
+        ctrl->mp_slots = malloc(MP_SLOTS * sizeof(*ctrl->mp_slots));
+        if (!ctrl->mp_slots)
+        {
+            Log(XLL_ERROR, "out of memory");
+            return -1;
+        }
+
+        // no ticket is ever all ones, so no slot is filled yet
+        for (i = 0; i < MP_SLOTS; i++)
+            ctrl->mp_slots[i].ticket = -1;
+    }
+
+    ctrl->mp_next = 0;
+    ctrl->mp_reserve = (LONG64)mp_pack(0, wr_prod(ctrl));
+    ctrl->multi_producer = enable != 0;
+    return 0;
+}
+
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt)
+{
+    size_t size = iov_total(iov, iovcnt);
+    size_t avail;
+    size_t pos = 0;
+    int sent;
+
+    if (!libxenvchan_is_open(ctrl))
+    {
+        Log(XLL_ERROR, "vchan not open");
+        return -1;
+    }
+
+    while (1)
+    {
+        size_t wake = write_wake(ctrl, size - pos);
+
+        avail = fast_get_buffer_space(ctrl, size - pos, wake);
+
+        if (pos + avail > size)
+            avail = size - pos;
+
+        if (avail >= wake || (avail && !ctrl->blocking))
+        {
+            sent = do_sendv(ctrl, iov, iovcnt, pos, avail);
+            if (sent < 0)
+                return -1;
+            pos += sent;
+        }
+
+        if (pos == size || !ctrl->blocking)
+        {
+            return (int)pos;
+        }
+
+        if (wait_ring(ctrl, &ctrl->write))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_recvv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt)
+{
+    size_t size = iov_total(iov, iovcnt);
+
+    while (1)
+    {
+        int avail = fast_get_data_ready(ctrl, size, size);
+
+        if (size <= avail)
+        {
+            return do_recvv(ctrl, iov, iovcnt, 0, size);
+        }
+
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        if (!ctrl->blocking)
+        {
+            return 0;
+        }
+
+        if (size > rd_ring_size(ctrl))
+        {
+            Log(XLL_ERROR, "size > rd_ring_size(ctrl)");
+            return -1;
+        }
+
+        if (wait_ring(ctrl, &ctrl->read))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt)
+{
+    size_t size = iov_total(iov, iovcnt);
+    size_t wake = read_wake(ctrl, size);
+
+    while (1)
+    {
+        int avail = fast_get_data_ready(ctrl, size, wake);
+
+        if (avail >= wake || (avail && !ctrl->blocking))
+        {
+            return do_recvv(ctrl, iov, iovcnt, 0, min(size, (size_t)avail));
+        }
+
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        if (!ctrl->blocking)
+        {
+            return 0;
+        }
+
+        if (wait_ring(ctrl, &ctrl->read))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_read_peek(struct libxenvchan *ctrl, struct libxenvchan_iovec iov[2])
+{
+    int avail;
+
+    while (1)
+    {
+        avail = fast_get_data_ready(ctrl, 1, 1);
+
+        if (avail)
+        {
+            xen_rmb(); /* data read must happen /after/ rd_prod read */
+            ring_segments((void*)rd_ring(ctrl), rd_ring_size(ctrl), rd_cons(ctrl), avail, iov);
+            ctrl->read.mapped = 1;
+            return avail;
+        }
+
+        iov[0].iov_base = iov[1].iov_base = NULL;
+        iov[0].iov_len = iov[1].iov_len = 0;
+
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        if (!ctrl->blocking)
+        {
+            return 0;
+        }
+
+        if (wait_ring(ctrl, &ctrl->read))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_read_commit(struct libxenvchan *ctrl, size_t size)
+{
+    if (size > (size_t)raw_get_data_ready(ctrl))
+    {
+        Log(XLL_ERROR, "commit of %u bytes exceeds data ready", (uint32_t)size);
+        return -1;
+    }
+
+    if (size == 0)
+    {
+        ctrl->read.mapped = 0;
+        return 0;
+    }
+
+    return rd_consume(ctrl, size);
+}
+
+int libxenvchan_write_reserve(struct libxenvchan *ctrl, size_t size, struct libxenvchan_iovec iov[2])
+{
+    int avail;
+
+    iov[0].iov_base = iov[1].iov_base = NULL;
+    iov[0].iov_len = iov[1].iov_len = 0;
+
+    while (1)
+    {
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        avail = fast_get_buffer_space(ctrl, size, size);
+        if (size <= avail)
+        {
+            xen_mb(); /* read indexes /then/ write data */
+            ring_segments(wr_ring(ctrl), wr_ring_size(ctrl), wr_prod(ctrl), size, iov);
+            ctrl->write.mapped = 1;
+            return (int)size;
+        }
+
+        if (!ctrl->blocking)
+        {
+            return 0;
+        }
+
+        if (size > wr_ring_size(ctrl))
+        {
+            Log(XLL_ERROR, "size > wr_ring_size(ctrl)");
+            return -1;
+        }
+
+        if (wait_ring(ctrl, &ctrl->write))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+}
+
+int libxenvchan_write_publish(struct libxenvchan *ctrl, size_t size)
+{
+    if (size > (size_t)raw_get_buffer_space(ctrl))
+    {
+        Log(XLL_ERROR, "publish of %u bytes exceeds buffer space", (uint32_t)size);
+        return -1;
+    }
+
+    if (size == 0)
+    {
+        ctrl->write.mapped = 0;
+        return 0;
+    }
+
+    return wr_publish(ctrl, size);
+}
+
+void libxenvchan_cork(struct libxenvchan *ctrl)
+{
+    ctrl->corked = 1;
+}
+
+int libxenvchan_uncork(struct libxenvchan *ctrl)
+{
+    ctrl->corked = 0;
+    take_pending(&ctrl->write);
+
+    if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+    {
+        Log(XLL_ERROR, "send_notify failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int libxenvchan_set_notify_policy(struct libxenvchan *ctrl, int bytes, int usec)
+{
+    if (bytes < 0 || usec < 0)
+    {
+        Log(XLL_ERROR, "invalid notify policy (%d bytes, %d usec)", bytes, usec);
+        return -1;
+    }
+
+    if (bytes && !usec)
+        usec = NOTIFY_DEFAULT_USEC;
+
+    if (usec && !ctrl->write.notify_timer)
+    {
+        ctrl->write.notify_timer = CreateThreadpoolTimer(wr_notify_timer_cb, ctrl, NULL);
+        if (!ctrl->write.notify_timer)
+        {
+            Log(XLL_ERROR, "CreateThreadpoolTimer failed: 0x%x", GetLastError());
+            return -1;
+        }
+    }
+
+    if (usec && !ctrl->read.notify_timer)
+    {
+        ctrl->read.notify_timer = CreateThreadpoolTimer(rd_notify_timer_cb, ctrl, NULL);
+        if (!ctrl->read.notify_timer)
+        {
+            Log(XLL_ERROR, "CreateThreadpoolTimer failed: 0x%x", GetLastError());
+            return -1;
+        }
+    }
+
+    /* don't strand anything held back under the old policy */
+    if (flush_notify(ctrl))
+    {
+        Log(XLL_ERROR, "send_notify failed");
+        return -1;
+    }
+
+    ctrl->notify_bytes = bytes;
+    ctrl->notify_usec = usec;
+    return 0;
+}
+
+int libxenvchan_set_read_watermark(struct libxenvchan *ctrl, int bytes)
+{
+    if (bytes < 0)
+    {
+        Log(XLL_ERROR, "invalid read watermark %d", bytes);
+        return -1;
+    }
+
+    ctrl->read_watermark = bytes;
+    return 0;
+}
+
+int libxenvchan_set_write_watermark(struct libxenvchan *ctrl, int bytes)
+{
+    if (bytes < 0)
+    {
+        Log(XLL_ERROR, "invalid write watermark %d", bytes);
+        return -1;
+    }
+
+    ctrl->write_watermark = bytes;
+    return 0;
+}
+
+int libxenvchan_set_busy_poll(struct libxenvchan *ctrl, int enable)
+{
+    uint8_t *notify = ctrl->is_server ? &ctrl->ring->cli_notify : &ctrl->ring->srv_notify;
+
+    /* don't strand anything held back for a notification */
+    if (flush_notify(ctrl))
+    {
+        Log(XLL_ERROR, "send_notify failed");
+        return -1;
+    }
+
+    ctrl->busy_poll = enable != 0;
+    if (ctrl->busy_poll)
+    {
+        // withdraw our requests so that the peer stops signalling us
+        __sync_fetch_and_and(notify, (uint8_t)~(VCHAN_NOTIFY_READ | VCHAN_NOTIFY_WRITE));
+    }
+
+    /* kick waiters sleeping on the event (or spinning) into the new mode */
+    SetEvent(ctrl->event);
+    SetEvent(ctrl->read.wakeup);
+    SetEvent(ctrl->write.wakeup);
+    Log(XLL_DEBUG, "busy polling %s", ctrl->busy_poll ? "on" : "off");
+    return 0;
+}
+
+void libxenvchan_get_stats(struct libxenvchan *ctrl, struct libxenvchan_stats *stats)
+{
+    uint64_t *from = (uint64_t *)&ctrl->stats;
+    uint64_t *to = (uint64_t *)stats;
+    size_t i;
+
+    /* a plain read of a 64-bit counter can tear on 32-bit builds */
+    for (i = 0; i < STATS_COUNTERS; i++)
+        to[i] = (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)&from[i], 0, 0);
+
+    stats->max_write_fill = ctrl->stats.max_write_fill;
+    stats->max_read_fill = ctrl->stats.max_read_fill;
+}
+
+void libxenvchan_reset_stats(struct libxenvchan *ctrl)
+{
+    uint64_t *counters = (uint64_t *)&ctrl->stats;
+    size_t i;
+
+    for (i = 0; i < STATS_COUNTERS; i++)
+        InterlockedExchange64((volatile LONG64 *)&counters[i], 0);
+
+    InterlockedExchange((volatile LONG *)&ctrl->stats.max_write_fill, 0);
+    InterlockedExchange((volatile LONG *)&ctrl->stats.max_read_fill, 0);
+    if (hist_get(ctrl))
+        ZeroMemory(ctrl->hist_buf, sizeof(*ctrl->hist_buf));
+}
+
+int libxenvchan_poll(struct libxenvchan *ctrl, int interest)
+{
+    int events = 0;
+
+    /* a resize may be waiting for a ring nobody is interested in right now */
+    resize_poll_all(ctrl);
+    indexes_check(ctrl, NULL);
+
+    if (interest & LIBXENVCHAN_READABLE && fast_get_data_ready(ctrl, 1, read_wake(ctrl, rd_ring_size(ctrl))) > 0)
+        events |= LIBXENVCHAN_READABLE;
+
+    if (!libxenvchan_is_open(ctrl))
+        return events | LIBXENVCHAN_CLOSED;
+
+    if (interest & LIBXENVCHAN_WRITABLE && fast_get_buffer_space(ctrl, 1, write_wake(ctrl, wr_ring_size(ctrl))) > 0)
+        events |= LIBXENVCHAN_WRITABLE;
+
+    return events;
+}
+
+int libxenvchan_is_open(struct libxenvchan* ctrl)
+{
+    if (ctrl->is_server)
+        return ctrl->server_persist ? 1 : ctrl->ring->cli_live;
+    else
+        return ctrl->ring->srv_live;
+}
+
+HANDLE libxenvchan_fd_for_select(struct libxenvchan *ctrl)
+{
+    return ctrl->event;
+}
+
+static void close_notify_timer(struct libxenvchan_ring *ring)
+{
+    if (!ring->notify_timer)
+        return;
+
+    SetThreadpoolTimer(ring->notify_timer, NULL, 0, 0);
+    WaitForThreadpoolTimerCallbacks(ring->notify_timer, TRUE);
+    CloseThreadpoolTimer(ring->notify_timer);
+}
+
+void libxenvchan_close(struct libxenvchan *ctrl)
+{
+    if (!ctrl)
+        return;
+
+    Log(XLL_DEBUG, "start");
+
+    // take the connection details down first, so that later clients don't
+    // find them and connect to a vchan that is going away
+    if (ctrl->xs_path)
+    {
+        ctrl->backend->store_remove(ctrl->xc, ctrl->xs_path);
+        free(ctrl->xs_path);
+    }
+
+    close_notify_timer(&ctrl->read);
+    close_notify_timer(&ctrl->write);
+
+    resize_close(ctrl);
+    indexes_close(ctrl);
+    free(ctrl->hist_buf);
+    trace_close(ctrl);
+
+    if (ctrl->read.order >= PAGE_SHIFT && ctrl->read.buffer)
+    {
+        if (ctrl->is_server)
+            ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->read.buffer);
+        else
+            ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->read.buffer);
+    }
+
+    if (ctrl->read.grant_dir)
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->read.grant_dir);
+
+    if (ctrl->write.order >= PAGE_SHIFT && ctrl->write.buffer)
+    {
+        if (ctrl->is_server)
+            ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->write.buffer);
+        else
+            ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->write.buffer);
+    }
+
+    if (ctrl->write.grant_dir)
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->write.grant_dir);
+
+    if (ctrl->ring)
+    {
+        if (ctrl->is_server)
+        {
+            ctrl->ring->srv_live = 0;
+            ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->ring);
+        }
+        else
+        {
+            ctrl->ring->cli_live = 0;
+            ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->ring);
+        }
+    }
+
+    if (ctrl->event)
+    {
+        if (ctrl->ring)
+            ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+
+        ctrl->backend->evtchn_close(ctrl->xc, ctrl->event_port);
+    }
+
+    free(ctrl->mp_slots);
+
+    if (ctrl->read.wakeup)
+        CloseHandle(ctrl->read.wakeup);
+    if (ctrl->write.wakeup)
+        CloseHandle(ctrl->write.wakeup);
 
     if (ctrl->xc)
-        XcClose(ctrl->xc);
+        ctrl->backend->close(ctrl->xc);
 
     free(ctrl);
 }
@@ -0,0 +1,703 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the loopback backend, which connects vchans between
+ *  processes on one machine without a hypervisor. A grant is a named file
+ *  mapping that a mapping process opens by its first reference, an event
+ *  channel is a pair of ports that set each other's event, and the store is a
+ *  table of paths and values. The ports, grants and store live in one named
+ *  section that every process using the backend maps, under a named mutex.
+ *  These are the Win32 objects the rest of the library is built on; like the
+ *  Xen backend, it is only built for Windows.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "private.h"
+
+#define LOOPBACK_NAME "Local\\libxenvchan-loopback"
+
+#define LOOPBACK_MAX_PORTS 1024
+#define LOOPBACK_MAX_GRANTS 4096
+#define LOOPBACK_MAX_NODES 4096
+#define LOOPBACK_PATH_SIZE 128
+#define LOOPBACK_VALUE_SIZE 32
+
+/* what to do when a grant or mapping goes away, as with the Xen backend */
+struct unmap_notify {
+    ULONG offset;
+    ULONG port;
+    XENIFACE_GNTTAB_PAGE_FLAGS flags;
+};
+
+struct lo_port {
+    /* the owner's event, as a handle in process pid */
+    uint64_t event;
+    DWORD pid;
+    /* bound port at the other end, or 0 */
+    volatile ULONG peer;
+    /* changes whenever the port is allocated, so stale duplicates are noticed */
+    volatile ULONG generation;
+    int used;
+};
+
+struct lo_grant {
+    /* the pages have references first_ref to first_ref + pages - 1 */
+    ULONG first_ref;
+    ULONG pages;
+    int granted;
+};
+
+struct lo_node {
+    /* empty if the node is unused */
+    char path[LOOPBACK_PATH_SIZE];
+    char value[LOOPBACK_VALUE_SIZE];
+};
+
+/* the state all processes share, in the section named LOOPBACK_NAME */
+struct lo_shared {
+    ULONG next_ref;
+    struct lo_port ports[LOOPBACK_MAX_PORTS];
+    struct lo_grant grants[LOOPBACK_MAX_GRANTS];
+    struct lo_node store[LOOPBACK_MAX_NODES];
+};
+
+/* a grant's section as seen by this process, granted here or mapped */
+struct lo_view {
+    struct lo_view *next;
+    HANDLE section;
+    uint8_t *base;
+    /* what the caller got: base, or a page within it */
+    uint8_t *address;
+    ULONG pages;
+    int granted;
+    ULONG slot;
+    struct unmap_notify notify;
+};
+
+/* a duplicate of the event at the other end of a local port */
+struct lo_peer {
+    HANDLE event;
+    ULONG peer;
+    ULONG generation;
+};
+
+/* lock guards the state of this process, mutex guards *shared */
+static SRWLOCK lock = SRWLOCK_INIT;
+static HANDLE mutex;
+static HANDLE shared_section;
+static struct lo_shared *shared;
+static struct lo_view *views;
+static struct lo_peer peers[LOOPBACK_MAX_PORTS];
+
+/* there is no per-user state, but callers expect a context */
+static int context;
+
+/*
+ * A process that dies holding the mutex abandons it and the next owner goes
+ * on regardless: this is a test backend, not a hypervisor.
+ */
+static void lock_shared(void)
+{
+    WaitForSingleObject(mutex, INFINITE);
+}
+
+static void unlock_shared(void)
+{
+    ReleaseMutex(mutex);
+}
+
+/* map the shared state once per process; lock must be held */
+static DWORD attach(void)
+{
+    DWORD status;
+
+    mutex = CreateMutexA(NULL, FALSE, LOOPBACK_NAME "-lock");
+    if (!mutex)
+        return GetLastError();
+
+    // a new section is zeroed, which is an empty state
+    shared_section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(struct lo_shared),
+                                        LOOPBACK_NAME);
+    if (!shared_section)
+        goto fail;
+
+    shared = MapViewOfFile(shared_section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!shared)
+        goto fail;
+
+    return ERROR_SUCCESS;
+
+fail:
+    status = GetLastError();
+    if (shared_section)
+        CloseHandle(shared_section);
+    shared_section = NULL;
+    CloseHandle(mutex);
+    mutex = NULL;
+    return status;
+}
+
+static DWORD lo_open(XENCONTROL_LOGGER *logger, PXENCONTROL_CONTEXT *xc)
+{
+    DWORD status = ERROR_SUCCESS;
+
+    // the shared state stays mapped until the process exits
+    AcquireSRWLockExclusive(&lock);
+    if (!shared)
+        status = attach();
+    ReleaseSRWLockExclusive(&lock);
+
+    if (status == ERROR_SUCCESS)
+        *xc = (PXENCONTROL_CONTEXT)&context;
+
+    return status;
+}
+
+static void lo_close(PXENCONTROL_CONTEXT xc)
+{
+}
+
+/* duplicate the event at the other end of port; lock must be held exclusively */
+static HANDLE resolve_peer(ULONG port, ULONG peer)
+{
+    struct lo_peer *cache = &peers[port];
+    struct lo_port *remote = &shared->ports[peer];
+    HANDLE process;
+    HANDLE event = NULL;
+
+    lock_shared();
+    if (remote->used && shared->ports[port].peer == peer)
+    {
+        process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, remote->pid);
+        if (process)
+        {
+            if (!DuplicateHandle(process, (HANDLE)(ULONG_PTR)remote->event, GetCurrentProcess(), &event,
+                                 EVENT_MODIFY_STATE, FALSE, 0))
+                event = NULL;
+            CloseHandle(process);
+        }
+    }
+
+    if (event)
+    {
+        if (cache->event)
+            CloseHandle(cache->event);
+        cache->event = event;
+        cache->peer = peer;
+        cache->generation = remote->generation;
+    }
+    unlock_shared();
+
+    return event;
+}
+
+/* signal the event at the other end of port */
+static void signal_port(ULONG port)
+{
+    struct lo_peer *cache;
+    ULONG peer;
+
+    if (port == 0 || port >= LOOPBACK_MAX_PORTS)
+        return;
+
+    peer = shared->ports[port].peer;
+    if (peer == 0 || peer >= LOOPBACK_MAX_PORTS)
+        return;
+
+    // the duplicate made by the first notification serves until the peer changes
+    cache = &peers[port];
+    AcquireSRWLockShared(&lock);
+    if (cache->event && cache->peer == peer && cache->generation == shared->ports[peer].generation)
+    {
+        SetEvent(cache->event);
+        ReleaseSRWLockShared(&lock);
+        return;
+    }
+    ReleaseSRWLockShared(&lock);
+
+    AcquireSRWLockExclusive(&lock);
+    if (cache->event && cache->peer == peer && cache->generation == shared->ports[peer].generation)
+        SetEvent(cache->event);
+    else if (resolve_peer(port, peer))
+        SetEvent(cache->event);
+    ReleaseSRWLockExclusive(&lock);
+}
+
+/* shared state must be locked */
+static ULONG alloc_port(HANDLE event)
+{
+    struct lo_port *p;
+    ULONG port;
+
+    for (port = 1; port < LOOPBACK_MAX_PORTS; port++)
+    {
+        p = &shared->ports[port];
+        if (!p->used)
+        {
+            p->event = (uint64_t)(ULONG_PTR)event;
+            p->pid = GetCurrentProcessId();
+            p->peer = 0;
+            p->generation++;
+            p->used = 1;
+            return port;
+        }
+    }
+
+    return 0;
+}
+
+static DWORD lo_evtchn_bind_unbound(PXENCONTROL_CONTEXT xc, USHORT domain, HANDLE event, BOOL mask, ULONG *port)
+{
+    lock_shared();
+    *port = alloc_port(event);
+    unlock_shared();
+
+    return *port ? ERROR_SUCCESS : ERROR_NO_MORE_ITEMS;
+}
+
+static DWORD lo_evtchn_bind_interdomain(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG remote_port, HANDLE event,
+                                        BOOL mask, ULONG *local_port)
+{
+    DWORD status = ERROR_INVALID_PARAMETER;
+    struct lo_port *remote;
+    ULONG port;
+
+    if (remote_port == 0 || remote_port >= LOOPBACK_MAX_PORTS)
+        return status;
+
+    lock_shared();
+    remote = &shared->ports[remote_port];
+    if (remote->used && !remote->peer)
+    {
+        port = alloc_port(event);
+        if (port)
+        {
+            shared->ports[port].peer = remote_port;
+            remote->peer = port;
+            *local_port = port;
+            status = ERROR_SUCCESS;
+        }
+        else
+        {
+            status = ERROR_NO_MORE_ITEMS;
+        }
+    }
+    unlock_shared();
+
+    return status;
+}
+
+static DWORD lo_evtchn_notify(PXENCONTROL_CONTEXT xc, ULONG port)
+{
+    signal_port(port);
+
+    return ERROR_SUCCESS;
+}
+
+static DWORD lo_evtchn_close(PXENCONTROL_CONTEXT xc, ULONG port)
+{
+    struct lo_port *p;
+
+    if (port == 0 || port >= LOOPBACK_MAX_PORTS)
+        return ERROR_INVALID_PARAMETER;
+
+    AcquireSRWLockExclusive(&lock);
+    lock_shared();
+    p = &shared->ports[port];
+    if (p->peer && p->peer < LOOPBACK_MAX_PORTS)
+        shared->ports[p->peer].peer = 0;
+    p->peer = 0;
+    p->event = 0;
+    p->pid = 0;
+    p->used = 0;
+    unlock_shared();
+
+    if (peers[port].event)
+        CloseHandle(peers[port].event);
+    ZeroMemory(&peers[port], sizeof(peers[port]));
+    ReleaseSRWLockExclusive(&lock);
+
+    return ERROR_SUCCESS;
+}
+
+static void grant_name(char *name, ULONG first_ref)
+{
+    sprintf(name, LOOPBACK_NAME "-%lu", first_ref);
+}
+
+/* unmap a view that is no longer listed, doing what was asked for on the way */
+static void put_view(struct lo_view *view)
+{
+    if (view->notify.flags & XENIFACE_GNTTAB_USE_NOTIFY_OFFSET)
+        view->base[view->notify.offset] = 0;
+    if (view->notify.flags & XENIFACE_GNTTAB_USE_NOTIFY_PORT)
+        signal_port(view->notify.port);
+
+    UnmapViewOfFile(view->base);
+    CloseHandle(view->section);
+    free(view);
+}
+
+/* unlist and return the view that address was granted or mapped at */
+static struct lo_view *take_view(uint8_t *address, int granted)
+{
+    struct lo_view **prev;
+    struct lo_view *view;
+
+    AcquireSRWLockExclusive(&lock);
+    for (prev = &views; (view = *prev) != NULL; prev = &view->next)
+    {
+        if (granted ? view->granted && view->address == address
+                    : !view->granted && address >= view->base && address < view->base + (SIZE_T)view->pages * PAGE_SIZE)
+        {
+            *prev = view->next;
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&lock);
+
+    return view;
+}
+
+static DWORD lo_gnttab_grant(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG notify_offset, ULONG notify_port,
+                             XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address, ULONG *refs)
+{
+    uint64_t size = (uint64_t)pages * PAGE_SIZE;
+    struct lo_view *view;
+    DWORD status = ERROR_SUCCESS;
+    char name[64];
+    ULONG first_ref;
+    ULONG slot;
+    ULONG i;
+
+    view = malloc(sizeof(*view));
+    if (!view)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    ZeroMemory(view, sizeof(*view));
+    view->pages = pages;
+    view->granted = 1;
+    view->notify.offset = notify_offset;
+    view->notify.port = notify_port;
+    view->notify.flags = flags;
+
+    AcquireSRWLockExclusive(&lock);
+    lock_shared();
+    for (slot = 0; slot < LOOPBACK_MAX_GRANTS; slot++)
+    {
+        if (!shared->grants[slot].granted)
+            break;
+    }
+
+    if (slot == LOOPBACK_MAX_GRANTS)
+    {
+        status = ERROR_NO_MORE_ITEMS;
+        goto out;
+    }
+
+    // references are never reused, so neither are section names
+    first_ref = shared->next_ref + 1;
+    grant_name(name, first_ref);
+
+    view->section = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size,
+                                       name);
+    if (!view->section)
+    {
+        status = GetLastError();
+        goto out;
+    }
+
+    view->base = MapViewOfFile(view->section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!view->base)
+    {
+        status = GetLastError();
+        CloseHandle(view->section);
+        goto out;
+    }
+
+    shared->next_ref += pages;
+    shared->grants[slot].first_ref = first_ref;
+    shared->grants[slot].pages = pages;
+    shared->grants[slot].granted = 1;
+
+    view->address = view->base;
+    view->slot = slot;
+    view->next = views;
+    views = view;
+
+out:
+    unlock_shared();
+    ReleaseSRWLockExclusive(&lock);
+
+    if (status != ERROR_SUCCESS)
+    {
+        free(view);
+        return status;
+    }
+
+    for (i = 0; i < pages; i++)
+        refs[i] = first_ref + i;
+
+    *address = view->address;
+    return ERROR_SUCCESS;
+}
+
+static DWORD lo_gnttab_revoke(PXENCONTROL_CONTEXT xc, PVOID address)
+{
+    struct lo_view *view;
+
+    view = take_view(address, 1);
+    if (!view)
+        return ERROR_NOT_FOUND;
+
+    // mappings keep the section alive, but nobody new can map it
+    lock_shared();
+    shared->grants[view->slot].granted = 0;
+    unlock_shared();
+
+    put_view(view);
+    return ERROR_SUCCESS;
+}
+
+static DWORD lo_gnttab_map(PXENCONTROL_CONTEXT xc, USHORT domain, ULONG pages, ULONG *refs, ULONG notify_offset,
+                           ULONG notify_port, XENIFACE_GNTTAB_PAGE_FLAGS flags, PVOID *address)
+{
+    struct lo_grant *grant = NULL;
+    struct lo_view *view;
+    DWORD status = ERROR_NOT_FOUND;
+    char name[64];
+    ULONG first, slot, i;
+
+    view = malloc(sizeof(*view));
+    if (!view)
+        return ERROR_NOT_ENOUGH_MEMORY;
+
+    ZeroMemory(view, sizeof(*view));
+
+    AcquireSRWLockExclusive(&lock);
+    lock_shared();
+    for (slot = 0; slot < LOOPBACK_MAX_GRANTS; slot++)
+    {
+        grant = &shared->grants[slot];
+        first = refs[0] - grant->first_ref;
+        if (grant->granted && refs[0] >= grant->first_ref && first + pages <= grant->pages)
+            break;
+    }
+
+    if (slot == LOOPBACK_MAX_GRANTS)
+        goto out;
+
+    // the pages only look contiguous to the mapper if they are here
+    for (i = 1; i < pages; i++)
+    {
+        if (refs[i] != refs[0] + i)
+            break;
+    }
+    if (i < pages)
+    {
+        status = ERROR_NOT_SUPPORTED;
+        goto out;
+    }
+
+    grant_name(name, grant->first_ref);
+    view->section = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name);
+    if (!view->section)
+    {
+        status = GetLastError();
+        goto out;
+    }
+
+    view->base = MapViewOfFile(view->section, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (!view->base)
+    {
+        status = GetLastError();
+        CloseHandle(view->section);
+        goto out;
+    }
+
+    view->pages = grant->pages;
+    view->address = view->base + (SIZE_T)first * PAGE_SIZE;
+    if (flags & (XENIFACE_GNTTAB_USE_NOTIFY_OFFSET | XENIFACE_GNTTAB_USE_NOTIFY_PORT))
+    {
+        view->notify.offset = notify_offset + first * PAGE_SIZE;
+        view->notify.port = notify_port;
+        view->notify.flags = flags;
+    }
+
+    view->next = views;
+    views = view;
+    status = ERROR_SUCCESS;
+
+out:
+    unlock_shared();
+    ReleaseSRWLockExclusive(&lock);
+
+    if (status != ERROR_SUCCESS)
+    {
+        free(view);
+        return status;
+    }
+
+    *address = view->address;
+    return ERROR_SUCCESS;
+}
+
+static DWORD lo_gnttab_unmap(PXENCONTROL_CONTEXT xc, PVOID address)
+{
+    struct lo_view *view;
+
+    view = take_view(address, 0);
+    if (!view)
+        return ERROR_NOT_FOUND;
+
+    put_view(view);
+    return ERROR_SUCCESS;
+}
+
+/* shared state must be locked */
+static struct lo_node *find_node(const CHAR *path)
+{
+    ULONG i;
+
+    for (i = 0; i < LOOPBACK_MAX_NODES; i++)
+    {
+        if (!strcmp(shared->store[i].path, path))
+            return &shared->store[i];
+    }
+
+    return NULL;
+}
+
+static DWORD lo_store_read(PXENCONTROL_CONTEXT xc, const CHAR *path, DWORD size, CHAR *value)
+{
+    struct lo_node *node;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!size)
+        return ERROR_INSUFFICIENT_BUFFER;
+
+    lock_shared();
+    node = path[0] ? find_node(path) : NULL;
+    if (node)
+    {
+        strncpy(value, node->value, size - 1);
+        value[size - 1] = 0;
+    }
+    else if (!strcmp(path, "domid"))
+    {
+        // everything is in one domain
+        strncpy(value, "0", size - 1);
+        value[size - 1] = 0;
+    }
+    else
+    {
+        status = ERROR_FILE_NOT_FOUND;
+    }
+    unlock_shared();
+
+    return status;
+}
+
+static DWORD lo_store_write(PXENCONTROL_CONTEXT xc, const CHAR *path, const CHAR *value)
+{
+    struct lo_node *node;
+    DWORD status = ERROR_SUCCESS;
+
+    if (!path[0] || strlen(path) >= LOOPBACK_PATH_SIZE || strlen(value) >= LOOPBACK_VALUE_SIZE)
+        return ERROR_INVALID_PARAMETER;
+
+    lock_shared();
+    node = find_node(path);
+    if (!node)
+    {
+        // an unused node has an empty path
+        node = find_node("");
+        if (node)
+            strcpy(node->path, path);
+    }
+
+    if (node)
+        strcpy(node->value, value);
+    else
+        status = ERROR_NO_MORE_ITEMS;
+    unlock_shared();
+
+    return status;
+}
+
+static DWORD lo_store_remove(PXENCONTROL_CONTEXT xc, const CHAR *path)
+{
+    size_t len = strlen(path);
+    DWORD status = ERROR_FILE_NOT_FOUND;
+    ULONG i;
+
+    if (!len)
+        return ERROR_INVALID_PARAMETER;
+
+    lock_shared();
+    for (i = 0; i < LOOPBACK_MAX_NODES; i++)
+    {
+        struct lo_node *node = &shared->store[i];
+
+        // the node itself and everything below it, as XenStore does
+        if (!strncmp(node->path, path, len) && (node->path[len] == 0 || node->path[len] == '/'))
+        {
+            node->path[0] = 0;
+            status = ERROR_SUCCESS;
+        }
+    }
+    unlock_shared();
+
+    return status;
+}
+
+static DWORD lo_store_set_permissions(PXENCONTROL_CONTEXT xc, const CHAR *path, ULONG count,
+                                      PXENIFACE_STORE_PERMISSION perms)
+{
+    return ERROR_SUCCESS;
+}
+
+static const struct libxenvchan_backend loopback_backend = {
+    "loopback",
+    lo_open,
+    lo_close,
+    lo_evtchn_bind_unbound,
+    lo_evtchn_bind_interdomain,
+    lo_evtchn_notify,
+    lo_evtchn_close,
+    lo_gnttab_grant,
+    lo_gnttab_revoke,
+    lo_gnttab_map,
+    lo_gnttab_unmap,
+    lo_store_read,
+    lo_store_write,
+    lo_store_remove,
+    lo_store_set_permissions,
+};
+
+const struct libxenvchan_backend *libxenvchan_loopback_backend(void)
+{
+    return &loopback_backend;
+}
@@ -0,0 +1,228 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains multi-queue vchans: a set of ordinary vchans sharing a
+ *  base XenStore path, one per queue, so that a connection can be spread
+ *  over several threads without them contending on the same ring indexes
+ *  and event channel.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "private.h"
+
+#define snprintf _snprintf
+
+struct libxenvchan_mq {
+    int num_queues;
+    struct libxenvchan *queues[LIBXENVCHAN_MAX_QUEUES];
+    /* the queue count a server published, removed on close */
+    char *queues_path;
+};
+
+/*
+ * Format a store path into buf. Unlike a bare _snprintf(), fails instead of
+ * leaving a path that was cut short, without a terminating NUL, which would
+ * put a queue under some other node.
+ * returns -1 if it doesn't fit, 0 on success
+ */
+static int mq_path(char *buf, size_t size, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = _vsnprintf(buf, size, format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= size)
+    {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct libxenvchan_mq *libxenvchan_mq_server_init(XENCONTROL_LOGGER *logger, int domain, const char *xs_path,
+                                                  int queues, size_t read_min, size_t write_min)
+{
+    struct libxenvchan_mq *mq;
+    char buf[64];
+    char num[16];
+    int i;
+
+    if (queues <= 0 || queues > LIBXENVCHAN_MAX_QUEUES)
+        return NULL;
+
+    mq = malloc(sizeof(*mq));
+    if (!mq)
+        return NULL;
+
+    ZeroMemory(mq, sizeof(*mq));
+
+    for (i = 0; i < queues; i++)
+    {
+        if (mq_path(buf, sizeof(buf), "%s/queue-%d", xs_path, i))
+            goto fail;
+
+        mq->queues[i] = libxenvchan_server_init(logger, domain, buf, read_min, write_min);
+        if (!mq->queues[i])
+            goto fail;
+
+        mq->num_queues++;
+    }
+
+    // clients wait for this, so the queues must be complete by now
+    snprintf(num, sizeof(num), "%d", queues);
+    if (mq_path(buf, sizeof(buf), "%s/queues", xs_path))
+        goto fail;
+
+    mq->queues_path = _strdup(buf);
+    if (!mq->queues_path)
+        goto fail;
+
+    if (store_write_peer(mq->queues[0], (USHORT)domain, buf, num))
+        goto fail;
+
+    return mq;
+
+fail:
+    libxenvchan_mq_close(mq);
+    return NULL;
+}
+
+struct libxenvchan_mq *libxenvchan_mq_client_init(XENCONTROL_LOGGER *logger, int domain, const char *xs_path)
+{
+    struct libxenvchan_mq *mq;
+    char buf[64];
+    char num[16];
+    const struct libxenvchan_backend *backend = current_backend();
+    PXENCONTROL_CONTEXT xc;
+    DWORD status;
+    int queues;
+    int i;
+
+    if (mq_path(buf, sizeof(buf), "%s/queues", xs_path))
+        return NULL;
+
+    status = backend->open(logger, &xc);
+    if (status != ERROR_SUCCESS)
+    {
+        // same as libxenvchan_client_init(): xeniface is not available (yet)
+        SetLastError(ERROR_NOT_SUPPORTED);
+        return NULL;
+    }
+
+    status = backend->store_read(xc, buf, sizeof(num), num);
+    backend->close(xc);
+
+    if (status != ERROR_SUCCESS)
+        return NULL;
+
+    queues = atoi(num);
+    if (queues <= 0 || queues > LIBXENVCHAN_MAX_QUEUES)
+        return NULL;
+
+    mq = malloc(sizeof(*mq));
+    if (!mq)
+        return NULL;
+
+    ZeroMemory(mq, sizeof(*mq));
+
+    for (i = 0; i < queues; i++)
+    {
+        if (mq_path(buf, sizeof(buf), "%s/queue-%d", xs_path, i))
+        {
+            libxenvchan_mq_close(mq);
+            return NULL;
+        }
+
+        mq->queues[i] = libxenvchan_client_init(logger, domain, buf);
+        if (!mq->queues[i])
+        {
+            libxenvchan_mq_close(mq);
+            return NULL;
+        }
+
+        mq->num_queues++;
+    }
+
+    return mq;
+}
+
+void libxenvchan_mq_close(struct libxenvchan_mq *mq)
+{
+    int i;
+
+    if (!mq)
+        return;
+
+    // the count goes first, as clients take it to mean all queues are there
+    if (mq->queues_path)
+    {
+        mq->queues[0]->backend->store_remove(mq->queues[0]->xc, mq->queues_path);
+        free(mq->queues_path);
+    }
+
+    for (i = 0; i < mq->num_queues; i++)
+        libxenvchan_close(mq->queues[i]);
+
+    free(mq);
+}
+
+int libxenvchan_mq_num_queues(struct libxenvchan_mq *mq)
+{
+    return mq->num_queues;
+}
+
+struct libxenvchan *libxenvchan_mq_queue(struct libxenvchan_mq *mq, int index)
+{
+    if (index < 0 || index >= mq->num_queues)
+        return NULL;
+
+    return mq->queues[index];
+}
+
+struct libxenvchan *libxenvchan_mq_select(struct libxenvchan_mq *mq, const void *key, size_t len)
+{
+    const uint8_t *p = key;
+    DWORD tid;
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    size_t i;
+
+    if (!key)
+    {
+        tid = GetCurrentThreadId();
+        p = (const uint8_t*)&tid;
+        len = sizeof(tid);
+    }
+
+    for (i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return mq->queues[hash % mq->num_queues];
+}
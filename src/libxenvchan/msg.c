@@ -0,0 +1,328 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the framed message layer, built on the scatter-gather
+ *  and zero-copy stream interfaces. Every fragment is a 32-bit length header
+ *  (see VCHAN_MSG_MORE) followed by the payload. Messages that fit in the
+ *  ring are sent as a single fragment; larger ones are split into fragments
+ *  of half the ring so that the reader can drain one while the next is
+ *  written.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "private.h"
+
+#define MSG_HDR_SIZE sizeof(uint32_t)
+
+/* messages are sent in chunks of this many when batching */
+#define MSG_BATCH_CHUNK 32
+
+/**
+ * Copy size bytes, starting offset bytes into the segments returned by
+ * libxenvchan_read_peek(), into buf.
+ */
+static void seg_copy(const struct libxenvchan_iovec iov[2], size_t offset, void *buf, size_t size)
+{
+    size_t len;
+
+    if (offset < iov[0].iov_len)
+    {
+        len = min(size, iov[0].iov_len - offset);
+        memcpy(buf, (uint8_t*)iov[0].iov_base + offset, len);
+        buf = (uint8_t*)buf + len;
+        size -= len;
+        offset = 0;
+    }
+    else
+    {
+        offset -= iov[0].iov_len;
+    }
+
+    if (size)
+        memcpy(buf, (uint8_t*)iov[1].iov_base + offset, size);
+}
+
+/**
+ * Wait until at least size bytes are ready to read.
+ * returns 1 if they are, 0 if not and block is false, -1 on error
+ */
+static int wait_data(struct libxenvchan *ctrl, size_t size, int block)
+{
+    while ((size_t)libxenvchan_data_ready(ctrl) < size)
+    {
+        if (!libxenvchan_is_open(ctrl))
+        {
+            Log(XLL_ERROR, "vchan not open");
+            return -1;
+        }
+
+        if (!block)
+            return 0;
+
+        if (wait_ring(ctrl, &ctrl->read))
+        {
+            Log(XLL_ERROR, "wait failed");
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Send one fragment: header and payload with a single index update, waiting
+ * for space if block is set.
+ * returns -1 on error, 0 if not blocking and insufficient space, or size
+ */
+static int send_fragment(struct libxenvchan *ctrl, const void *data, size_t size, uint32_t flags, int block)
+{
+    uint32_t hdr = (uint32_t)size | flags;
+    struct libxenvchan_iovec iov[2];
+    int sent;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = MSG_HDR_SIZE;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = size;
+
+    sent = sendv_block(ctrl, iov, 2, block);
+    if (sent <= 0)
+        return sent;
+
+    return (int)size;
+}
+
+int libxenvchan_send_msg(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+    size_t pos = 0;
+    int block = ctrl->blocking;
+    int sent = 0;
+
+    if (size > INT_MAX)
+    {
+        Log(XLL_ERROR, "message too large (%Iu bytes)", size);
+        return -1;
+    }
+
+    if (size + MSG_HDR_SIZE <= wr_ring_size(ctrl))
+        return send_fragment(ctrl, data, size, 0, block);
+
+    while (pos < size)
+    {
+        /* recomputed each time, as the ring may be resized under us */
+        size_t len = min(size - pos, wr_ring_size(ctrl) / 2 - MSG_HDR_SIZE);
+
+        sent = send_fragment(ctrl, (uint8_t*)data + pos, len, pos + len < size ? VCHAN_MSG_MORE : 0, block);
+        if (sent <= 0)
+            break;
+
+        /* the peer can't make sense of half a message; finish it */
+        block = 1;
+        pos += len;
+    }
+
+    if (sent <= 0)
+        return sent;
+
+    return (int)size;
+}
+
+int libxenvchan_recv_msg(struct libxenvchan *ctrl, void *data, size_t size)
+{
+    struct libxenvchan_iovec iov[2];
+    size_t total = 0;
+    int block = ctrl->blocking;
+    uint32_t hdr;
+    size_t len;
+    int rv;
+
+    while (1)
+    {
+        rv = wait_data(ctrl, MSG_HDR_SIZE, block);
+        if (rv <= 0)
+            return rv;
+
+        if (libxenvchan_read_peek(ctrl, iov) < 0)
+            return -1;
+        seg_copy(iov, 0, &hdr, MSG_HDR_SIZE);
+
+        len = hdr & VCHAN_MSG_LEN_MASK;
+        if (len + MSG_HDR_SIZE > rd_ring_size(ctrl) || total + len > INT_MAX)
+        {
+            Log(XLL_ERROR, "bad message header 0x%x", hdr);
+            return -1;
+        }
+
+        rv = wait_data(ctrl, MSG_HDR_SIZE + len, block);
+        if (rv <= 0)
+            return rv;
+
+        if (libxenvchan_read_peek(ctrl, iov) < 0)
+            return -1;
+        if (total < size)
+            seg_copy(iov, MSG_HDR_SIZE, (uint8_t*)data + total, min(len, size - total));
+
+        if (libxenvchan_read_commit(ctrl, MSG_HDR_SIZE + len) < 0)
+            return -1;
+
+        total += len;
+        if (!(hdr & VCHAN_MSG_MORE))
+            return (int)total;
+
+        /* the rest of a fragmented message is on its way */
+        block = 1;
+    }
+}
+
+int libxenvchan_send_batch(struct libxenvchan *ctrl, struct libxenvchan_msg *msgs, int count)
+{
+    struct libxenvchan_iovec iov[MSG_BATCH_CHUNK * 2];
+    uint32_t hdr[MSG_BATCH_CHUNK];
+    int corked = ctrl->corked;
+    int done = 0;
+    int rv = 0;
+
+    /* one notification for the whole batch */
+    if (!corked)
+        libxenvchan_cork(ctrl);
+
+    while (done < count)
+    {
+        size_t space = libxenvchan_buffer_space(ctrl);
+        size_t total = 0;
+        int n = 0;
+
+        while (done + n < count && n < MSG_BATCH_CHUNK)
+        {
+            struct libxenvchan_msg *msg = &msgs[done + n];
+
+            if (total + MSG_HDR_SIZE + msg->size > space)
+                break;
+
+            hdr[n] = (uint32_t)msg->size;
+            iov[2 * n].iov_base = &hdr[n];
+            iov[2 * n].iov_len = MSG_HDR_SIZE;
+            iov[2 * n + 1].iov_base = msg->buf;
+            iov[2 * n + 1].iov_len = msg->size;
+            total += MSG_HDR_SIZE + msg->size;
+            n++;
+        }
+
+        if (n > 0)
+        {
+            rv = libxenvchan_sendv(ctrl, iov, 2 * n);
+            if (rv <= 0)
+                break;
+            done += n;
+            continue;
+        }
+
+        /* the next message doesn't fit right now: wait, or fragment it */
+        if (!ctrl->blocking && done > 0)
+            break;
+
+        rv = libxenvchan_send_msg(ctrl, msgs[done].buf, msgs[done].size);
+        if (rv <= 0)
+            break;
+        done++;
+    }
+
+    if (!corked && libxenvchan_uncork(ctrl))
+        rv = -1;
+
+    if (rv < 0 && done == 0)
+        return -1;
+
+    return done;
+}
+
+int libxenvchan_recv_batch(struct libxenvchan *ctrl, struct libxenvchan_msg *msgs, int count)
+{
+    struct libxenvchan_iovec iov[2];
+    size_t offset;
+    size_t need;
+    int avail;
+    int n;
+    int rv;
+
+    if (count <= 0)
+        return 0;
+
+    while (1)
+    {
+        avail = libxenvchan_read_peek(ctrl, iov);
+        if (avail < 0)
+            return -1;
+
+        offset = 0;
+        need = MSG_HDR_SIZE;
+        n = 0;
+
+        while (n < count && offset + MSG_HDR_SIZE <= (size_t)avail)
+        {
+            uint32_t hdr;
+            size_t len;
+
+            seg_copy(iov, offset, &hdr, MSG_HDR_SIZE);
+            len = hdr & VCHAN_MSG_LEN_MASK;
+
+            if (hdr & VCHAN_MSG_MORE)
+            {
+                if (n > 0)
+                    break;
+
+                /* a fragmented message is reassembled by recv_msg */
+                rv = libxenvchan_recv_msg(ctrl, msgs[0].buf, msgs[0].size);
+                if (rv < 0)
+                    return -1;
+                msgs[0].len = rv;
+                return 1;
+            }
+
+            if (offset + MSG_HDR_SIZE + len > (size_t)avail)
+            {
+                need = MSG_HDR_SIZE + len;
+                break;
+            }
+
+            seg_copy(iov, offset + MSG_HDR_SIZE, msgs[n].buf, min(len, msgs[n].size));
+            msgs[n].len = len;
+            offset += MSG_HDR_SIZE + len;
+            n++;
+        }
+
+        if (n > 0)
+            return libxenvchan_read_commit(ctrl, offset) < 0 ? -1 : n;
+
+        if (need > rd_ring_size(ctrl))
+        {
+            Log(XLL_ERROR, "bad message length %Iu", need);
+            return -1;
+        }
+
+        rv = wait_data(ctrl, need, ctrl->blocking);
+        if (rv <= 0)
+            return rv;
+    }
+}
@@ -0,0 +1,194 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  Definitions shared between the source files of the library, which are
+ *  not part of its interface.
+ */
+
+#ifndef _LIBXENVCHAN_PRIVATE_H
+#define _LIBXENVCHAN_PRIVATE_H
+
+#include <string.h>
+
+#include "libxenvchan.h"
+
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#ifndef min
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#ifndef max
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
+#define SMALL_RING_SHIFT 10
+#define LARGE_RING_SHIFT 11
+
+#define MAX_SMALL_RING (1 << SMALL_RING_SHIFT)
+#define SMALL_RING_OFFSET 1024
+#define MAX_LARGE_RING (1 << LARGE_RING_SHIFT)
+#define LARGE_RING_OFFSET 2048
+
+// if you go over this size, you'll have too many grants to fit in the shared page.
+#define MAX_RING_SHIFT 20
+#define MAX_RING_SIZE (1 << MAX_RING_SHIFT)
+
+// larger rings list their grants in directory pages, and the shared page holds
+// the grants of the directory pages.
+#define MAX_INDIRECT_RING_SHIFT 26
+#define MAX_INDIRECT_RING_SIZE (1 << MAX_INDIRECT_RING_SHIFT)
+#define GRANTS_PER_DIR_PAGE (PAGE_SIZE / sizeof(uint32_t))
+
+/* sizes of the rings, at which their indexes wrap around */
+static __inline uint32_t wr_ring_size(struct libxenvchan *ctrl)
+{
+    return (1 << ctrl->write.order);
+}
+
+static __inline uint32_t rd_ring_size(struct libxenvchan *ctrl)
+{
+    return (1 << ctrl->read.order);
+}
+
+/* init.c */
+void _Log(XENCONTROL_LOG_LEVEL logLevel, PCHAR function, struct libxenvchan *ctrl, PWCHAR format, ...);
+
+#define Log(level, msg, ...) _Log(level, __FUNCTION__, ctrl, L"(%p) " L##msg L"\n", ctrl, __VA_ARGS__)
+
+int ring_pages(int order);
+int ring_grants(int order);
+int min_order(int size);
+DWORD grant_ring_pages(struct libxenvchan *ctrl, USHORT domain, struct libxenvchan_ring *ring, uint32_t *grants);
+DWORD map_ring_pages(struct libxenvchan *ctrl, USHORT domain, struct libxenvchan_ring *ring, uint32_t *grants, int flags);
+int store_write_peer(struct libxenvchan *ctrl, USHORT domain, const char *path, const char *value);
+
+/* io.c */
+void wake_waiters(struct libxenvchan *ctrl);
+int wait_ring(struct libxenvchan *ctrl, struct libxenvchan_ring *ring);
+int sendv_block(struct libxenvchan *ctrl, const struct libxenvchan_iovec *iov, int iovcnt, int block);
+
+/* backend.c */
+const struct libxenvchan_backend *current_backend(void);
+
+/* hist.c */
+uint64_t now_nsec(void);
+
+static __inline uint64_t now_usec(void)
+{
+    return now_nsec() / 1000;
+}
+
+void hist_record(struct libxenvchan_hist *hist, uint64_t value);
+
+/* read ctrl->hist once, as it can be turned off under a recording thread */
+static __inline struct libxenvchan_histograms *hist_get(struct libxenvchan *ctrl)
+{
+    return *(struct libxenvchan_histograms *volatile *)&ctrl->hist;
+}
+
+/* trace.c */
+void trace_record(struct libxenvchan_trace *trace, uint8_t type, uint8_t arg, uint32_t value);
+void trace_close(struct libxenvchan *ctrl);
+
+/* read ctrl->trace once, as it can be replaced under a recording thread */
+static __inline struct libxenvchan_trace *trace_get(struct libxenvchan *ctrl)
+{
+    return *(struct libxenvchan_trace *volatile *)&ctrl->trace;
+}
+
+/* copy.c */
+void copy_ring_in(void *ring, uint32_t ring_size, uint32_t idx, const void *data, size_t size);
+void copy_ring_out(void *data, const void *ring, uint32_t ring_size, uint32_t idx, size_t size);
+
+// copies up to this size are done with a few fixed-size moves
+#define COPY_SMALL 32
+
+static __inline void copy_small(void *dst, const void *src, size_t size)
+{
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    // the two moves overlap unless size is exactly twice their width
+    if (size >= 16)
+    {
+        memcpy(d, s, 16);
+        memcpy(d + size - 16, s + size - 16, 16);
+    }
+    else if (size >= 8)
+    {
+        memcpy(d, s, 8);
+        memcpy(d + size - 8, s + size - 8, 8);
+    }
+    else if (size >= 4)
+    {
+        memcpy(d, s, 4);
+        memcpy(d + size - 4, s + size - 4, 4);
+    }
+    else if (size)
+    {
+        d[0] = s[0];
+        d[size - 1] = s[size - 1];
+        d[size / 2] = s[size / 2];
+    }
+}
+
+/* copy size bytes into a ring starting at index idx, wrapping around its end */
+static __inline void copy_to_ring(void *ring, uint32_t ring_size, uint32_t idx, const void *data, size_t size)
+{
+    uint32_t real_idx = idx & (ring_size - 1);
+
+    if (size <= COPY_SMALL && size <= ring_size - real_idx)
+        copy_small((uint8_t*)ring + real_idx, data, size);
+    else
+        copy_ring_in(ring, ring_size, idx, data, size);
+}
+
+/* copy size bytes out of a ring starting at index idx, wrapping around its end */
+static __inline void copy_from_ring(void *data, const void *ring, uint32_t ring_size, uint32_t idx, size_t size)
+{
+    uint32_t real_idx = idx & (ring_size - 1);
+
+    if (size <= COPY_SMALL && size <= ring_size - real_idx)
+        copy_small(data, (const uint8_t*)ring + real_idx, size);
+    else
+        copy_ring_out(data, ring, ring_size, idx, size);
+}
+
+/* indexes.c */
+uint32_t indexes_init_srv(struct libxenvchan *ctrl);
+int indexes_init_cli(struct libxenvchan *ctrl, uint32_t index_ref);
+void indexes_update(struct libxenvchan *ctrl, struct libxenvchan_ring *ring);
+void indexes_reset(struct libxenvchan *ctrl, struct libxenvchan_ring *ring);
+void indexes_close(struct libxenvchan *ctrl);
+
+/* resize.c */
+uint32_t resize_init_srv(struct libxenvchan *ctrl);
+int resize_init_cli(struct libxenvchan *ctrl, uint32_t resize_ref);
+void resize_update(struct libxenvchan *ctrl, struct libxenvchan_ring *ring);
+void resize_close(struct libxenvchan *ctrl);
+
+#endif
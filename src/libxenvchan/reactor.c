@@ -0,0 +1,293 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the reactor, which multiplexes readiness of many vchans
+ *  onto a small pool of worker threads. Each registered vchan has a thread
+ *  pool wait on a wakeup event of its own, so there is no limit on the number
+ *  of vchans (unlike WaitForMultipleObjects), and a vchan's wait is only
+ *  re-armed once its callback has returned, so callbacks for one vchan are
+ *  serialized. A second wait takes notifications off the vchan's event and
+ *  hands them out with wake_waiters(), which sets the wakeup event, as do
+ *  threads blocked on the vchan when they take a notification themselves.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "private.h"
+
+struct libxenvchan_reactor_entry {
+    struct libxenvchan_reactor *reactor;
+    struct libxenvchan *ctrl;
+    /* wait on wakeup, which dispatches the callback */
+    PTP_WAIT wait;
+    HANDLE wakeup;
+    /* wait on the vchan's event, which passes notifications on */
+    PTP_WAIT relay;
+    libxenvchan_reactor_cb *callback;
+    void *context;
+    /* protects interest, armed, closed and removing */
+    CRITICAL_SECTION lock;
+    int interest;
+    /* true while the wait is queued or its callback is running */
+    int armed;
+    /* true once LIBXENVCHAN_CLOSED has been reported */
+    int closed;
+    /* stops the relay from re-arming */
+    int removing;
+    struct libxenvchan_reactor_entry *prev, *next;
+};
+
+struct libxenvchan_reactor {
+    PTP_POOL pool;
+    TP_CALLBACK_ENVIRON env;
+    /* protects the list of entries */
+    CRITICAL_SECTION lock;
+    struct libxenvchan_reactor_entry *entries;
+};
+
+/*
+ * Queue the wait for the entry's wakeup. If the vchan is ready already, use
+ * a zero timeout so that the callback is dispatched right away.
+ * Called with entry->lock held.
+ */
+static void reactor_arm(struct libxenvchan_reactor_entry *entry)
+{
+    FILETIME immediate = { 0, 0 };
+    int events = libxenvchan_poll(entry->ctrl, entry->interest);
+
+    if (entry->closed || !entry->interest)
+    {
+        entry->armed = 0;
+        return;
+    }
+
+    entry->armed = 1;
+    if (events & (entry->interest | LIBXENVCHAN_CLOSED))
+        SetThreadpoolWait(entry->wait, entry->wakeup, &immediate);
+    else
+        SetThreadpoolWait(entry->wait, entry->wakeup, NULL);
+}
+
+static VOID CALLBACK reactor_relay_cb(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WAIT wait, TP_WAIT_RESULT result)
+{
+    struct libxenvchan_reactor_entry *entry = context;
+
+    /* threads blocked on either ring may be waiting for this too */
+    wake_waiters(entry->ctrl);
+
+    EnterCriticalSection(&entry->lock);
+    if (!entry->removing)
+        SetThreadpoolWait(entry->relay, entry->ctrl->event, NULL);
+    LeaveCriticalSection(&entry->lock);
+}
+
+static VOID CALLBACK reactor_wait_cb(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WAIT wait, TP_WAIT_RESULT result)
+{
+    struct libxenvchan_reactor_entry *entry = context;
+    int interest;
+    int events;
+
+    /* modify and remove may change the interest while we look */
+    EnterCriticalSection(&entry->lock);
+    interest = entry->interest;
+    LeaveCriticalSection(&entry->lock);
+
+    events = libxenvchan_poll(entry->ctrl, interest);
+    if (events & LIBXENVCHAN_CLOSED)
+    {
+        EnterCriticalSection(&entry->lock);
+        entry->closed = 1;
+        LeaveCriticalSection(&entry->lock);
+    }
+
+    if (events & (interest | LIBXENVCHAN_CLOSED))
+        entry->callback(entry->ctrl, events, entry->context);
+
+    EnterCriticalSection(&entry->lock);
+    reactor_arm(entry);
+    LeaveCriticalSection(&entry->lock);
+}
+
+struct libxenvchan_reactor *libxenvchan_reactor_create(int threads)
+{
+    struct libxenvchan_reactor *reactor;
+    SYSTEM_INFO info;
+
+    if (threads <= 0)
+    {
+        GetSystemInfo(&info);
+        threads = info.dwNumberOfProcessors;
+    }
+
+    reactor = malloc(sizeof(*reactor));
+    if (!reactor)
+        return NULL;
+
+    ZeroMemory(reactor, sizeof(*reactor));
+
+    reactor->pool = CreateThreadpool(NULL);
+    if (!reactor->pool)
+    {
+        free(reactor);
+        return NULL;
+    }
+
+    SetThreadpoolThreadMaximum(reactor->pool, threads);
+    if (!SetThreadpoolThreadMinimum(reactor->pool, 1))
+    {
+        CloseThreadpool(reactor->pool);
+        free(reactor);
+        return NULL;
+    }
+
+    InitializeThreadpoolEnvironment(&reactor->env);
+    SetThreadpoolCallbackPool(&reactor->env, reactor->pool);
+    InitializeCriticalSection(&reactor->lock);
+    return reactor;
+}
+
+void libxenvchan_reactor_destroy(struct libxenvchan_reactor *reactor)
+{
+    if (!reactor)
+        return;
+
+    while (reactor->entries)
+        libxenvchan_reactor_remove(reactor->entries);
+
+    DeleteCriticalSection(&reactor->lock);
+    DestroyThreadpoolEnvironment(&reactor->env);
+    CloseThreadpool(reactor->pool);
+    free(reactor);
+}
+
+struct libxenvchan_reactor_entry *libxenvchan_reactor_add(struct libxenvchan_reactor *reactor, struct libxenvchan *ctrl,
+                                                          int interest, libxenvchan_reactor_cb *callback, void *context)
+{
+    struct libxenvchan_reactor_entry *entry;
+
+    if (!reactor || !ctrl || !callback)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return NULL;
+    }
+
+    entry = malloc(sizeof(*entry));
+    if (!entry)
+        return NULL;
+
+    ZeroMemory(entry, sizeof(*entry));
+    entry->reactor = reactor;
+    entry->ctrl = ctrl;
+    entry->callback = callback;
+    entry->context = context;
+    entry->interest = interest;
+
+    entry->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!entry->wakeup)
+    {
+        free(entry);
+        return NULL;
+    }
+
+    entry->wait = CreateThreadpoolWait(reactor_wait_cb, entry, &reactor->env);
+    entry->relay = CreateThreadpoolWait(reactor_relay_cb, entry, &reactor->env);
+    if (!entry->wait || !entry->relay)
+    {
+        if (entry->wait)
+            CloseThreadpoolWait(entry->wait);
+        if (entry->relay)
+            CloseThreadpoolWait(entry->relay);
+        CloseHandle(entry->wakeup);
+        free(entry);
+        return NULL;
+    }
+
+    InitializeCriticalSection(&entry->lock);
+    ctrl->reactor_wakeup = entry->wakeup;
+
+    EnterCriticalSection(&reactor->lock);
+    entry->next = reactor->entries;
+    if (entry->next)
+        entry->next->prev = entry;
+    reactor->entries = entry;
+    LeaveCriticalSection(&reactor->lock);
+
+    EnterCriticalSection(&entry->lock);
+    SetThreadpoolWait(entry->relay, ctrl->event, NULL);
+    reactor_arm(entry);
+    LeaveCriticalSection(&entry->lock);
+
+    return entry;
+}
+
+void libxenvchan_reactor_modify(struct libxenvchan_reactor_entry *entry, int interest)
+{
+    int added;
+
+    EnterCriticalSection(&entry->lock);
+    added = interest & ~entry->interest;
+    entry->interest = interest;
+    /* if the callback is running, it re-arms with the new interest */
+    if (!entry->armed)
+        reactor_arm(entry);
+    else if (added)
+    {
+        // a queued wait never asked to be notified of the new events; have
+        // the callback look (at worst it runs once with nothing ready)
+        SetEvent(entry->wakeup);
+    }
+    LeaveCriticalSection(&entry->lock);
+}
+
+void libxenvchan_reactor_remove(struct libxenvchan_reactor_entry *entry)
+{
+    struct libxenvchan_reactor *reactor = entry->reactor;
+
+    /* stop running callbacks from re-arming the waits */
+    EnterCriticalSection(&entry->lock);
+    entry->interest = 0;
+    entry->removing = 1;
+    LeaveCriticalSection(&entry->lock);
+
+    SetThreadpoolWait(entry->relay, NULL, NULL);
+    WaitForThreadpoolWaitCallbacks(entry->relay, TRUE);
+    CloseThreadpoolWait(entry->relay);
+
+    SetThreadpoolWait(entry->wait, NULL, NULL);
+    WaitForThreadpoolWaitCallbacks(entry->wait, TRUE);
+    CloseThreadpoolWait(entry->wait);
+
+    /* threads blocked on the vchan stop passing notifications on */
+    entry->ctrl->reactor_wakeup = NULL;
+
+    EnterCriticalSection(&reactor->lock);
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        reactor->entries = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    LeaveCriticalSection(&reactor->lock);
+
+    DeleteCriticalSection(&entry->lock);
+    CloseHandle(entry->wakeup);
+    free(entry);
+}
@@ -0,0 +1,446 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the live ring resize protocol. The steps of a resize
+ *  are driven from the data path of whichever side owns them, see
+ *  struct vchan_resize.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <intrin.h>
+
+#include "private.h"
+
+#ifndef offsetof
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
+
+#define xen_rmb() _ReadBarrier()
+#define xen_wmb() _WriteBarrier()
+
+static struct vchan_resize_ring *resize_shared(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    /* left is client write, server read */
+    if ((ring == &ctrl->read) == (ctrl->is_server != 0))
+        return &ctrl->resize->left;
+    else
+        return &ctrl->resize->right;
+}
+
+/*
+ * Resize steps are rare, so the peer is always signalled instead of going
+ * through the notification bits of the data path.
+ */
+static void resize_signal(struct libxenvchan *ctrl)
+{
+    DWORD status;
+
+    status = ctrl->backend->evtchn_notify(ctrl->xc, ctrl->event_port);
+    if (status != ERROR_SUCCESS)
+        Log(XLL_ERROR, "failed to notify event channel %u: 0x%x", ctrl->event_port, status);
+}
+
+static void release_pages(struct libxenvchan *ctrl, void *buffer, void *grant_dir, int order)
+{
+    if (order >= PAGE_SHIFT && buffer)
+    {
+        if (ctrl->is_server)
+            ctrl->backend->gnttab_revoke(ctrl->xc, buffer);
+        else
+            ctrl->backend->gnttab_unmap(ctrl->xc, buffer);
+    }
+
+    if (grant_dir)
+        ctrl->backend->gnttab_revoke(ctrl->xc, grant_dir);
+}
+
+/*
+ * The server rewrites the grant list in the shared page after a resize, so
+ * that a restarting client maps the current rings. Check that it will still
+ * fit in front of a ring that stays inside the shared page.
+ */
+static int shared_layout_fits(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, int order)
+{
+    struct libxenvchan_ring *other = ring == &ctrl->read ? &ctrl->write : &ctrl->read;
+    int grants = ring_grants(order) + max(ring_grants(other->order), ring_grants(other->next_order));
+    size_t limit = PAGE_SIZE;
+
+    if (other->order == SMALL_RING_SHIFT)
+        limit = SMALL_RING_OFFSET;
+    else if (other->order == LARGE_RING_SHIFT)
+        limit = LARGE_RING_OFFSET;
+
+    return offsetof(struct vchan_interface, grants) + grants * sizeof(uint32_t) <= limit;
+}
+
+static void update_shared_layout(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, struct vchan_resize_ring *shr)
+{
+    struct vchan_interface *page = ctrl->ring;
+    int left = ring == &ctrl->read;
+    int old_left = ring_grants(left ? ring->prev_order : ctrl->read.order);
+    int new_left = ring_grants(ctrl->read.order);
+    int right = ring_grants(ctrl->write.order);
+
+    if (left)
+    {
+        memmove(page->grants + new_left, page->grants + old_left, right * sizeof(uint32_t));
+        memcpy(page->grants, shr->grants, new_left * sizeof(uint32_t));
+        page->left_order = (uint16_t)ctrl->read.order;
+    }
+    else
+    {
+        memcpy(page->grants + new_left, shr->grants, right * sizeof(uint32_t));
+        page->right_order = (uint16_t)ctrl->write.order;
+    }
+}
+
+static void resize_offer(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, struct vchan_resize_ring *shr, int order)
+{
+    struct libxenvchan_ring next;
+    DWORD status;
+
+    if (order < PAGE_SHIFT || order > MAX_INDIRECT_RING_SHIFT || !shared_layout_fits(ctrl, ring, order))
+    {
+        Log(XLL_ERROR, "can't resize ring to order %d", order);
+        return;
+    }
+
+    ZeroMemory(&next, sizeof(next));
+    next.order = order;
+
+    status = grant_ring_pages(ctrl, ctrl->domain, &next, shr->grants);
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_ERROR, "Granting resized ring (%d pages) to domain %u failed", ring_pages(order), ctrl->domain);
+        return;
+    }
+
+    ring->next_buffer = next.buffer;
+    ring->next_grant_dir = next.grant_dir;
+    ring->next_order = order;
+
+    shr->order = (uint16_t)order;
+    xen_wmb(); /* publish the grants /before/ the offer */
+    shr->state = VCHAN_RESIZE_OFFERED;
+    resize_signal(ctrl);
+}
+
+static int map_next(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, struct vchan_resize_ring *shr)
+{
+    struct libxenvchan_ring next;
+    DWORD status = ERROR_INVALID_PARAMETER;
+
+    ZeroMemory(&next, sizeof(next));
+    next.order = shr->order;
+    xen_rmb(); /* read the grants /after/ the offer */
+
+    if (next.order >= PAGE_SHIFT && next.order <= MAX_INDIRECT_RING_SHIFT)
+        status = map_ring_pages(ctrl, ctrl->domain, &next, shr->grants, ring == &ctrl->read ? XENIFACE_GNTTAB_READONLY : 0);
+
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_ERROR, "Mapping resized ring (order %d) from domain %u failed", next.order, ctrl->domain);
+        return -1;
+    }
+
+    ring->next_buffer = next.buffer;
+    ring->next_order = next.order;
+    return 0;
+}
+
+static void resize_map(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, struct vchan_resize_ring *shr)
+{
+    if (map_next(ctrl, ring, shr))
+    {
+        shr->state = VCHAN_RESIZE_FAILED;
+        resize_signal(ctrl);
+        return;
+    }
+
+    xen_wmb();
+    shr->state = VCHAN_RESIZE_MAPPED;
+    resize_signal(ctrl);
+}
+
+/*
+ * Move this side over to the new ring. The client is done with the old ring
+ * right away; the server keeps it until the peer has moved over as well.
+ */
+static void resize_switch(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    ring->prev_buffer = ring->buffer;
+    ring->prev_grant_dir = ring->grant_dir;
+    ring->prev_order = ring->order;
+
+    ring->buffer = ring->next_buffer;
+    ring->grant_dir = ring->next_grant_dir;
+    ring->order = ring->next_order;
+
+    ring->next_buffer = ring->next_grant_dir = NULL;
+    ring->next_order = 0;
+
+    if (!ctrl->is_server)
+    {
+        release_pages(ctrl, ring->prev_buffer, ring->prev_grant_dir, ring->prev_order);
+        ring->prev_buffer = ring->prev_grant_dir = NULL;
+        ring->prev_order = 0;
+    }
+}
+
+/* server only: both sides are on the new ring */
+static void resize_finish(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, struct vchan_resize_ring *shr)
+{
+    update_shared_layout(ctrl, ring, shr);
+
+    release_pages(ctrl, ring->prev_buffer, ring->prev_grant_dir, ring->prev_order);
+    ring->prev_buffer = ring->prev_grant_dir = NULL;
+    ring->prev_order = 0;
+
+    xen_wmb();
+    shr->state = VCHAN_RESIZE_IDLE;
+    resize_signal(ctrl);
+}
+
+void resize_update(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    struct vchan_resize_ring *shr = resize_shared(ctrl, ring);
+    int producer = ring == &ctrl->write;
+    int order;
+
+    switch (shr->state)
+    {
+    case VCHAN_RESIZE_IDLE:
+        ring->switching = 0;
+        order = shr->req_order;
+        if (!ctrl->is_server || !order)
+            break;
+
+        shr->req_order = 0;
+        if (order != ring->order)
+            resize_offer(ctrl, ring, shr, order);
+        break;
+
+    case VCHAN_RESIZE_OFFERED:
+        if (!ctrl->is_server && !ring->next_buffer)
+            resize_map(ctrl, ring, shr);
+        break;
+
+    case VCHAN_RESIZE_MAPPED:
+        if (!producer)
+            break;
+
+        /* the consumer reads up to here from the old ring */
+        shr->switch_idx = *ring->prod;
+        resize_switch(ctrl, ring);
+        ring->switching = 1;
+
+        xen_wmb();
+        shr->state = VCHAN_RESIZE_SWITCHING;
+        resize_signal(ctrl);
+        break;
+
+    case VCHAN_RESIZE_SWITCHING:
+        xen_rmb(); /* read switch_idx /after/ the state */
+        if (producer || *ring->cons != shr->switch_idx)
+            break;
+
+        resize_switch(ctrl, ring);
+
+        xen_wmb();
+        shr->state = VCHAN_RESIZE_SWITCHED;
+        if (ctrl->is_server)
+            resize_finish(ctrl, ring, shr);
+        else
+            resize_signal(ctrl);
+        break;
+
+    case VCHAN_RESIZE_SWITCHED:
+        ring->switching = 0;
+        if (ctrl->is_server)
+            resize_finish(ctrl, ring, shr);
+        break;
+
+    case VCHAN_RESIZE_FAILED:
+        if (!ctrl->is_server)
+            break;
+
+        release_pages(ctrl, ring->next_buffer, ring->next_grant_dir, ring->next_order);
+        ring->next_buffer = ring->next_grant_dir = NULL;
+        ring->next_order = 0;
+        shr->state = VCHAN_RESIZE_IDLE;
+        break;
+    }
+}
+
+static int resize_request(struct libxenvchan *ctrl, struct libxenvchan_ring *ring, size_t size)
+{
+    struct vchan_resize_ring *shr = resize_shared(ctrl, ring);
+    int order = min_order((int)size);
+
+    if (order == ring->order)
+        return 0;
+
+    if (shr->state != VCHAN_RESIZE_IDLE || shr->req_order)
+    {
+        Log(XLL_ERROR, "resize already in progress");
+        return -1;
+    }
+
+    if (!shared_layout_fits(ctrl, ring, order))
+    {
+        Log(XLL_ERROR, "grants for a ring of order %d don't fit in the shared page", order);
+        return -1;
+    }
+
+    shr->req_order = (uint16_t)order;
+    return 0;
+}
+
+int libxenvchan_resize(struct libxenvchan *ctrl, size_t read_min, size_t write_min)
+{
+    if (!ctrl->resize || !ctrl->resize->cli_resize)
+    {
+        Log(XLL_ERROR, "peer does not support resizing");
+        return -1;
+    }
+
+    if (read_min > MAX_INDIRECT_RING_SIZE || write_min > MAX_INDIRECT_RING_SIZE)
+    {
+        Log(XLL_ERROR, "ring size too large");
+        return -1;
+    }
+
+    if (read_min && resize_request(ctrl, &ctrl->read, read_min))
+        return -1;
+
+    if (write_min && resize_request(ctrl, &ctrl->write, write_min))
+        return -1;
+
+    /* the server picks requests up from its data path */
+    resize_signal(ctrl);
+    return 0;
+}
+
+uint32_t resize_init_srv(struct libxenvchan *ctrl)
+{
+    uint32_t ref;
+    void *page;
+    DWORD status;
+
+    status = ctrl->backend->gnttab_grant(ctrl->xc,
+                                         ctrl->domain,
+                                         1,
+                                         0,
+                                         0,
+                                         0, // no notifications
+                                         &page,
+                                         &ref);
+
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_ERROR, "Granting resize page to domain %u failed", ctrl->domain);
+        return ~0ul;
+    }
+
+    ZeroMemory(page, sizeof(struct vchan_resize));
+    ctrl->resize = page;
+    return ref;
+}
+
+/*
+ * A client that reconnects in the middle of a resize takes over from the
+ * previous one. The shared page still describes the old rings until the
+ * server finishes the resize, so map the new ring if the previous client
+ * had it mapped, and move to it if the previous client already had.
+ */
+static void resize_adopt(struct libxenvchan *ctrl, struct libxenvchan_ring *ring)
+{
+    struct vchan_resize_ring *shr = resize_shared(ctrl, ring);
+    uint8_t state = shr->state;
+    int producer = ring == &ctrl->write;
+
+    if (state < VCHAN_RESIZE_MAPPED || state > VCHAN_RESIZE_SWITCHED)
+        return;
+
+    if (map_next(ctrl, ring, shr))
+        return;
+
+    if (state == VCHAN_RESIZE_SWITCHED || (state == VCHAN_RESIZE_SWITCHING && producer))
+    {
+        resize_switch(ctrl, ring);
+        ring->switching = state == VCHAN_RESIZE_SWITCHING;
+    }
+}
+
+int resize_init_cli(struct libxenvchan *ctrl, uint32_t resize_ref)
+{
+    void *page;
+    DWORD status;
+
+    status = ctrl->backend->gnttab_map(ctrl->xc,
+                                       ctrl->domain,
+                                       1,
+                                       &resize_ref,
+                                       0,
+                                       0,
+                                       0, // no notifications
+                                       &page);
+
+    if (status != ERROR_SUCCESS)
+    {
+        Log(XLL_WARNING, "Mapping resize page (ref %u) from domain %u failed, resizing disabled", resize_ref, ctrl->domain);
+        return -1;
+    }
+
+    ctrl->resize = page;
+    resize_adopt(ctrl, &ctrl->read);
+    resize_adopt(ctrl, &ctrl->write);
+    ctrl->resize->cli_resize = 1;
+    return 0;
+}
+
+void resize_close(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_ring *rings[2] = { &ctrl->read, &ctrl->write };
+    int i;
+
+    for (i = 0; i < 2; i++)
+    {
+        release_pages(ctrl, rings[i]->next_buffer, rings[i]->next_grant_dir, rings[i]->next_order);
+        release_pages(ctrl, rings[i]->prev_buffer, rings[i]->prev_grant_dir, rings[i]->prev_order);
+    }
+
+    if (!ctrl->resize)
+        return;
+
+    if (ctrl->is_server)
+    {
+        ctrl->backend->gnttab_revoke(ctrl->xc, ctrl->resize);
+    }
+    else
+    {
+        ctrl->resize->cli_resize = 0;
+        ctrl->backend->gnttab_unmap(ctrl->xc, ctrl->resize);
+    }
+
+    ctrl->resize = NULL;
+}
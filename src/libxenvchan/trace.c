@@ -0,0 +1,234 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ *  This file contains the trace ring: a fixed-size buffer of time-stamped
+ *  index transitions that overwrites its oldest entries. Writers claim a
+ *  slot with one interlocked increment and never wait for each other.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <intrin.h>
+
+#include "private.h"
+
+#define xen_rmb() _ReadBarrier()
+#define xen_wmb() _WriteBarrier()
+
+/* largest trace ring, 256MiB of entries */
+#define MAX_TRACE_SHIFT 24
+
+struct libxenvchan_trace {
+    /* number of events claimed so far; the next one goes in slot head & mask */
+    volatile LONGLONG head;
+    int shift;
+    uint64_t mask;
+    /* next ring on the retired list */
+    struct libxenvchan_trace *next;
+    /* when tracing started, to work out the time stamp counter frequency */
+    uint64_t tsc_start;
+    LARGE_INTEGER qpc_start;
+    struct libxenvchan_trace_entry entries[1];
+};
+
+void trace_record(struct libxenvchan_trace *trace, uint8_t type, uint8_t arg, uint32_t value)
+{
+    uint64_t seq = (uint64_t)InterlockedIncrement64(&trace->head) - 1;
+    struct libxenvchan_trace_entry *e = &trace->entries[seq & trace->mask];
+
+    /*
+     * type 0 marks the slot as being written. seq holds the number of times
+     * the ring has wrapped, so that a dump can tell this event from the one
+     * it replaces.
+     */
+    e->type = 0;
+    xen_wmb();
+    e->tsc = __rdtsc();
+    e->value = value;
+    e->arg = arg;
+    e->seq = (uint16_t)(seq >> trace->shift);
+    xen_wmb();
+    e->type = type;
+}
+
+/*
+ * Take the current ring out of use. Other threads may still be recording
+ * into it, so it is kept on the retired list until the vchan is closed.
+ */
+static void trace_retire(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_trace *trace = ctrl->trace;
+
+    if (!trace)
+        return;
+
+    ctrl->trace = NULL;
+    trace->next = ctrl->trace_retired;
+    ctrl->trace_retired = trace;
+}
+
+/*
+ * Reuse a retired ring of the same size, so that toggling tracing doesn't
+ * grow memory. A thread still recording into it can at worst leave one
+ * stray event in the new trace, as the mask stays within the ring.
+ */
+static struct libxenvchan_trace *trace_reuse(struct libxenvchan *ctrl, int shift)
+{
+    struct libxenvchan_trace **link;
+    struct libxenvchan_trace *trace;
+
+    for (link = &ctrl->trace_retired; *link; link = &(*link)->next)
+    {
+        trace = *link;
+        if (trace->shift == shift)
+        {
+            *link = trace->next;
+            return trace;
+        }
+    }
+
+    return NULL;
+}
+
+int libxenvchan_trace_enable(struct libxenvchan *ctrl, size_t entries)
+{
+    struct libxenvchan_trace *trace;
+    size_t size;
+    int shift = 0;
+
+    if (!entries)
+    {
+        trace_retire(ctrl);
+        return 0;
+    }
+
+    while (((size_t)1 << shift) < entries)
+    {
+        if (++shift > MAX_TRACE_SHIFT)
+            return -1;
+    }
+
+    size = sizeof(*trace) + (((size_t)1 << shift) - 1) * sizeof(trace->entries[0]);
+    trace = trace_reuse(ctrl, shift);
+    if (!trace)
+    {
+        trace = malloc(size);
+        if (!trace)
+            return -1;
+    }
+
+    ZeroMemory(trace, size);
+    trace->shift = shift;
+    trace->mask = ((uint64_t)1 << shift) - 1;
+    QueryPerformanceCounter(&trace->qpc_start);
+    trace->tsc_start = __rdtsc();
+
+    trace_retire(ctrl);
+    xen_wmb(); /* set the ring up /before/ publishing it */
+    ctrl->trace = trace;
+    return 0;
+}
+
+void trace_close(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_trace *trace;
+
+    trace_retire(ctrl);
+    while (ctrl->trace_retired)
+    {
+        trace = ctrl->trace_retired;
+        ctrl->trace_retired = trace->next;
+        free(trace);
+    }
+}
+
+/**
+ * Estimate the time stamp counter frequency over the time since tracing
+ * started, against the performance counter.
+ */
+static uint64_t tsc_freq(struct libxenvchan_trace *trace)
+{
+    LARGE_INTEGER freq, now;
+    uint64_t tsc;
+
+    QueryPerformanceCounter(&now);
+    tsc = __rdtsc();
+    QueryPerformanceFrequency(&freq);
+
+    if (now.QuadPart <= trace->qpc_start.QuadPart)
+        return 0;
+
+    return (uint64_t)((double)(tsc - trace->tsc_start) * freq.QuadPart /
+                      (now.QuadPart - trace->qpc_start.QuadPart));
+}
+
+int libxenvchan_trace_dump(struct libxenvchan *ctrl, void *buf, size_t size)
+{
+    struct libxenvchan_trace *trace = trace_get(ctrl);
+    struct libxenvchan_trace_header *hdr = buf;
+    struct libxenvchan_trace_entry *out = (struct libxenvchan_trace_entry *)(hdr + 1);
+    struct libxenvchan_trace_entry *e, copy;
+    uint64_t head, seq, n;
+    uint32_t count = 0;
+
+    if (!trace)
+        return -1;
+
+    head = (uint64_t)trace->head;
+    n = min(head, trace->mask + 1);
+
+    if (!buf)
+        return (int)(sizeof(*hdr) + n * sizeof(*out));
+
+    if (size < sizeof(*hdr))
+        return -1;
+
+    /* keep the newest events if they don't all fit */
+    n = min(n, (size - sizeof(*hdr)) / sizeof(*out));
+
+    for (seq = head - n; seq != head; seq++)
+    {
+        e = &trace->entries[seq & trace->mask];
+
+        copy = *e;
+        xen_rmb();
+
+        /* skip events being written, or overwritten since we read head */
+        if (!copy.type || copy.seq != (uint16_t)(seq >> trace->shift) ||
+            e->type != copy.type || e->seq != copy.seq)
+            continue;
+
+        /* a dump numbers its entries instead, so that gaps show */
+        copy.seq = (uint16_t)seq;
+        out[count++] = copy;
+    }
+
+    hdr->magic = LIBXENVCHAN_TRACE_MAGIC;
+    hdr->version = LIBXENVCHAN_TRACE_VERSION;
+    hdr->tsc_freq = tsc_freq(trace);
+    hdr->recorded = head;
+    hdr->count = count;
+    hdr->is_server = ctrl->is_server;
+    hdr->read_size = 1 << ctrl->read.order;
+    hdr->write_size = 1 << ctrl->write.order;
+
+    return (int)(sizeof(*hdr) + count * sizeof(*out));
+}
@@ -0,0 +1,1112 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ * This is a benchmark for libxenvchan. It sweeps a matrix of message sizes,
+ * ring sizes, blocking and nonblocking mode and the stream and packet
+ * interfaces, and reports throughput, notifications and CPU time for each
+ * combination as CSV or JSON. Results can be compared against a baseline
+ * from an earlier run to catch regressions.
+ *
+ * With -m latency, it measures instead what a request costs: the round trip
+ * time of a ping-pong exchange for each message size, the time from a send
+ * until a blocked peer wakes up, the time spent in the notify call, and the
+ * cost of the request_notify double check a reader does on an empty ring.
+ *
+ * With "server" and "client", the ends run in two domains over Xen: the
+ * client sends, and the server measures and reports (for latency, the
+ * server echoes, and the client measures the round trips only). By default,
+ * the benchmark runs the same way over the loopback backend, with a copy of
+ * itself as the peer process, so that the results include crossing between
+ * two address spaces. Only the wakeup and peek tests keep both ends in this
+ * process, as they need one clock and one vchan.
+ *
+ * Like the library, the benchmark only builds for Windows: the loopback
+ * backend is made of Win32 sections and events, so latency numbers without
+ * Xen come from two processes on one Windows machine, not from a Linux host.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <windows.h>
+
+#include <libxenvchan.h>
+#include <xencontrol.h>
+
+#include <strsafe.h>
+
+void XifLogger(XENCONTROL_LOG_LEVEL level, const CHAR *function, const WCHAR *format, va_list args)
+{
+    WCHAR buf[1024];
+
+    // keep debug output out of the measurements
+    if (level > XLL_WARNING)
+        return;
+
+    StringCbVPrintfW(buf, sizeof(buf), format, args);
+    fprintf(stderr, "[X] %s: %S\n", function, buf);
+}
+
+#define snprintf _snprintf
+
+#define perror(msg) fprintf(stderr, __FUNCTION__ ": " msg " failed: error 0x%x\n", GetLastError())
+
+#define MAX_SIZES 32
+#define MAX_BASELINE 4096
+
+/* one combination of the matrix */
+struct cell {
+    int packet;
+    int blocking;
+    size_t ring_size;
+    size_t msg_size;
+};
+
+struct result {
+    struct cell cell;
+    uint64_t bytes;
+    double seconds;
+    double mb_per_s;
+    double msgs_per_s;
+    double notifies_per_mb;
+    double cpu_ms;
+};
+
+struct baseline {
+    char api[16], mode[16];
+    unsigned ring_size, msg_size;
+    double mb_per_s;
+};
+
+static size_t msg_sizes[MAX_SIZES] = { 64, 512, 4096, 65536 };
+static int num_msg_sizes = 4;
+static size_t ring_sizes[MAX_SIZES] = { 1024, 2048, 4096, 65536, 1048576 };
+static int num_ring_sizes = 5;
+static size_t lat_sizes[MAX_SIZES] = { 1, 64, 512, 4096 };
+static int num_lat_sizes = 4;
+static int iterations = 100000;
+static int spin_usec;
+static int busy_poll;
+static uint64_t total_bytes = 64 << 20;
+static int json;
+static int rows;
+
+static struct baseline baseline[MAX_BASELINE];
+static int num_baseline;
+static double threshold = 10;
+
+void usage(char** argv)
+{
+    fprintf(stderr, "usage:\n"
+            "%s [options] [loopback | server domid nodepath | client domid nodepath]\n"
+            "  -l           use the loopback backend for server and client, which then\n"
+            "               run in two processes on this machine\n"
+            "  -m throughput|latency  what to measure (default throughput)\n"
+            "  -s sizes     message sizes, comma separated (default 64,512,4096,65536,\n"
+            "               or 1,64,512,4096 for latency)\n"
+            "  -r sizes     ring sizes, comma separated (default 1024,2048,4096,65536,1048576,\n"
+            "               or 65536 for latency, where only the first is used)\n"
+            "  -b bytes     data sent for each combination (default 67108864)\n"
+            "  -n count     round trips for each latency test (default 100000)\n"
+            "  -p usec|busy spin_usec of the ping-pong vchans (default 0), or busy polling\n"
+            "  -f csv|json  output format (default csv)\n"
+            "  -c file      compare throughput against a baseline in CSV format; exit status 2\n"
+            "               on regression\n"
+            "  -t percent   throughput drop that counts as a regression (default 10)\n", argv[0]);
+    exit(1);
+}
+
+static int parse_sizes(const char *arg, size_t *sizes)
+{
+    int n = 0;
+
+    while (*arg && n < MAX_SIZES)
+    {
+        sizes[n] = strtoul(arg, (char **)&arg, 0);
+        if (!sizes[n])
+            return 0;
+        n++;
+        if (*arg == ',')
+            arg++;
+    }
+
+    return n;
+}
+
+static uint64_t now_nsec(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000000 +
+                      now.QuadPart % freq.QuadPart * 1000000000 / freq.QuadPart);
+}
+
+static double now_sec(void)
+{
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+}
+
+/* user plus kernel time of this process, in milliseconds */
+static double cpu_ms(void)
+{
+    FILETIME create, exit, kernel, user;
+    ULARGE_INTEGER k, u;
+
+    GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &user);
+    k.LowPart = kernel.dwLowDateTime;
+    k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime;
+    u.HighPart = user.dwHighDateTime;
+    return (k.QuadPart + u.QuadPart) / 10000.0;
+}
+
+static const char *api_name(const struct cell *cell)
+{
+    return cell->packet ? "packet" : "stream";
+}
+
+static const char *mode_name(const struct cell *cell)
+{
+    return cell->blocking ? "blocking" : "nonblocking";
+}
+
+/* bytes to send for a cell: whole messages, so that packet receives match */
+static uint64_t cell_bytes(const struct cell *cell)
+{
+    uint64_t bytes = total_bytes - total_bytes % cell->msg_size;
+
+    return bytes ? bytes : cell->msg_size;
+}
+
+static int send_all(struct libxenvchan *ctrl, const struct cell *cell, char *buf)
+{
+    uint64_t bytes = cell_bytes(cell);
+    uint64_t done = 0;
+    int ret;
+
+    while (done < bytes)
+    {
+        if (cell->packet)
+            ret = libxenvchan_send(ctrl, buf, cell->msg_size);
+        else
+            ret = libxenvchan_write(ctrl, buf, cell->msg_size);
+
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+        {
+            // nonblocking and the ring is full
+            if (libxenvchan_wait(ctrl))
+                return -1;
+            continue;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+static int recv_all(struct libxenvchan *ctrl, const struct cell *cell, char *buf)
+{
+    uint64_t bytes = cell_bytes(cell);
+    uint64_t done = 0;
+    int ret;
+
+    while (done < bytes)
+    {
+        if (cell->packet)
+            ret = libxenvchan_recv(ctrl, buf, cell->msg_size);
+        else
+            ret = libxenvchan_read(ctrl, buf, cell->msg_size);
+
+        if (ret < 0)
+            return -1;
+
+        if (ret == 0)
+        {
+            if (libxenvchan_wait(ctrl))
+                return -1;
+            continue;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+}
+
+/*
+ * The data goes from the client to the server, into the server's read ring.
+ * Asking for a small write ring keeps in-page read rings of 1K and 2K.
+ */
+static struct libxenvchan *open_server(int domain, const char *path, const struct cell *cell)
+{
+    struct libxenvchan *ctrl;
+
+    ctrl = libxenvchan_server_init(XifLogger, domain, path, cell->ring_size, 1024);
+    if (ctrl)
+        ctrl->blocking = cell->blocking;
+
+    return ctrl;
+}
+
+static void finish_result(struct result *res, const struct cell *cell, double seconds, double cpu,
+                          const struct libxenvchan_stats *stats, int nstats)
+{
+    double mb;
+    uint64_t notifies = 0;
+    int i;
+
+    for (i = 0; i < nstats; i++)
+        notifies += stats[i].notifies_sent;
+
+    res->cell = *cell;
+    res->bytes = cell_bytes(cell);
+    res->seconds = seconds;
+    mb = res->bytes / 1048576.0;
+    res->mb_per_s = seconds > 0 ? mb / seconds : 0;
+    res->msgs_per_s = seconds > 0 ? res->bytes / cell->msg_size / seconds : 0;
+    res->notifies_per_mb = notifies / mb;
+    res->cpu_ms = cpu;
+}
+
+static int run_server(int domain, const char *path, const struct cell *cell, char *buf, struct result *res)
+{
+    struct libxenvchan *ctrl;
+    struct libxenvchan_stats stats;
+    double start, cpu;
+    int ret;
+
+    ctrl = open_server(domain, path, cell);
+    if (!ctrl)
+    {
+        perror("libxenvchan_server_init");
+        return -1;
+    }
+
+    // the client doesn't signal its arrival
+    while (libxenvchan_is_open(ctrl) == 2)
+        Sleep(1);
+
+    libxenvchan_reset_stats(ctrl);
+    cpu = cpu_ms();
+    start = now_sec();
+
+    ret = recv_all(ctrl, cell, buf);
+
+    libxenvchan_get_stats(ctrl, &stats);
+    finish_result(res, cell, now_sec() - start, cpu_ms() - cpu, &stats, 1);
+
+    libxenvchan_close(ctrl);
+    return ret;
+}
+
+static int run_client(int domain, const char *path, const struct cell *cell, char *buf)
+{
+    struct libxenvchan *ctrl = NULL;
+    int tries;
+    int ret;
+
+    // the server sets up each vchan once it is done with the previous one
+    for (tries = 0; tries < 1000 && !ctrl; tries++)
+    {
+        ctrl = libxenvchan_client_init(NULL, domain, path);
+        if (!ctrl)
+            Sleep(10);
+    }
+
+    if (!ctrl)
+    {
+        perror("libxenvchan_client_init");
+        return -1;
+    }
+    ctrl->blocking = cell->blocking;
+
+    ret = send_all(ctrl, cell, buf);
+
+    // leave the server to read all of it
+    while (!ret && libxenvchan_is_open(ctrl))
+    {
+        if (libxenvchan_wait(ctrl))
+            break;
+    }
+
+    libxenvchan_close(ctrl);
+    return ret;
+}
+
+static void print_result(const struct result *res)
+{
+    if (json)
+    {
+        printf("%s  {\"api\": \"%s\", \"mode\": \"%s\", \"ring\": %u, \"msg_size\": %u, \"bytes\": %llu, "
+               "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"msgs_per_s\": %.0f, \"notifies_per_mb\": %.2f, "
+               "\"cpu_ms\": %.1f}",
+               rows ? ",\n" : "[\n",
+               api_name(&res->cell), mode_name(&res->cell), (unsigned)res->cell.ring_size,
+               (unsigned)res->cell.msg_size, res->bytes, res->seconds, res->mb_per_s, res->msgs_per_s,
+               res->notifies_per_mb, res->cpu_ms);
+    }
+    else
+    {
+        if (!rows)
+            printf("api,mode,ring,msg_size,bytes,seconds,mb_per_s,msgs_per_s,notifies_per_mb,cpu_ms\n");
+
+        printf("%s,%s,%u,%u,%llu,%.6f,%.2f,%.0f,%.2f,%.1f\n",
+               api_name(&res->cell), mode_name(&res->cell), (unsigned)res->cell.ring_size,
+               (unsigned)res->cell.msg_size, res->bytes, res->seconds, res->mb_per_s, res->msgs_per_s,
+               res->notifies_per_mb, res->cpu_ms);
+    }
+
+    fflush(stdout);
+    rows++;
+}
+
+static void load_baseline(const char *file)
+{
+    struct baseline *b;
+    char line[512];
+    FILE *f;
+
+    f = fopen(file, "r");
+    if (!f)
+    {
+        fprintf(stderr, "can't open baseline %s\n", file);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f) && num_baseline < MAX_BASELINE)
+    {
+        b = &baseline[num_baseline];
+
+        // the header and anything else that doesn't parse is skipped
+        if (sscanf(line, "%15[^,],%15[^,],%u,%u,%*[^,],%*[^,],%lf",
+                   b->api, b->mode, &b->ring_size, &b->msg_size, &b->mb_per_s) == 5)
+            num_baseline++;
+    }
+
+    fclose(f);
+}
+
+/* returns 1 if the result is a regression from the baseline */
+static int compare_baseline(const struct result *res)
+{
+    const struct baseline *b;
+    double change;
+    int i;
+
+    for (i = 0; i < num_baseline; i++)
+    {
+        b = &baseline[i];
+
+        if (strcmp(b->api, api_name(&res->cell)) || strcmp(b->mode, mode_name(&res->cell)) ||
+            b->ring_size != res->cell.ring_size || b->msg_size != res->cell.msg_size)
+            continue;
+
+        if (b->mb_per_s <= 0)
+            return 0;
+
+        change = (res->mb_per_s - b->mb_per_s) * 100 / b->mb_per_s;
+        if (change >= -threshold)
+            return 0;
+
+        fprintf(stderr, "regression: %s %s ring %u msg %u: %.2f MB/s, baseline %.2f MB/s (%.1f%%)\n",
+                b->api, b->mode, b->ring_size, b->msg_size, res->mb_per_s, b->mb_per_s, change);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Latency tests. Samples are kept whole and sorted, so the percentiles are
+ * exact rather than bucketed.
+ */
+struct latency {
+    const char *test;
+    size_t size;
+    int count;
+    uint64_t p50, p99, p999, max;
+    double mean;
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void summarize(struct latency *lat, const char *test, size_t size, uint64_t *samples, int count)
+{
+    uint64_t sum = 0;
+    int i;
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    for (i = 0; i < count; i++)
+        sum += samples[i];
+
+    lat->test = test;
+    lat->size = size;
+    lat->count = count;
+    lat->p50 = samples[(size_t)(count - 1) * 50 / 100];
+    lat->p99 = samples[(size_t)(count - 1) * 99 / 100];
+    lat->p999 = samples[(size_t)(count - 1) * 999 / 1000];
+    lat->max = samples[count - 1];
+    lat->mean = (double)sum / count;
+}
+
+static void print_latency(const struct latency *lat)
+{
+    if (json)
+    {
+        printf("%s  {\"test\": \"%s\", \"size\": %u, \"count\": %d, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+               "\"p999_ns\": %llu, \"max_ns\": %llu, \"mean_ns\": %.1f}",
+               rows ? ",\n" : "[\n", lat->test, (unsigned)lat->size, lat->count,
+               lat->p50, lat->p99, lat->p999, lat->max, lat->mean);
+    }
+    else
+    {
+        if (!rows)
+            printf("test,size,count,p50_ns,p99_ns,p999_ns,max_ns,mean_ns\n");
+
+        printf("%s,%u,%d,%llu,%llu,%llu,%llu,%.1f\n", lat->test, (unsigned)lat->size, lat->count,
+               lat->p50, lat->p99, lat->p999, lat->max, lat->mean);
+    }
+
+    fflush(stdout);
+    rows++;
+}
+
+/* the same as print_latency(), from a library histogram */
+static void print_hist(const char *test, const struct libxenvchan_hist *hist)
+{
+    struct latency lat;
+
+    if (!hist->count)
+        return;
+
+    lat.test = test;
+    lat.size = 0;
+    lat.count = (int)hist->count;
+    lat.p50 = libxenvchan_hist_percentile(hist, 50);
+    lat.p99 = libxenvchan_hist_percentile(hist, 99);
+    lat.p999 = libxenvchan_hist_percentile(hist, 99.9);
+    lat.max = hist->max;
+    lat.mean = (double)hist->sum / hist->count;
+    print_latency(&lat);
+}
+
+struct echo {
+    struct libxenvchan *ctrl;
+    size_t size;
+    int count;
+    char *buf;
+    /* wakeup test: when the waiter saw each message */
+    uint64_t *woken;
+    int ret;
+};
+
+/* server side of the ping-pong: send every message straight back */
+static DWORD WINAPI echo_thread(LPVOID arg)
+{
+    struct echo *e = arg;
+    int i;
+
+    e->ret = -1;
+    for (i = 0; i < e->count; i++)
+    {
+        if (libxenvchan_recv(e->ctrl, e->buf, e->size) != (int)e->size)
+            return 0;
+        if (libxenvchan_send(e->ctrl, e->buf, e->size) != (int)e->size)
+            return 0;
+    }
+
+    e->ret = 0;
+    return 0;
+}
+
+/* client side of the ping-pong; warms up with the first tenth */
+static int ping_pong(struct libxenvchan *ctrl, size_t size, int count, char *buf, uint64_t *samples)
+{
+    int warmup = count / 10;
+    uint64_t start;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        start = now_nsec();
+        if (libxenvchan_send(ctrl, buf, size) != (int)size)
+            return -1;
+        if (libxenvchan_recv(ctrl, buf, size) != (int)size)
+            return -1;
+        if (i >= warmup)
+            samples[i - warmup] = now_nsec() - start;
+    }
+
+    return count - warmup;
+}
+
+/*
+ * The waiter blocks in libxenvchan_wait() until a message arrives, notes the
+ * time and acknowledges it. Spinning is off, so every wakeup goes through the
+ * notify call and the event.
+ */
+static DWORD WINAPI waiter_thread(LPVOID arg)
+{
+    struct echo *e = arg;
+    int i;
+
+    e->ret = -1;
+    for (i = 0; i < e->count; i++)
+    {
+        while (libxenvchan_data_ready(e->ctrl) == 0)
+        {
+            if (libxenvchan_wait(e->ctrl))
+                return 0;
+        }
+        e->woken[i] = now_nsec();
+
+        if (libxenvchan_read(e->ctrl, e->buf, 1) != 1)
+            return 0;
+        if (libxenvchan_write(e->ctrl, e->buf, 1) != 1)
+            return 0;
+    }
+
+    e->ret = 0;
+    return 0;
+}
+
+static int connect_loopback(const char *base_path, size_t ring_size, struct libxenvchan **srv,
+                            struct libxenvchan **cli)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/local", base_path);
+
+    *srv = libxenvchan_server_init(XifLogger, 0, path, ring_size, ring_size);
+    if (!*srv)
+    {
+        perror("libxenvchan_server_init");
+        return -1;
+    }
+
+    *cli = libxenvchan_client_init(XifLogger, 0, path);
+    if (!*cli)
+    {
+        perror("libxenvchan_client_init");
+        libxenvchan_close(*srv);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* wakeups are paced by a sleep each, so there are fewer of them */
+#define WAKEUP_MAX 2000
+
+/* send to a blocked waiter, and time until it runs */
+static int wakeup_loopback(const char *base_path, char *buf, uint64_t *samples)
+{
+    struct libxenvchan *srv, *cli;
+    struct latency lat;
+    struct echo e;
+    HANDLE thread;
+    int count = min(iterations, WAKEUP_MAX);
+    uint64_t *sent = samples + count;
+    int i;
+
+    if (connect_loopback(base_path, 0, &srv, &cli))
+        return -1;
+
+    srv->blocking = 0;
+    cli->blocking = 1;
+
+    e.ctrl = srv;
+    e.size = 1;
+    e.count = count;
+    e.buf = buf + 1;
+    e.woken = samples;
+
+    thread = CreateThread(NULL, 0, waiter_thread, &e, 0, NULL);
+    if (!thread)
+    {
+        perror("CreateThread");
+        libxenvchan_close(cli);
+        libxenvchan_close(srv);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        // give the waiter time to block
+        Sleep(0);
+        Sleep(1);
+
+        sent[i] = now_nsec();
+        if (libxenvchan_send(cli, buf, 1) != 1 || libxenvchan_recv(cli, buf, 1) != 1)
+            break;
+    }
+
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    if (i == count && !e.ret)
+    {
+        for (i = 0; i < count; i++)
+            samples[i] -= sent[i];
+
+        summarize(&lat, "wakeup", 1, samples, count);
+        print_latency(&lat);
+    }
+
+    libxenvchan_close(cli);
+    libxenvchan_close(srv);
+    return e.ret;
+}
+
+/*
+ * A nonblocking peek on an empty ring takes the path that asks for a
+ * notification and reads the producer index again; with data ready it
+ * returns after the first read. Calls are timed in batches so that the
+ * timer doesn't swamp them.
+ */
+#define POLL_BATCH 1000
+
+static int poll_loopback(const char *base_path, char *buf, uint64_t *samples)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_iovec iov[2];
+    struct latency lat;
+    int count = max(iterations / POLL_BATCH, 1);
+    uint64_t start;
+    int i, j, ready;
+
+    if (connect_loopback(base_path, 0, &srv, &cli))
+        return -1;
+
+    srv->blocking = 0;
+
+    for (ready = 0; ready <= 1; ready++)
+    {
+        if (ready && libxenvchan_send(cli, buf, 1) != 1)
+            break;
+
+        for (i = 0; i < count; i++)
+        {
+            start = now_nsec();
+            for (j = 0; j < POLL_BATCH; j++)
+                libxenvchan_read_peek(srv, iov);
+            samples[i] = (now_nsec() - start) / POLL_BATCH;
+        }
+
+        summarize(&lat, ready ? "peek_ready" : "peek_empty", 0, samples, count);
+        print_latency(&lat);
+    }
+
+    libxenvchan_close(cli);
+    libxenvchan_close(srv);
+    return ready > 1 ? 0 : -1;
+}
+
+static int latency_server(int domain, const char *path, size_t ring_size, size_t size, char *buf)
+{
+    struct libxenvchan *ctrl;
+    struct echo e;
+
+    ctrl = libxenvchan_server_init(XifLogger, domain, path, ring_size, ring_size);
+    if (!ctrl)
+    {
+        perror("libxenvchan_server_init");
+        return -1;
+    }
+
+    ctrl->blocking = 1;
+    ctrl->spin_usec = spin_usec;
+    if (busy_poll)
+        libxenvchan_set_busy_poll(ctrl, 1);
+
+    e.ctrl = ctrl;
+    e.size = size;
+    e.count = iterations;
+    e.buf = buf;
+    echo_thread(&e);
+
+    libxenvchan_close(ctrl);
+    return e.ret;
+}
+
+static int latency_client(int domain, const char *path, size_t size, char *buf, uint64_t *samples)
+{
+    struct libxenvchan *ctrl = NULL;
+    struct libxenvchan_histograms hist;
+    struct latency lat;
+    int tries;
+    int n;
+
+    for (tries = 0; tries < 1000 && !ctrl; tries++)
+    {
+        ctrl = libxenvchan_client_init(NULL, domain, path);
+        if (!ctrl)
+            Sleep(10);
+    }
+
+    if (!ctrl)
+    {
+        perror("libxenvchan_client_init");
+        return -1;
+    }
+
+    ctrl->blocking = 1;
+    ctrl->spin_usec = spin_usec;
+    if (busy_poll)
+        libxenvchan_set_busy_poll(ctrl, 1);
+    libxenvchan_enable_histograms(ctrl, 1);
+
+    n = ping_pong(ctrl, size, iterations, buf, samples);
+    if (n > 0)
+    {
+        summarize(&lat, "pingpong", size, samples, n);
+        print_latency(&lat);
+
+        // the notify calls this end made, on its own
+        if (size == lat_sizes[0] && !libxenvchan_get_histograms(ctrl, &hist))
+            print_hist("notify_call", &hist.notify);
+    }
+
+    libxenvchan_close(ctrl);
+    return n > 0 ? 0 : -1;
+}
+
+static int run_latency(const char *role, int domain, const char *base_path, size_t ring_size, char *buf, int local)
+{
+    uint64_t *samples;
+    char path[256];
+    int failures = 0;
+    int ret;
+    int m;
+
+    // the wakeup test keeps its send times after the samples
+    samples = malloc(max(iterations, 2 * WAKEUP_MAX) * sizeof(*samples));
+    if (!samples)
+    {
+        perror("malloc");
+        return 1;
+    }
+
+    for (m = 0; m < num_lat_sizes; m++)
+    {
+        if (lat_sizes[m] > ring_size)
+            continue;
+
+        snprintf(path, sizeof(path), "%s/lat-%d", base_path, m);
+
+        if (!strcmp(role, "server"))
+            ret = latency_server(domain, path, ring_size, lat_sizes[m], buf);
+        else
+            ret = latency_client(domain, path, lat_sizes[m], buf, samples);
+
+        if (ret)
+        {
+            fprintf(stderr, "pingpong size %u failed\n", (unsigned)lat_sizes[m]);
+            failures++;
+        }
+    }
+
+    // these need both ends on the same clock
+    if (local)
+    {
+        if (wakeup_loopback(base_path, buf, samples))
+        {
+            fprintf(stderr, "wakeup test failed\n");
+            failures++;
+        }
+
+        if (poll_loopback(base_path, buf, samples))
+        {
+            fprintf(stderr, "poll test failed\n");
+            failures++;
+        }
+    }
+
+    free(samples);
+    return failures;
+}
+
+/*
+ * Start a copy of this program with the options in argv[1] to argv[nopts],
+ * running role over the loopback backend at path.
+ */
+static HANDLE start_peer(char **argv, int nopts, const char *role, const char *path)
+{
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    char exe[MAX_PATH];
+    char cmd[4096];
+    size_t len;
+    int i;
+
+    if (!GetModuleFileNameA(NULL, exe, sizeof(exe)))
+    {
+        perror("GetModuleFileName");
+        return NULL;
+    }
+
+    len = snprintf(cmd, sizeof(cmd), "\"%s\"", exe);
+    for (i = 1; i <= nopts && len < sizeof(cmd); i++)
+        len += snprintf(cmd + len, sizeof(cmd) - len, " \"%s\"", argv[i]);
+    if (len < sizeof(cmd))
+        len += snprintf(cmd + len, sizeof(cmd) - len, " -l %s 0 %s", role, path);
+
+    // _snprintf returns -1, which is huge here, if it doesn't fit
+    if (len >= sizeof(cmd))
+    {
+        fprintf(stderr, "command line too long\n");
+        return NULL;
+    }
+
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    if (!CreateProcessA(exe, cmd, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+    {
+        perror("CreateProcess");
+        return NULL;
+    }
+
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+/* wait for the peer to finish; returns its exit status */
+static DWORD wait_peer(HANDLE peer)
+{
+    DWORD status = 1;
+
+    WaitForSingleObject(peer, INFINITE);
+    GetExitCodeProcess(peer, &status);
+    CloseHandle(peer);
+    return status;
+}
+
+int __cdecl main(int argc, char **argv)
+{
+    struct cell cell;
+    struct result res;
+    const char *role = "loopback";
+    char path[256];
+    char loopback_path[64];
+    HANDLE peer = NULL;
+    int loopback = 0;
+    int nopts;
+    size_t max_msg = 0;
+    char *buf;
+    int domain = 0;
+    const char *base_path = NULL;
+    int regressions = 0;
+    int failures = 0;
+    int index = 0;
+    int latency = 0;
+    int sizes_set = 0, rings_set = 0;
+    int i, r, m, packet, blocking, ret;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (argv[i][1] == 'l')
+        {
+            loopback = 1;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+            usage(argv);
+
+        switch (argv[i][1])
+        {
+        case 'm':
+            latency = !strcmp(argv[++i], "latency");
+            break;
+        case 's':
+            num_msg_sizes = parse_sizes(argv[++i], msg_sizes);
+            sizes_set = 1;
+            break;
+        case 'r':
+            num_ring_sizes = parse_sizes(argv[++i], ring_sizes);
+            rings_set = 1;
+            break;
+        case 'n':
+            iterations = atoi(argv[++i]);
+            break;
+        case 'p':
+            if (!strcmp(argv[++i], "busy"))
+                busy_poll = 1;
+            else
+                spin_usec = atoi(argv[i]);
+            break;
+        case 'b':
+            total_bytes = _strtoui64(argv[++i], NULL, 0);
+            break;
+        case 'f':
+            json = !strcmp(argv[++i], "json");
+            break;
+        case 'c':
+            load_baseline(argv[++i]);
+            break;
+        case 't':
+            threshold = atof(argv[++i]);
+            break;
+        default:
+            usage(argv);
+        }
+    }
+
+    if (!num_msg_sizes || !num_ring_sizes || !total_bytes || iterations < 10)
+        usage(argv);
+
+    nopts = i - 1;
+    if (i < argc)
+    {
+        role = argv[i++];
+        if (strcmp(role, "loopback"))
+        {
+            if (i + 2 > argc || (strcmp(role, "server") && strcmp(role, "client")))
+                usage(argv);
+            domain = atoi(argv[i]);
+            base_path = argv[i + 1];
+        }
+    }
+
+    if (!base_path)
+    {
+        // measure here, as over Xen, with the peer in a process of its own
+        snprintf(loopback_path, sizeof(loopback_path), "bench-%lu", GetCurrentProcessId());
+        base_path = loopback_path;
+        role = latency ? "client" : "server";
+        loopback = 1;
+
+        peer = start_peer(argv, nopts, latency ? "server" : "client", base_path);
+        if (!peer)
+            return 1;
+    }
+
+    if (loopback)
+        libxenvchan_set_backend(libxenvchan_loopback_backend());
+
+    if (latency && sizes_set)
+    {
+        memcpy(lat_sizes, msg_sizes, sizeof(lat_sizes));
+        num_lat_sizes = num_msg_sizes;
+    }
+
+    for (m = 0; m < num_msg_sizes; m++)
+        max_msg = max(max_msg, msg_sizes[m]);
+    for (m = 0; m < num_lat_sizes; m++)
+        max_msg = max(max_msg, lat_sizes[m]);
+
+    // a send and a receive buffer, for the loopback case
+    buf = malloc(max_msg * 2);
+    if (!buf)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memset(buf, 0x5a, max_msg * 2);
+
+    if (latency)
+    {
+        failures = run_latency(role, domain, base_path, rings_set ? ring_sizes[0] : 65536, buf, peer != NULL);
+        if (peer && wait_peer(peer))
+            failures++;
+
+        if (json)
+            printf(rows ? "\n]\n" : "[]\n");
+
+        free(buf);
+        return failures ? 1 : 0;
+    }
+
+    for (packet = 0; packet <= 1; packet++)
+    {
+        for (blocking = 1; blocking >= 0; blocking--)
+        {
+            for (r = 0; r < num_ring_sizes; r++)
+            {
+                for (m = 0; m < num_msg_sizes; m++)
+                {
+                    cell.packet = packet;
+                    cell.blocking = blocking;
+                    cell.ring_size = ring_sizes[r];
+                    cell.msg_size = msg_sizes[m];
+
+                    // packets must fit in the ring
+                    if (packet && cell.msg_size > cell.ring_size)
+                        continue;
+
+                    snprintf(path, sizeof(path), "%s/%d", base_path, index);
+                    index++;
+
+                    if (!strcmp(role, "client"))
+                    {
+                        if (run_client(domain, path, &cell, buf))
+                            failures++;
+                        continue;
+                    }
+
+                    ret = run_server(domain, path, &cell, buf, &res);
+
+                    if (ret)
+                    {
+                        fprintf(stderr, "%s %s ring %u msg %u failed\n", api_name(&cell), mode_name(&cell),
+                                (unsigned)cell.ring_size, (unsigned)cell.msg_size);
+                        failures++;
+                        continue;
+                    }
+
+                    print_result(&res);
+                    regressions += compare_baseline(&res);
+                }
+            }
+        }
+    }
+
+    if (peer && wait_peer(peer))
+        failures++;
+
+    if (json)
+        printf(rows ? "\n]\n" : "[]\n");
+
+    free(buf);
+
+    if (failures)
+        return 1;
+    return regressions ? 2 : 0;
+}
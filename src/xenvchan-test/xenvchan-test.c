@@ -28,6 +28,9 @@
  *
  * This is a test program for libxenvchan.  Communications are in one direction,
  * either server (grant offeror) to client or vice versa.
+ *
+ * With "check", it instead runs behaviour checks of the library over the
+ * loopback backend, with both ends of each vchan in this process.
  */
 
 #include <stdlib.h>
@@ -54,6 +57,8 @@ void XifLogger(XENCONTROL_LOG_LEVEL level, const CHAR *function, const WCHAR *fo
 #define Log(msg, ...)
 #endif
 
+#define snprintf _snprintf
+
 #define perror(msg) fprintf(stderr, __FUNCTION__ ": " msg " failed: error 0x%x\n", GetLastError())
 
 int libxenvchan_write_all(struct libxenvchan *ctrl, char *buf, int size)
@@ -95,7 +100,8 @@ void write_all(HANDLE fd, char *buf, DWORD size)
 void usage(char** argv)
 {
     fprintf(stderr, "usage:\n"
-            "%s [client|server] [read|write] domid nodepath\n", argv[0]);
+            "%s [client|server] [read|write] domid nodepath\n"
+            "%s check\n", argv[0], argv[0]);
     exit(1);
 }
 
@@ -161,6 +167,1236 @@ void writer(struct libxenvchan *ctrl)
     }
 }
 
+#define CHECK_SIZE (1 << 20)
+#define CHECK_RING 4096
+
+/* small writes that fit in the ring together, for counting notifications */
+#define CHECK_WRITES 30
+#define CHECK_WRITE_SIZE 100
+
+#define CHECK_VCHANS 8
+#define CHECK_PART (CHECK_SIZE / CHECK_VCHANS)
+
+/* more than the 1 MiB a ring can have without a grant directory */
+#define CHECK_BIG_RING (4 << 20)
+
+#define CHECK_QUEUES 4
+#define CHECK_TRACE_ENTRIES 1024
+#define CHECK_ASYNC_WRITES 16
+#define CHECK_PRODUCERS 4
+#define CHECK_RECORDS 20000
+#define CHECK_RECORD_SIZE 64
+
+enum {
+    SEND_WRITE,
+    SEND_RESERVE,
+    SEND_MSG,
+    SEND_TRICKLE,
+    RECV_BACK,
+    SEND_RECORDS,
+    SEND_MIXED
+};
+
+/* a thread driving one end of a vchan while the check uses the other */
+struct check_worker {
+    struct libxenvchan *ctrl;
+    int mode;
+    int id;
+    HANDLE thread;
+};
+
+char check_src[CHECK_SIZE];
+char check_dst[CHECK_SIZE];
+char check_back[CHECK_SIZE];
+char check_base[64];
+
+/* sizes sent by the framed message check; the ring takes CHECK_RING - 4 in one fragment */
+const size_t check_msg_sizes[] = { 1, 100, CHECK_RING - 4, CHECK_RING - 3, 3 * CHECK_RING + 17, 5000, 7 };
+#define CHECK_MSGS (sizeof(check_msg_sizes) / sizeof(check_msg_sizes[0]))
+/* this one is received into a buffer that is too small */
+#define CHECK_MSG_TRUNCATED 5
+#define CHECK_MSG_BUFFER 10
+
+struct libxenvchan_backend v1_client_backend;
+struct libxenvchan_backend v1_server_backend;
+
+/* a version 1 client doesn't look for the index page... */
+DWORD v1_store_read(PXENCONTROL_CONTEXT xc, const CHAR *path, DWORD size, CHAR *value)
+{
+    if (strstr(path, "/index-ref"))
+        return ERROR_FILE_NOT_FOUND;
+
+    return libxenvchan_loopback_backend()->store_read(xc, path, size, value);
+}
+
+/* ...and a version 1 server doesn't offer one */
+DWORD v1_store_write(PXENCONTROL_CONTEXT xc, const CHAR *path, const CHAR *value)
+{
+    if (strstr(path, "/index-ref"))
+        return ERROR_SUCCESS;
+
+    return libxenvchan_loopback_backend()->store_write(xc, path, value);
+}
+
+void check_failed(const char *check, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", check, what);
+    exit(1);
+}
+
+void check_data(const char *check)
+{
+    if (memcmp(check_src, check_dst, CHECK_SIZE))
+        check_failed(check, "data mismatch");
+
+    memset(check_dst, 0, CHECK_SIZE);
+}
+
+void check_connect(const char *check, const struct libxenvchan_backend *srv_backend,
+                   const struct libxenvchan_backend *cli_backend, size_t ring_size,
+                   struct libxenvchan **srv, struct libxenvchan **cli)
+{
+    char path[128];
+
+    snprintf(path, sizeof(path), "%s/%s", check_base, check);
+
+    libxenvchan_set_backend(srv_backend);
+    *srv = libxenvchan_server_init(XifLogger, 0, path, ring_size, ring_size);
+    if (!*srv)
+        check_failed(check, "server init failed");
+
+    libxenvchan_set_backend(cli_backend);
+    *cli = libxenvchan_client_init(XifLogger, 0, path);
+    if (!*cli)
+        check_failed(check, "client init failed");
+
+    (*srv)->blocking = 1;
+    (*cli)->blocking = 1;
+}
+
+void check_close(struct libxenvchan *srv, struct libxenvchan *cli)
+{
+    libxenvchan_close(cli);
+    libxenvchan_close(srv);
+}
+
+/* notifications ctrl has signalled to its peer so far */
+uint64_t notifies_sent(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_stats stats;
+
+    libxenvchan_get_stats(ctrl, &stats);
+    return stats.notifies_sent;
+}
+
+/* has the peer signalled ctrl since the last look? */
+int signalled(struct libxenvchan *ctrl)
+{
+    return WaitForSingleObject(libxenvchan_fd_for_select(ctrl), 0) == WAIT_OBJECT_0;
+}
+
+/* send CHECK_WRITES small writes of the start of check_src */
+void send_small(const char *check, struct libxenvchan *ctrl, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (libxenvchan_write(ctrl, check_src + i * CHECK_WRITE_SIZE, CHECK_WRITE_SIZE) != CHECK_WRITE_SIZE)
+            check_failed(check, "write failed");
+    }
+}
+
+/* the small writes are all ready to read at once */
+void recv_small(const char *check, struct libxenvchan *ctrl)
+{
+    size_t size = CHECK_WRITES * CHECK_WRITE_SIZE;
+
+    if (libxenvchan_data_ready(ctrl) != (int)size)
+        check_failed(check, "wrong amount of data ready");
+    if (libxenvchan_read(ctrl, check_dst, size) != (int)size)
+        check_failed(check, "read failed");
+    if (memcmp(check_src, check_dst, size))
+        check_failed(check, "data mismatch");
+}
+
+void send_reserved(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_iovec iov[2];
+    size_t pos = 0;
+    size_t size;
+
+    while (pos < CHECK_SIZE)
+    {
+        /* min() evaluates its arguments twice */
+        size = rand() % (CHECK_RING / 2) + 1;
+        size = min(size, CHECK_SIZE - pos);
+        if (libxenvchan_write_reserve(ctrl, size, iov) != (int)size)
+            check_failed("reserve-publish", "reserve failed");
+
+        memcpy(iov[0].iov_base, check_src + pos, iov[0].iov_len);
+        memcpy(iov[1].iov_base, check_src + pos + iov[0].iov_len, iov[1].iov_len);
+
+        if (libxenvchan_write_publish(ctrl, size) != (int)size)
+            check_failed("reserve-publish", "publish failed");
+        pos += size;
+    }
+}
+
+void send_records(struct libxenvchan *ctrl, int id)
+{
+    char rec[CHECK_RECORD_SIZE];
+    struct libxenvchan_iovec iov[2];
+    int seq;
+    int rv;
+
+    for (seq = 0; seq < CHECK_RECORDS; seq++)
+    {
+        memcpy(rec, &id, sizeof(id));
+        memcpy(rec + 4, &seq, sizeof(seq));
+        memset(rec + 8, (id * 31 + seq) & 0xff, CHECK_RECORD_SIZE - 8);
+
+        /* both send paths reserve space the same way */
+        if (seq & 1)
+        {
+            rv = libxenvchan_send(ctrl, rec, CHECK_RECORD_SIZE);
+        }
+        else
+        {
+            iov[0].iov_base = rec;
+            iov[0].iov_len = 8;
+            iov[1].iov_base = rec + 8;
+            iov[1].iov_len = CHECK_RECORD_SIZE - 8;
+            rv = libxenvchan_sendv(ctrl, iov, 2);
+        }
+
+        if (rv != CHECK_RECORD_SIZE)
+            check_failed("multi-producer", "send failed");
+    }
+}
+
+/* a multi-producer vchan with one thread, taking turns between every way of writing */
+void send_mixed(struct libxenvchan *ctrl)
+{
+    struct libxenvchan_iovec iov[2];
+    size_t pos = 0;
+    size_t size;
+    int rv;
+
+    while (pos < CHECK_SIZE)
+    {
+        /* min() evaluates its arguments twice */
+        size = rand() % (CHECK_RING / 2) + 1;
+        size = min(size, CHECK_SIZE - pos);
+
+        switch (rand() % 3)
+        {
+        case 0:
+            rv = libxenvchan_write_all(ctrl, check_src + pos, (int)size);
+            break;
+
+        case 1:
+            rv = libxenvchan_send(ctrl, check_src + pos, size);
+            break;
+
+        default:
+            rv = libxenvchan_write_reserve(ctrl, size, iov);
+            if (rv != (int)size)
+                break;
+            memcpy(iov[0].iov_base, check_src + pos, iov[0].iov_len);
+            memcpy(iov[1].iov_base, check_src + pos + iov[0].iov_len, iov[1].iov_len);
+            rv = libxenvchan_write_publish(ctrl, size);
+            break;
+        }
+
+        if (rv != (int)size)
+            check_failed("mixed-producer", "write failed");
+        pos += size;
+    }
+}
+
+/* read CHECK_SIZE bytes with plain reads of random size */
+void recv_all(const char *check, struct libxenvchan *ctrl, char *data)
+{
+    size_t pos = 0;
+    size_t size;
+    int rv;
+
+    while (pos < CHECK_SIZE)
+    {
+        size = rand() % (BUFSIZE - 1) + 1;
+        size = min(size, CHECK_SIZE - pos);
+        rv = libxenvchan_read(ctrl, data + pos, size);
+        if (rv <= 0)
+            check_failed(check, "read failed");
+        pos += rv;
+    }
+}
+
+DWORD WINAPI check_worker_thread(LPVOID arg)
+{
+    struct check_worker *w = arg;
+    size_t pos = 0;
+    size_t size;
+    size_t i;
+
+    switch (w->mode)
+    {
+    case SEND_WRITE:
+        while (pos < CHECK_SIZE)
+        {
+            size = rand() % (BUFSIZE - 1) + 1;
+            size = min(size, CHECK_SIZE - pos);
+            pos += libxenvchan_write_all(w->ctrl, check_src + pos, (int)size);
+        }
+        break;
+
+    case SEND_RESERVE:
+        send_reserved(w->ctrl);
+        break;
+
+    case SEND_MSG:
+        for (i = 0; i < CHECK_MSGS; i++)
+        {
+            if (libxenvchan_send_msg(w->ctrl, check_src + i, check_msg_sizes[i]) != (int)check_msg_sizes[i])
+                check_failed("messages", "send failed");
+        }
+        break;
+
+    case SEND_TRICKLE:
+        /* the small writes, one at a time, so that the reader waits in between */
+        while (pos < CHECK_WRITES * CHECK_WRITE_SIZE)
+        {
+            Sleep(1);
+            pos += libxenvchan_write_all(w->ctrl, check_src + pos, CHECK_WRITE_SIZE);
+        }
+        break;
+
+    case RECV_BACK:
+        recv_all("full-duplex", w->ctrl, check_back);
+        break;
+
+    case SEND_RECORDS:
+        send_records(w->ctrl, w->id);
+        break;
+
+    case SEND_MIXED:
+        send_mixed(w->ctrl);
+        break;
+    }
+
+    return 0;
+}
+
+void start_worker(struct check_worker *w, struct libxenvchan *ctrl, int mode, int id)
+{
+    w->ctrl = ctrl;
+    w->mode = mode;
+    w->id = id;
+    w->thread = CreateThread(NULL, 0, check_worker_thread, w, 0, NULL);
+    if (!w->thread)
+    {
+        perror("CreateThread");
+        exit(1);
+    }
+}
+
+void join_worker(struct check_worker *w)
+{
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+}
+
+/* stream CHECK_SIZE bytes from one end to the other with plain reads and writes */
+void check_stream(const char *check, struct libxenvchan *from, struct libxenvchan *to)
+{
+    struct check_worker w;
+
+    start_worker(&w, from, SEND_WRITE, 0);
+    recv_all(check, to, check_dst);
+    join_worker(&w);
+
+    check_data(check);
+}
+
+void check_peek_commit(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_iovec iov[2];
+    struct check_worker w;
+    size_t pos = 0;
+    size_t take;
+    size_t len;
+    int ready;
+
+    check_connect("peek-commit", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    start_worker(&w, srv, SEND_WRITE, 0);
+    while (pos < CHECK_SIZE)
+    {
+        ready = libxenvchan_read_peek(cli, iov);
+        if (ready <= 0 || iov[0].iov_len + iov[1].iov_len != (size_t)ready)
+            check_failed("peek-commit", "bad peek");
+
+        /* consume part of it, so that the next peek starts mid-segment */
+        take = (size_t)(rand() % ready + 1);
+        len = min(take, iov[0].iov_len);
+        memcpy(check_dst + pos, iov[0].iov_base, len);
+        memcpy(check_dst + pos + len, iov[1].iov_base, take - len);
+
+        if (libxenvchan_read_commit(cli, take) != (int)take)
+            check_failed("peek-commit", "commit failed");
+        pos += take;
+    }
+    join_worker(&w);
+
+    check_data("peek-commit");
+    check_close(srv, cli);
+}
+
+void check_reserve_publish(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w;
+
+    check_connect("reserve-publish", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    start_worker(&w, srv, SEND_RESERVE, 0);
+    recv_all("reserve-publish", cli, check_dst);
+    join_worker(&w);
+
+    check_data("reserve-publish");
+    check_close(srv, cli);
+}
+
+void check_cork(void)
+{
+    struct libxenvchan *srv, *cli;
+
+    check_connect("cork", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING, &srv, &cli);
+
+    /* have the client ask for a notification, and forget any from connecting */
+    libxenvchan_data_ready(cli);
+    signalled(cli);
+    libxenvchan_reset_stats(srv);
+
+    libxenvchan_cork(srv);
+    send_small("cork", srv, CHECK_WRITES);
+    if (notifies_sent(srv) || signalled(cli))
+        check_failed("cork", "notified while corked");
+
+    if (libxenvchan_uncork(srv))
+        check_failed("cork", "uncork failed");
+    if (notifies_sent(srv) != 1 || !signalled(cli))
+        check_failed("cork", "not notified once on uncork");
+
+    recv_small("cork", cli);
+    check_close(srv, cli);
+}
+
+void check_moderation(void)
+{
+    struct libxenvchan *srv, *cli;
+
+    check_connect("moderation", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    /* a byte threshold of all the small writes, and a deadline that doesn't come */
+    if (libxenvchan_set_notify_policy(srv, CHECK_WRITES * CHECK_WRITE_SIZE, 10000000))
+        check_failed("moderation", "setting the policy failed");
+
+    libxenvchan_data_ready(cli);
+    signalled(cli);
+    libxenvchan_reset_stats(srv);
+
+    send_small("moderation", srv, CHECK_WRITES - 1);
+    if (notifies_sent(srv) || signalled(cli))
+        check_failed("moderation", "notified below the threshold");
+
+    if (libxenvchan_write(srv, check_src + (CHECK_WRITES - 1) * CHECK_WRITE_SIZE, CHECK_WRITE_SIZE) != CHECK_WRITE_SIZE)
+        check_failed("moderation", "write failed");
+    if (notifies_sent(srv) != 1 || !signalled(cli))
+        check_failed("moderation", "not notified at the threshold");
+
+    recv_small("moderation", cli);
+
+    /* with only a deadline, the end of a stream is left to the timer */
+    if (libxenvchan_set_notify_policy(srv, 0, 2000))
+        check_failed("moderation", "setting the policy failed");
+    check_stream("moderation", srv, cli);
+
+    check_close(srv, cli);
+}
+
+size_t check_reactor_pos[CHECK_VCHANS];
+volatile LONG check_reactor_bytes;
+volatile LONG check_reactor_closed;
+HANDLE check_reactor_done;
+
+void check_reactor_cb(struct libxenvchan *ctrl, int events, void *context)
+{
+    size_t i = (size_t)context;
+    char *dst = check_dst + i * CHECK_PART;
+    int rv;
+
+    /* readiness is level-triggered, so take all there is */
+    if (events & LIBXENVCHAN_READABLE)
+    {
+        while (check_reactor_pos[i] < CHECK_PART &&
+               (rv = libxenvchan_read(ctrl, dst + check_reactor_pos[i], CHECK_PART - check_reactor_pos[i])) > 0)
+        {
+            check_reactor_pos[i] += rv;
+            if (InterlockedExchangeAdd(&check_reactor_bytes, rv) + rv == CHECK_SIZE)
+                SetEvent(check_reactor_done);
+        }
+    }
+
+    if (events & LIBXENVCHAN_CLOSED)
+    {
+        if (InterlockedIncrement(&check_reactor_closed) == CHECK_VCHANS)
+            SetEvent(check_reactor_done);
+    }
+}
+
+void check_reactor(void)
+{
+    struct libxenvchan *srv[CHECK_VCHANS], *cli[CHECK_VCHANS];
+    struct libxenvchan_reactor_entry *entry[CHECK_VCHANS];
+    struct libxenvchan_reactor *reactor;
+    char check[32];
+    size_t pos;
+    size_t i;
+
+    reactor = libxenvchan_reactor_create(2);
+    check_reactor_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!reactor || !check_reactor_done)
+        check_failed("reactor", "setup failed");
+
+    for (i = 0; i < CHECK_VCHANS; i++)
+    {
+        snprintf(check, sizeof(check), "reactor-%d", (int)i);
+        check_connect(check, libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                      &srv[i], &cli[i]);
+
+        cli[i]->blocking = 0;
+        entry[i] = libxenvchan_reactor_add(reactor, cli[i], LIBXENVCHAN_READABLE, check_reactor_cb, (void *)i);
+        if (!entry[i])
+            check_failed("reactor", "add failed");
+    }
+
+    /* feed every vchan a part of the data in turn, so that they are all busy at once */
+    for (pos = 0; pos < CHECK_PART; pos += BUFSIZE)
+    {
+        for (i = 0; i < CHECK_VCHANS; i++)
+            libxenvchan_write_all(srv[i], check_src + i * CHECK_PART + pos, (int)min((size_t)BUFSIZE, CHECK_PART - pos));
+    }
+
+    if (WaitForSingleObject(check_reactor_done, 10000) != WAIT_OBJECT_0)
+        check_failed("reactor", "data was not delivered");
+    check_data("reactor");
+
+    for (i = 0; i < CHECK_VCHANS; i++)
+        libxenvchan_close(srv[i]);
+
+    if (WaitForSingleObject(check_reactor_done, 10000) != WAIT_OBJECT_0)
+        check_failed("reactor", "close was not reported");
+
+    for (i = 0; i < CHECK_VCHANS; i++)
+    {
+        libxenvchan_reactor_remove(entry[i]);
+        libxenvchan_close(cli[i]);
+    }
+
+    libxenvchan_reactor_destroy(reactor);
+    CloseHandle(check_reactor_done);
+}
+
+void check_messages(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w;
+    size_t size;
+    size_t i;
+    int rv;
+
+    check_connect("messages", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    start_worker(&w, srv, SEND_MSG, 0);
+    for (i = 0; i < CHECK_MSGS; i++)
+    {
+        size = i == CHECK_MSG_TRUNCATED ? CHECK_MSG_BUFFER : CHECK_SIZE;
+
+        rv = libxenvchan_recv_msg(cli, check_dst, size);
+        if (rv != (int)check_msg_sizes[i])
+            check_failed("messages", "wrong message length");
+        if (memcmp(check_dst, check_src + i, min(size, check_msg_sizes[i])))
+            check_failed("messages", "data mismatch");
+    }
+    join_worker(&w);
+
+    memset(check_dst, 0, CHECK_SIZE);
+    check_close(srv, cli);
+}
+
+void check_indirect(void)
+{
+    struct libxenvchan *srv, *cli;
+    int i;
+
+    check_connect("indirect", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_BIG_RING,
+                  &srv, &cli);
+
+    if ((1u << cli->read.order) != CHECK_BIG_RING || (1u << cli->write.order) != CHECK_BIG_RING)
+        check_failed("indirect", "wrong ring size");
+
+    /* enough data to go round the rings */
+    for (i = 0; i <= CHECK_BIG_RING / CHECK_SIZE; i++)
+    {
+        check_stream("indirect", srv, cli);
+        check_stream("indirect", cli, srv);
+    }
+
+    check_close(srv, cli);
+}
+
+int ring_is(struct libxenvchan *srv, struct libxenvchan *cli, size_t size)
+{
+    return (1u << cli->read.order) == size && (1u << srv->write.order) == size;
+}
+
+/* keep both ends going until a resize of the server to client ring is done */
+void finish_resize(struct libxenvchan *srv, struct libxenvchan *cli, size_t size)
+{
+    int i;
+
+    for (i = 0; i < 1000 && !ring_is(srv, cli, size); i++)
+    {
+        libxenvchan_poll(srv, 0);
+        libxenvchan_poll(cli, 0);
+        Sleep(1);
+    }
+
+    if (!ring_is(srv, cli, size))
+        check_failed("resize", "ring was not resized");
+}
+
+void check_resize(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w;
+    size_t pos = 0;
+    int grow = 0;
+    int shrink = 0;
+    int rv;
+
+    check_connect("resize", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING, &srv, &cli);
+
+    /*
+     * grow the ring a quarter of the way in and shrink it back once it has
+     * switched, while the data keeps flowing
+     */
+    start_worker(&w, srv, SEND_WRITE, 0);
+    while (pos < CHECK_SIZE)
+    {
+        rv = libxenvchan_read(cli, check_dst + pos, min((size_t)BUFSIZE, CHECK_SIZE - pos));
+        if (rv <= 0)
+            check_failed("resize", "read failed");
+        pos += rv;
+
+        if (!grow && pos >= CHECK_SIZE / 4)
+        {
+            if (libxenvchan_resize(cli, 16 * CHECK_RING, 0))
+                check_failed("resize", "growing failed");
+            grow = 1;
+        }
+
+        if (grow && !shrink && ring_is(srv, cli, 16 * CHECK_RING))
+        {
+            if (libxenvchan_resize(cli, CHECK_RING, 0))
+                check_failed("resize", "shrinking failed");
+            shrink = 1;
+        }
+    }
+    join_worker(&w);
+
+    check_data("resize");
+
+    if (!shrink)
+    {
+        finish_resize(srv, cli, 16 * CHECK_RING);
+        if (libxenvchan_resize(cli, CHECK_RING, 0))
+            check_failed("resize", "shrinking failed");
+    }
+    finish_resize(srv, cli, CHECK_RING);
+
+    /* and the smaller ring still works */
+    check_stream("resize", srv, cli);
+    check_close(srv, cli);
+}
+
+void check_multi_queue(void)
+{
+    struct libxenvchan_mq *srv, *cli;
+    struct check_worker w[CHECK_QUEUES];
+    char path[128];
+    int key;
+    int i;
+
+    snprintf(path, sizeof(path), "%s/multi-queue", check_base);
+    libxenvchan_set_backend(libxenvchan_loopback_backend());
+
+    srv = libxenvchan_mq_server_init(XifLogger, 0, path, CHECK_QUEUES, CHECK_RING, CHECK_RING);
+    if (!srv)
+        check_failed("multi-queue", "server init failed");
+
+    cli = libxenvchan_mq_client_init(XifLogger, 0, path);
+    if (!cli)
+        check_failed("multi-queue", "client init failed");
+
+    if (libxenvchan_mq_num_queues(cli) != CHECK_QUEUES)
+        check_failed("multi-queue", "wrong number of queues");
+
+    /* both sides pick the same queue for a flow */
+    for (key = 0; key < 64; key++)
+    {
+        for (i = 0; i < CHECK_QUEUES; i++)
+        {
+            if (libxenvchan_mq_select(srv, &key, sizeof(key)) == libxenvchan_mq_queue(srv, i))
+                break;
+        }
+
+        if (libxenvchan_mq_select(cli, &key, sizeof(key)) != libxenvchan_mq_queue(cli, i))
+            check_failed("multi-queue", "sides picked different queues");
+    }
+
+    /* every queue streams at once, and gets its own data through */
+    for (i = 0; i < CHECK_QUEUES; i++)
+    {
+        libxenvchan_mq_queue(srv, i)->blocking = 1;
+        libxenvchan_mq_queue(cli, i)->blocking = 1;
+        start_worker(&w[i], libxenvchan_mq_queue(srv, i), SEND_WRITE, i);
+    }
+
+    for (i = 0; i < CHECK_QUEUES; i++)
+    {
+        recv_all("multi-queue", libxenvchan_mq_queue(cli, i), check_dst);
+        check_data("multi-queue");
+    }
+
+    for (i = 0; i < CHECK_QUEUES; i++)
+        join_worker(&w[i]);
+
+    libxenvchan_mq_close(cli);
+    libxenvchan_mq_close(srv);
+}
+
+void check_stats(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_stats tx, rx, zero;
+    size_t size = CHECK_WRITES * CHECK_WRITE_SIZE;
+
+    check_connect("stats", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING, &srv, &cli);
+    libxenvchan_reset_stats(srv);
+    libxenvchan_reset_stats(cli);
+
+    send_small("stats", srv, CHECK_WRITES);
+    recv_small("stats", cli);
+
+    libxenvchan_get_stats(srv, &tx);
+    libxenvchan_get_stats(cli, &rx);
+    if (tx.sends != CHECK_WRITES || tx.bytes_sent != size || tx.max_write_fill != size)
+        check_failed("stats", "wrong send counters");
+    if (rx.recvs != 1 || rx.bytes_received != size || rx.max_read_fill != size)
+        check_failed("stats", "wrong receive counters");
+
+    /* the reader and writer count at the same time without losing any */
+    check_stream("stats", srv, cli);
+    libxenvchan_get_stats(srv, &tx);
+    libxenvchan_get_stats(cli, &rx);
+    if (tx.bytes_sent != size + CHECK_SIZE || rx.bytes_received != size + CHECK_SIZE)
+        check_failed("stats", "wrong byte counts");
+
+    libxenvchan_reset_stats(srv);
+    libxenvchan_get_stats(srv, &tx);
+    memset(&zero, 0, sizeof(zero));
+    if (memcmp(&tx, &zero, sizeof(zero)))
+        check_failed("stats", "reset left counters");
+
+    check_close(srv, cli);
+}
+
+void check_histograms(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_histograms hist, sum;
+    struct libxenvchan_stats stats;
+    struct check_worker w;
+    size_t pos = 0;
+    int on = 1;
+    int rv;
+
+    check_connect("histograms", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_get_histograms(srv, &hist) != -1)
+        check_failed("histograms", "on before being enabled");
+    if (libxenvchan_enable_histograms(srv, 1))
+        check_failed("histograms", "enabling failed");
+
+    libxenvchan_reset_stats(srv);
+    check_stream("histograms", srv, cli);
+
+    if (libxenvchan_get_histograms(srv, &hist))
+        check_failed("histograms", "snapshot failed");
+    libxenvchan_get_stats(srv, &stats);
+
+    /* every notification the writer sent was timed */
+    if (hist.notify.count != stats.notifies_sent)
+        check_failed("histograms", "notify count doesn't match the counters");
+    if (libxenvchan_hist_percentile(&hist.notify, 50) > libxenvchan_hist_percentile(&hist.notify, 100) ||
+        libxenvchan_hist_percentile(&hist.notify, 100) > hist.notify.max)
+        check_failed("histograms", "percentiles out of order");
+
+    memset(&sum, 0, sizeof(sum));
+    libxenvchan_merge_histograms(&sum, &hist);
+    libxenvchan_merge_histograms(&sum, &hist);
+    if (sum.notify.count != 2 * hist.notify.count || sum.wait.sum != 2 * hist.wait.sum)
+        check_failed("histograms", "merge failed");
+
+    /* turn them off and on while the writer records into them */
+    start_worker(&w, srv, SEND_WRITE, 0);
+    while (pos < CHECK_SIZE)
+    {
+        rv = libxenvchan_read(cli, check_dst + pos, min((size_t)BUFSIZE, CHECK_SIZE - pos));
+        if (rv <= 0)
+            check_failed("histograms", "read failed");
+        pos += rv;
+
+        on = !on;
+        if (libxenvchan_enable_histograms(srv, on))
+            check_failed("histograms", "enabling failed");
+    }
+    join_worker(&w);
+    check_data("histograms");
+
+    if (libxenvchan_enable_histograms(srv, 1))
+        check_failed("histograms", "enabling failed");
+    libxenvchan_reset_stats(srv);
+    if (libxenvchan_get_histograms(srv, &hist) || hist.notify.count || hist.wait.count)
+        check_failed("histograms", "reset left samples");
+
+    check_close(srv, cli);
+}
+
+void check_trace(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_trace_header *hdr;
+    struct libxenvchan_trace_entry *e;
+    struct check_worker w;
+    uint32_t prod = 0;
+    uint32_t i;
+    size_t pos = 0;
+    int writes = 0;
+    int round = 0;
+    int size;
+    int rv;
+
+    check_connect("trace", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING, &srv, &cli);
+
+    if (libxenvchan_trace_dump(srv, NULL, 0) != -1)
+        check_failed("trace", "dumped without tracing");
+    if (libxenvchan_trace_enable(srv, CHECK_TRACE_ENTRIES))
+        check_failed("trace", "enabling failed");
+
+    send_small("trace", srv, CHECK_WRITES);
+
+    size = libxenvchan_trace_dump(srv, NULL, 0);
+    hdr = malloc(size);
+    if (!hdr || libxenvchan_trace_dump(srv, hdr, size) != size)
+        check_failed("trace", "dump failed");
+
+    if (hdr->magic != LIBXENVCHAN_TRACE_MAGIC || hdr->version != LIBXENVCHAN_TRACE_VERSION || !hdr->is_server)
+        check_failed("trace", "bad header");
+    if (hdr->count != hdr->recorded || hdr->count > CHECK_TRACE_ENTRIES)
+        check_failed("trace", "wrong number of events");
+
+    /* every write shows up, with the index it published */
+    e = (struct libxenvchan_trace_entry *)(hdr + 1);
+    for (i = 0; i < hdr->count; i++)
+    {
+        if (e[i].type != LIBXENVCHAN_TRACE_WR_PROD)
+            continue;
+
+        if (e[i].value != prod + CHECK_WRITE_SIZE)
+            check_failed("trace", "wrong index traced");
+        prod = e[i].value;
+        writes++;
+    }
+
+    if (writes != CHECK_WRITES)
+        check_failed("trace", "writes missing from the trace");
+    free(hdr);
+    recv_small("trace", cli);
+
+    /* replace and turn off the ring while the writer records into it */
+    start_worker(&w, srv, SEND_WRITE, 0);
+    while (pos < CHECK_SIZE)
+    {
+        rv = libxenvchan_read(cli, check_dst + pos, min((size_t)BUFSIZE, CHECK_SIZE - pos));
+        if (rv <= 0)
+            check_failed("trace", "read failed");
+        pos += rv;
+
+        /* off, a smaller ring and a ring of the first size again */
+        if (libxenvchan_trace_enable(srv, (round++ % 3) * CHECK_TRACE_ENTRIES / 2))
+            check_failed("trace", "enabling failed");
+    }
+    join_worker(&w);
+    check_data("trace");
+
+    if (libxenvchan_trace_enable(srv, 0) || libxenvchan_trace_dump(srv, NULL, 0) != -1)
+        check_failed("trace", "still tracing");
+
+    check_close(srv, cli);
+}
+
+void check_interop(const char *check, const struct libxenvchan_backend *srv_backend,
+                   const struct libxenvchan_backend *cli_backend, int v2)
+{
+    struct libxenvchan *srv, *cli;
+
+    check_connect(check, srv_backend, cli_backend, CHECK_RING, &srv, &cli);
+
+    if (!cli->indexes != !v2)
+        check_failed(check, "wrong index layout");
+
+    check_stream(check, srv, cli);
+    check_stream(check, cli, srv);
+    check_close(srv, cli);
+}
+
+void check_read_watermark(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w;
+    size_t size = CHECK_WRITES * CHECK_WRITE_SIZE;
+
+    check_connect("read-watermark", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_set_read_watermark(cli, (int)size))
+        check_failed("read-watermark", "setting the watermark failed");
+    libxenvchan_reset_stats(srv);
+
+    /* the read only returns once all the small writes are in */
+    start_worker(&w, srv, SEND_TRICKLE, 0);
+    if (libxenvchan_read(cli, check_dst, CHECK_SIZE) != (int)size)
+        check_failed("read-watermark", "read returned below the watermark");
+    join_worker(&w);
+
+    if (memcmp(check_src, check_dst, size))
+        check_failed("read-watermark", "data mismatch");
+
+    /* and the writer only signalled once it was reached */
+    if (notifies_sent(srv) > 1)
+        check_failed("read-watermark", "notified below the watermark");
+
+    check_close(srv, cli);
+}
+
+void check_write_watermark(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_stats stats;
+    struct check_worker w;
+    size_t pos = 0;
+    int rv;
+
+    check_connect("write-watermark", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_set_write_watermark(srv, CHECK_RING / 2))
+        check_failed("write-watermark", "setting the watermark failed");
+    libxenvchan_reset_stats(cli);
+
+    /* drain in small reads, which only signal the writer once half the ring is free */
+    start_worker(&w, srv, SEND_WRITE, 0);
+    while (pos < CHECK_SIZE)
+    {
+        rv = libxenvchan_read(cli, check_dst + pos, min((size_t)64, CHECK_SIZE - pos));
+        if (rv <= 0)
+            check_failed("write-watermark", "read failed");
+        pos += rv;
+    }
+    join_worker(&w);
+    check_data("write-watermark");
+
+    libxenvchan_get_stats(cli, &stats);
+    if (stats.notifies_sent * 8 > stats.recvs)
+        check_failed("write-watermark", "reader notified below the watermark");
+
+    check_close(srv, cli);
+}
+
+void check_busy_poll(void)
+{
+    struct libxenvchan *srv, *cli;
+
+    /* a larger ring, as the ends only take turns when the scheduler says so */
+    check_connect("busy-poll", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), 16 * CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_set_busy_poll(srv, 1) || libxenvchan_set_busy_poll(cli, 1))
+        check_failed("busy-poll", "enabling failed");
+    libxenvchan_reset_stats(srv);
+    libxenvchan_reset_stats(cli);
+
+    check_stream("busy-poll", srv, cli);
+    if (notifies_sent(srv) || notifies_sent(cli))
+        check_failed("busy-poll", "event channel used while polling");
+
+    /* and back to sleeping on the event */
+    if (libxenvchan_set_busy_poll(srv, 0) || libxenvchan_set_busy_poll(cli, 0))
+        check_failed("busy-poll", "disabling failed");
+    check_stream("busy-poll", srv, cli);
+
+    check_close(srv, cli);
+}
+
+size_t check_async_pos;
+HANDLE check_async_done;
+
+void check_async_read_cb(struct libxenvchan *ctrl, int result, void *context)
+{
+    if (result <= 0)
+        check_failed("async", "read failed");
+
+    check_async_pos += result;
+    if (check_async_pos == CHECK_SIZE)
+    {
+        SetEvent(check_async_done);
+        return;
+    }
+
+    /* completions of a vchan come one at a time, so keep one read queued */
+    if (libxenvchan_read_async(ctrl, check_dst + check_async_pos, CHECK_SIZE - check_async_pos,
+                               check_async_read_cb, NULL))
+        check_failed("async", "queueing a read failed");
+}
+
+void check_async(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct libxenvchan_async *engine;
+    LPOVERLAPPED context;
+    ULONG_PTR key;
+    HANDLE port;
+    DWORD bytes;
+    int i;
+
+    check_connect("async", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING, &srv, &cli);
+
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    check_async_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    engine = libxenvchan_async_create(2, port);
+    if (!port || !check_async_done || !engine)
+        check_failed("async", "setup failed");
+
+    if (libxenvchan_async_attach(engine, srv) || libxenvchan_async_attach(engine, cli))
+        check_failed("async", "attach failed");
+
+    /* reads complete through a callback, writes through the completion port */
+    check_async_pos = 0;
+    if (libxenvchan_read_async(cli, check_dst, CHECK_SIZE, check_async_read_cb, NULL))
+        check_failed("async", "queueing a read failed");
+
+    for (i = 0; i < CHECK_ASYNC_WRITES; i++)
+    {
+        if (libxenvchan_write_async(srv, check_src + i * (CHECK_SIZE / CHECK_ASYNC_WRITES),
+                                    CHECK_SIZE / CHECK_ASYNC_WRITES, NULL, (void *)(ULONG_PTR)(i + 1)))
+            check_failed("async", "queueing a write failed");
+    }
+
+    for (i = 0; i < CHECK_ASYNC_WRITES; i++)
+    {
+        if (!GetQueuedCompletionStatus(port, &bytes, &key, &context, 10000))
+            check_failed("async", "write did not complete");
+        if (bytes != CHECK_SIZE / CHECK_ASYNC_WRITES || key != (ULONG_PTR)srv ||
+            context != (LPOVERLAPPED)(ULONG_PTR)(i + 1))
+            check_failed("async", "wrong write completion");
+    }
+
+    if (WaitForSingleObject(check_async_done, 10000) != WAIT_OBJECT_0)
+        check_failed("async", "read did not complete");
+    check_data("async");
+
+    libxenvchan_async_detach(cli);
+    libxenvchan_async_detach(srv);
+    if (!srv->blocking || !cli->blocking)
+        check_failed("async", "blocking mode not restored");
+
+    libxenvchan_async_destroy(engine);
+    CloseHandle(check_async_done);
+    CloseHandle(port);
+
+    /* the vchans are still usable as they were */
+    check_stream("async", cli, srv);
+    check_close(srv, cli);
+}
+
+void check_full_duplex(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w[3];
+
+    check_connect("full-duplex", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    /* each end reads on one thread while another writes, both ways at once */
+    start_worker(&w[0], srv, SEND_WRITE, 0);
+    start_worker(&w[1], cli, SEND_WRITE, 0);
+    start_worker(&w[2], srv, RECV_BACK, 0);
+    recv_all("full-duplex", cli, check_dst);
+    join_worker(&w[0]);
+    join_worker(&w[1]);
+    join_worker(&w[2]);
+
+    check_data("full-duplex");
+    if (memcmp(check_src, check_back, CHECK_SIZE))
+        check_failed("full-duplex", "data mismatch");
+
+    check_close(srv, cli);
+}
+
+void check_multi_producer(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w[CHECK_PRODUCERS];
+    int next[CHECK_PRODUCERS] = { 0 };
+    char rec[CHECK_RECORD_SIZE];
+    int id, seq;
+    int i, k;
+
+    check_connect("multi-producer", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_set_multi_producer(cli, 1))
+        check_failed("multi-producer", "enabling failed");
+
+    for (i = 0; i < CHECK_PRODUCERS; i++)
+        start_worker(&w[i], cli, SEND_RECORDS, i);
+
+    /* records of one producer arrive whole and in the order it sent them */
+    for (i = 0; i < CHECK_PRODUCERS * CHECK_RECORDS; i++)
+    {
+        if (libxenvchan_recv(srv, rec, CHECK_RECORD_SIZE) != CHECK_RECORD_SIZE)
+            check_failed("multi-producer", "recv failed");
+
+        memcpy(&id, rec, sizeof(id));
+        memcpy(&seq, rec + 4, sizeof(seq));
+        if (id < 0 || id >= CHECK_PRODUCERS || seq != next[id])
+            check_failed("multi-producer", "records out of order");
+
+        for (k = 8; k < CHECK_RECORD_SIZE; k++)
+        {
+            if (rec[k] != (char)((id * 31 + seq) & 0xff))
+                check_failed("multi-producer", "record corrupted");
+        }
+        next[id]++;
+    }
+
+    for (i = 0; i < CHECK_PRODUCERS; i++)
+        join_worker(&w[i]);
+
+    check_close(srv, cli);
+}
+
+void check_mixed_producer(void)
+{
+    struct libxenvchan *srv, *cli;
+    struct check_worker w;
+
+    check_connect("mixed-producer", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), CHECK_RING,
+                  &srv, &cli);
+
+    if (libxenvchan_set_multi_producer(cli, 1))
+        check_failed("mixed-producer", "enabling failed");
+
+    start_worker(&w, cli, SEND_MIXED, 0);
+    recv_all("mixed-producer", srv, check_dst);
+    join_worker(&w);
+
+    check_data("mixed-producer");
+    check_close(srv, cli);
+}
+
+/**
+    Run every check over the loopback backend; exits on the first failure.
+    */
+int run_checks(void)
+{
+    int i;
+
+    snprintf(check_base, sizeof(check_base), "xenvchan-test-%lu", GetCurrentProcessId());
+    for (i = 0; i < CHECK_SIZE; i++)
+        check_src[i] = (char)rand();
+
+    v1_client_backend = *libxenvchan_loopback_backend();
+    v1_client_backend.store_read = v1_store_read;
+    v1_server_backend = *libxenvchan_loopback_backend();
+    v1_server_backend.store_write = v1_store_write;
+
+    check_peek_commit();
+    fprintf(stderr, "peek-commit: ok\n");
+    check_reserve_publish();
+    fprintf(stderr, "reserve-publish: ok\n");
+    check_cork();
+    fprintf(stderr, "cork: ok\n");
+    check_moderation();
+    fprintf(stderr, "moderation: ok\n");
+    check_reactor();
+    fprintf(stderr, "reactor: ok\n");
+    check_messages();
+    fprintf(stderr, "messages: ok\n");
+    check_indirect();
+    fprintf(stderr, "indirect: ok\n");
+    check_resize();
+    fprintf(stderr, "resize: ok\n");
+    check_multi_queue();
+    fprintf(stderr, "multi-queue: ok\n");
+    check_stats();
+    fprintf(stderr, "stats: ok\n");
+    check_histograms();
+    fprintf(stderr, "histograms: ok\n");
+    check_trace();
+    fprintf(stderr, "trace: ok\n");
+    check_interop("interop-v2-v2", libxenvchan_loopback_backend(), libxenvchan_loopback_backend(), 1);
+    check_interop("interop-v2-v1", libxenvchan_loopback_backend(), &v1_client_backend, 0);
+    check_interop("interop-v1-v2", &v1_server_backend, libxenvchan_loopback_backend(), 0);
+    fprintf(stderr, "interop: ok\n");
+    check_read_watermark();
+    fprintf(stderr, "read-watermark: ok\n");
+    check_write_watermark();
+    fprintf(stderr, "write-watermark: ok\n");
+    check_busy_poll();
+    fprintf(stderr, "busy-poll: ok\n");
+    check_async();
+    fprintf(stderr, "async: ok\n");
+    check_full_duplex();
+    fprintf(stderr, "full-duplex: ok\n");
+    check_multi_producer();
+    fprintf(stderr, "multi-producer: ok\n");
+    check_mixed_producer();
+    fprintf(stderr, "mixed-producer: ok\n");
+
+    return 0;
+}
+
 /**
     Simple libxenvchan application, both client and server.
     One side does writing, the other side does reading; both from
@@ -172,6 +1408,13 @@ int __cdecl main(int argc, char **argv)
     struct libxenvchan *ctrl = 0;
     int wr = 0;
 
+    if (argc == 2 && !strcmp(argv[1], "check"))
+    {
+        srand(seed);
+        fprintf(stderr, "seed=%d\n", seed);
+        return run_checks();
+    }
+
     if (argc < 4)
         usage(argv);
     
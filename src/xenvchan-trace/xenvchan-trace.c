@@ -0,0 +1,207 @@
+/**
+ * @file
+ * @section LICENSE
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ *
+ * @section DESCRIPTION
+ *
+ * This program decodes a trace ring dump saved from libxenvchan_trace_dump()
+ * into a timeline of index transitions, notifications and waits.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#include <libxenvchan.h>
+
+void usage(char** argv)
+{
+    fprintf(stderr, "usage:\n"
+            "%s dumpfile [stall_usec]\n"
+            "  stall_usec: mark gaps between events longer than this (default 1000)\n", argv[0]);
+    exit(1);
+}
+
+static const char *event_name(uint8_t type)
+{
+    switch (type)
+    {
+    case LIBXENVCHAN_TRACE_WR_PROD: return "wr_prod";
+    case LIBXENVCHAN_TRACE_RD_CONS: return "rd_cons";
+    case LIBXENVCHAN_TRACE_REQUEST: return "request";
+    case LIBXENVCHAN_TRACE_NOTIFY:  return "notify";
+    case LIBXENVCHAN_TRACE_SKIP:    return "skip";
+    case LIBXENVCHAN_TRACE_WAIT:    return "wait";
+    case LIBXENVCHAN_TRACE_WAKE:    return "wake";
+    default:                        return "?";
+    }
+}
+
+static const char *bit_name(uint8_t bit)
+{
+    switch (bit)
+    {
+    case VCHAN_NOTIFY_WRITE: return "write";
+    case VCHAN_NOTIFY_READ:  return "read";
+    default:                 return "?";
+    }
+}
+
+/* index values seen last, to show how far each update moved them */
+static uint32_t last_prod, last_cons;
+static int have_prod, have_cons;
+
+static void print_event(const struct libxenvchan_trace_entry *e)
+{
+    switch (e->type)
+    {
+    case LIBXENVCHAN_TRACE_WR_PROD:
+        printf("prod=%u", e->value);
+        if (have_prod)
+            printf(" (+%u)", e->value - last_prod);
+        last_prod = e->value;
+        have_prod = 1;
+        break;
+    case LIBXENVCHAN_TRACE_RD_CONS:
+        printf("cons=%u", e->value);
+        if (have_cons)
+            printf(" (+%u)", e->value - last_cons);
+        last_cons = e->value;
+        have_cons = 1;
+        break;
+    case LIBXENVCHAN_TRACE_REQUEST:
+        printf("bit=%s %s=%u", bit_name(e->arg),
+               e->arg == VCHAN_NOTIFY_WRITE ? "rd_prod" : "wr_cons", e->value);
+        break;
+    case LIBXENVCHAN_TRACE_NOTIFY:
+    case LIBXENVCHAN_TRACE_SKIP:
+        printf("bit=%s", bit_name(e->arg));
+        break;
+    case LIBXENVCHAN_TRACE_WAIT:
+        printf("rd_prod=%u", e->value);
+        break;
+    case LIBXENVCHAN_TRACE_WAKE:
+        printf("rd_prod=%u%s", e->value, e->arg ? " spurious" : "");
+        break;
+    }
+}
+
+int __cdecl main(int argc, char **argv)
+{
+    struct libxenvchan_trace_header hdr;
+    struct libxenvchan_trace_entry *entries;
+    uint64_t counts[256] = { 0 };
+    double usec, prev_usec = 0, stall_usec = 1000, max_gap = 0;
+    uint32_t i, stalls = 0;
+    uint64_t lost = 0;
+    uint16_t missing;
+    FILE *f;
+
+    if (argc < 2)
+        usage(argv);
+
+    if (argc > 2)
+        stall_usec = atof(argv[2]);
+
+    f = fopen(argv[1], "rb");
+    if (!f)
+    {
+        fprintf(stderr, "can't open %s\n", argv[1]);
+        exit(1);
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != LIBXENVCHAN_TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s is not a vchan trace dump\n", argv[1]);
+        exit(1);
+    }
+
+    if (hdr.version != LIBXENVCHAN_TRACE_VERSION)
+    {
+        fprintf(stderr, "unsupported trace version %u\n", hdr.version);
+        exit(1);
+    }
+
+    entries = malloc((size_t)hdr.count * sizeof(*entries) + 1);
+    if (!entries)
+    {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    hdr.count = (uint32_t)fread(entries, sizeof(*entries), hdr.count, f);
+    fclose(f);
+
+    printf("# %s side, read ring %u, write ring %u\n",
+           hdr.is_server ? "server" : "client", hdr.read_size, hdr.write_size);
+    printf("# %u of %llu events recorded", hdr.count, hdr.recorded);
+    if (hdr.tsc_freq)
+        printf(", tsc %.0f MHz\n", hdr.tsc_freq / 1e6);
+    else
+        printf(", tsc frequency unknown, times in ticks\n");
+
+    if (!hdr.count)
+        return 0;
+
+    printf("#%13s %12s  %-8s\n", "time(us)", "delta(us)", "event");
+
+    for (i = 0; i < hdr.count; i++)
+    {
+        usec = (double)(entries[i].tsc - entries[0].tsc);
+        if (hdr.tsc_freq)
+            usec = usec * 1e6 / hdr.tsc_freq;
+
+        if (i > 0 && usec - prev_usec > max_gap)
+            max_gap = usec - prev_usec;
+
+        /* entries are numbered in a dump; a jump means events were dropped */
+        if (i > 0)
+        {
+            missing = (uint16_t)(entries[i].seq - entries[i - 1].seq - 1);
+            if (missing)
+            {
+                printf("# ---- %u events lost ----\n", missing);
+                lost += missing;
+            }
+        }
+
+        if (i > 0 && usec - prev_usec >= stall_usec)
+        {
+            printf("# ---- stalled %.3f us ----\n", usec - prev_usec);
+            stalls++;
+        }
+
+        printf("%14.3f %12.3f  %-8s ", usec, i > 0 ? usec - prev_usec : 0.0, event_name(entries[i].type));
+        print_event(&entries[i]);
+        printf("\n");
+
+        counts[entries[i].type]++;
+        prev_usec = usec;
+    }
+
+    printf("# summary: %.3f us, longest gap %.3f us, %u stalls, %llu events lost\n", prev_usec, max_gap, stalls, lost);
+    for (i = 1; i < 256; i++)
+    {
+        if (counts[i])
+            printf("#   %-8s %llu\n", event_name((uint8_t)i), counts[i]);
+    }
+
+    free(entries);
+    return 0;
+}